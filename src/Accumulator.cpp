@@ -0,0 +1,287 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Accumulator.h"
+#include "BinaryIO.h"
+#include "HranolException.h"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+namespace
+{
+    // Maximal pixel value of integer image depth, 0 for other depths
+    double max_pixel_value(int depth)
+    {
+        switch (depth)
+        {
+        case CV_8U:
+            return 255;
+        case CV_16U:
+            return 65535;
+        default:
+            return 0;
+        }
+    }
+
+    // Number of images with given max pixel value an accumulator of given depth can sum exactly
+    size_t capacity(int acc_depth, double max_value)
+    {
+        switch (acc_depth)
+        {
+        case CV_16U:
+            return (size_t) (65535 / max_value);
+        case CV_32S:
+            return (size_t) (INT_MAX / max_value);
+        default:
+            // 2^53, integers are exact in double up to this value
+            return (size_t) (9007199254740992.0 / max_value);
+        }
+    }
+
+    // Narrowest accumulator depth that can hold sum of count images
+    int acc_depth_for(size_t count, double max_value)
+    {
+        for (int depth : { CV_16U, CV_32S })
+            if (count <= capacity(depth, max_value))
+                return depth;
+        return CV_64F;
+    }
+
+    // acc += img, element by element. The loop is vectorized by compiler.
+    template< typename TI, typename TA>
+    void add_rows(const cv::Mat & img, cv::Mat & acc)
+    {
+        int n = img.cols * img.channels();
+        for (int r = 0; r < img.rows; ++r)
+        {
+            const TI * p = img.ptr< TI>(r);
+            TA * a = acc.ptr< TA>(r);
+            for (int c = 0; c < n; ++c)
+                a[c] += (TA) p[c];
+        }
+    }
+
+    // acc -= img, element by element
+    template< typename TI, typename TA>
+    void subtract_rows(const cv::Mat & img, cv::Mat & acc)
+    {
+        int n = img.cols * img.channels();
+        for (int r = 0; r < img.rows; ++r)
+        {
+            const TI * p = img.ptr< TI>(r);
+            TA * a = acc.ptr< TA>(r);
+            for (int c = 0; c < n; ++c)
+                a[c] -= (TA) p[c];
+        }
+    }
+
+    template< typename TI>
+    void add_img(const cv::Mat & img, cv::Mat & acc)
+    {
+        switch (acc.depth())
+        {
+        case CV_16U:
+            add_rows< TI, ushort>(img, acc);
+            break;
+        case CV_32S:
+            add_rows< TI, int>(img, acc);
+            break;
+        default:
+            add_rows< TI, double>(img, acc);
+            break;
+        }
+    }
+
+    template< typename TI>
+    void subtract_img(const cv::Mat & img, cv::Mat & acc)
+    {
+        switch (acc.depth())
+        {
+        case CV_16U:
+            subtract_rows< TI, ushort>(img, acc);
+            break;
+        case CV_32S:
+            subtract_rows< TI, int>(img, acc);
+            break;
+        default:
+            subtract_rows< TI, double>(img, acc);
+            break;
+        }
+    }
+}
+
+void Accumulator::add(const cv::Mat & img)
+{
+    ensure_capacity_(count_ + 1, img);
+
+    switch (sum_.depth())
+    {
+    case CV_32F:
+        // Not an integer image
+        cv::accumulate(img, sum_);
+        break;
+    default:
+        if (img.depth() == CV_8U)
+            add_img< uchar>(img, sum_);
+        else
+            add_img< ushort>(img, sum_);
+        break;
+    }
+    ++count_;
+}
+
+void Accumulator::subtract(const cv::Mat & img)
+{
+    if (count_ == 0)
+        throw HranolRuntimeException("Subtracting image from empty accumulator.");
+    if (img.size() != sum_.size() || img.channels() != sum_.channels() || img.depth() != img_depth_)
+        throw HranolRuntimeException("Size, number of channels or depth of subtracted image and accumulator did not match.");
+
+    switch (sum_.depth())
+    {
+    case CV_32F:
+        cv::subtract(sum_, img, sum_, cv::noArray(), sum_.type());
+        break;
+    default:
+        if (img.depth() == CV_8U)
+            subtract_img< uchar>(img, sum_);
+        else
+            subtract_img< ushort>(img, sum_);
+        break;
+    }
+    --count_;
+}
+
+void Accumulator::merge(const Accumulator & other)
+{
+    if (other.count_ == 0)
+        return;
+
+    if (count_ == 0)
+    {
+        sum_ = other.sum_.clone();
+        count_ = other.count_;
+        img_depth_ = other.img_depth_;
+        return;
+    }
+
+    if (other.sum_.size() != sum_.size() || other.sum_.channels() != sum_.channels())
+        throw HranolRuntimeException("Size or number of channels of merged accumulators did not match.");
+    if (other.img_depth_ != img_depth_)
+        throw HranolRuntimeException("Depth of accumulated images did not match.");
+
+    if (sum_.depth() != CV_32F)
+    {
+        // Integer sums: widen to the depth that can hold the total, but never narrower
+        // than any of the two accumulators (CV_16U < CV_32S < CV_64F)
+        int depth = acc_depth_for(count_ + other.count_, max_pixel_value(img_depth_));
+        depth = max({ depth, sum_.depth(), other.sum_.depth() });
+
+        if (sum_.depth() != depth)
+            sum_.convertTo(sum_, CV_MAKETYPE(depth, sum_.channels()));
+    }
+
+    if (other.sum_.type() == sum_.type())
+        sum_ += other.sum_;
+    else
+    {
+        cv::Mat other_sum;
+        other.sum_.convertTo(other_sum, sum_.type());
+        sum_ += other_sum;
+    }
+    count_ += other.count_;
+}
+
+void Accumulator::clear()
+{
+    sum_ = cv::Mat();
+    count_ = 0;
+    expected_count_ = 0;
+    img_depth_ = -1;
+}
+
+void Accumulator::save(std::ostream & out) const
+{
+    write_value< uint64_t>(out, count_);
+    write_value< int32_t>(out, img_depth_);
+    if (count_ != 0)
+        write_mat(out, sum_);
+}
+
+bool Accumulator::load(std::istream & in)
+{
+    clear();
+
+    uint64_t count;
+    int32_t depth;
+    if (!read_value(in, count) || !read_value(in, depth))
+        return false;
+    // Images are 8-bit or 16-bit, the sum must be wide enough for count of them
+    if (depth != CV_8U && depth != CV_16U && !(count == 0 && depth == -1))
+        return false;
+    if (count != 0 && (!read_mat(in, sum_) ||
+        (sum_.depth() != CV_16U && sum_.depth() != CV_32S && sum_.depth() != CV_64F) ||
+        sum_.depth() < acc_depth_for((size_t) count, max_pixel_value(depth))))
+    {
+        sum_ = cv::Mat();
+        return false;
+    }
+
+    count_ = (size_t) count;
+    img_depth_ = depth;
+    return true;
+}
+
+cv::Mat Accumulator::factored_mean(double factor, int depth) const
+{
+    cv::Mat ret, scratch;
+    factored_mean(factor, depth, ret, scratch);
+    return ret;
+}
+
+void Accumulator::factored_mean(double factor, int depth, cv::Mat & dst, cv::Mat & scratch) const
+{
+    if (count_ == 0)
+    {
+        dst.release();
+        return;
+    }
+
+    // Float sum is copied as well, scaling must not overwrite sum_
+    sum_.convertTo(scratch, CV_MAKETYPE(CV_32F, sum_.channels()));
+
+    // Intention: factor * (sum_ / count_)
+    // If the above equation was used, sum_ would have to be traversed twice.
+    // This is what scratch / (count_ / factor) evaluates to, without a temporary.
+    scratch.convertTo(scratch, -1, 1.0 / (count_ / factor));
+    scratch.convertTo(dst, CV_MAKETYPE(depth, sum_.channels()));
+}
+
+void Accumulator::ensure_capacity_(size_t count, const cv::Mat & img)
+{
+    double max_value = max_pixel_value(img.depth());
+
+    if (sum_.empty())
+    {
+        img_depth_ = img.depth();
+        // Integer accumulator is sized for all expected images, so that it does not need widening
+        int depth = (max_value == 0) ? CV_32F : acc_depth_for(max(count, expected_count_), max_value);
+        sum_ = cv::Mat::zeros(img.rows, img.cols, CV_MAKETYPE(depth, img.channels()));
+        return;
+    }
+
+    if (img.size() != sum_.size() || img.channels() != sum_.channels())
+        throw HranolRuntimeException("Size or number of channels of accumulated image and accumulator did not match.");
+    if (img.depth() != img_depth_)
+        throw HranolRuntimeException("Depth of accumulated images did not match.");
+
+    if (max_value != 0 && count > capacity(sum_.depth(), max_value))
+        sum_.convertTo(sum_, CV_MAKETYPE(acc_depth_for(count, max_value), sum_.channels()));
+}
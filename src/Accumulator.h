@@ -0,0 +1,81 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include "opencv2/core/mat.hpp"
+
+#include <istream>
+#include <ostream>
+
+
+// Accumulator holds per-pixel sum of images. Images with integer pixels (8-bit and 16-bit)
+// are summed in an integer matrix that is only as wide as the number of images requires:
+//   - CV_16U for 8-bit images while the sum fits (up to 257 images),
+//   - CV_32S (up to 8 421 504 8-bit or 32 767 16-bit images),
+//   - CV_64F for even more images.
+// Integer sums are exact and need less memory traffic than float accumulation. The width is
+// picked from the expected number of images (see reserve) and widened on the fly if more
+// images arrive. Other images are summed in CV_32F as with cv::accumulate.
+class Accumulator
+{
+    cv::Mat sum_;
+    size_t count_;
+    size_t expected_count_;
+    // Depth of accumulated images, -1 if no image was added yet
+    int img_depth_;
+
+public:
+    Accumulator() : count_(0), expected_count_(0), img_depth_(-1) {}
+
+    // Hint: number of images that will be added
+    void reserve(size_t expected_count) {
+        expected_count_ = expected_count;
+    }
+
+    void add(const cv::Mat & img);
+    // Removes previously added image from the sum
+    void subtract(const cv::Mat & img);
+    // Adds sums and counts of other accumulator
+    void merge(const Accumulator & other);
+    void clear();
+
+    // Writes the sum and the count, so that the accumulator can be restored with load
+    void save(std::ostream & out) const;
+    // Replaces the content with data written by save, returns false if the data are invalid
+    bool load(std::istream & in);
+
+    size_t count() const {
+        return count_;
+    }
+
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    // Depth of accumulated images, -1 if no image was added yet
+    int depth() const {
+        return img_depth_;
+    }
+
+    const cv::Mat & sum() const {
+        return sum_;
+    }
+
+    // Returns factor * (sum / count) converted to given depth (with rounding and saturation).
+    // It is computed in float exactly as it was computed from float accumulator, so the
+    // result does not depend on the accumulator width.
+    cv::Mat factored_mean(double factor, int depth) const;
+    // Same as above, the result is written to dst and scratch holds the float mean. Buffers of
+    // dst and scratch are reused, so repeated calls do not allocate.
+    void factored_mean(double factor, int depth, cv::Mat & dst, cv::Mat & scratch) const;
+
+private:
+    // Allocates sum_ for images like img, or widens it, so that it can hold sum of count images
+    void ensure_capacity_(size_t count, const cv::Mat & img);
+};
+
+#endif // ACCUMULATOR_H
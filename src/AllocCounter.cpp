@@ -0,0 +1,128 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "AllocCounter.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace
+{
+    // Number of heap allocations made so far
+    atomic< size_t> alloc_count(0);
+
+    bool is_power_of_two(size_t val)
+    {
+        return val != 0 && (val & (val - 1)) == 0;
+    }
+}
+
+size_t heap_allocations()
+{
+    return alloc_count;
+}
+
+// Allocations are counted by replacing the allocator. With glibc the malloc family is replaced,
+// which catches allocations of OpenCV (cv::fastMalloc) as well as operator new. Elsewhere only
+// the plain operator new is counted.
+#if defined(__GLIBC__)
+extern "C"
+{
+    void * __libc_malloc(size_t size);
+    void * __libc_calloc(size_t count, size_t size);
+    void * __libc_realloc(void * p, size_t size);
+    void * __libc_memalign(size_t alignment, size_t size);
+    void * __libc_valloc(size_t size);
+    void * __libc_pvalloc(size_t size);
+    void __libc_free(void * p);
+
+    void * malloc(size_t size)
+    {
+        ++alloc_count;
+        return __libc_malloc(size);
+    }
+
+    void * calloc(size_t count, size_t size)
+    {
+        ++alloc_count;
+        return __libc_calloc(count, size);
+    }
+
+    void * realloc(void * p, size_t size)
+    {
+        ++alloc_count;
+        return __libc_realloc(p, size);
+    }
+
+    void * memalign(size_t alignment, size_t size)
+    {
+        ++alloc_count;
+        return __libc_memalign(alignment, size);
+    }
+
+    void * aligned_alloc(size_t alignment, size_t size)
+    {
+        // __libc_memalign would round an invalid alignment up instead of failing
+        if (!is_power_of_two(alignment))
+        {
+            errno = EINVAL;
+            return nullptr;
+        }
+        ++alloc_count;
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void ** p, size_t alignment, size_t size)
+    {
+        if (!is_power_of_two(alignment) || alignment % sizeof(void *) != 0)
+            return EINVAL;
+        ++alloc_count;
+        void * ret = __libc_memalign(alignment, size);
+        if (ret == nullptr)
+            return ENOMEM;
+        *p = ret;
+        return 0;
+    }
+
+    void * valloc(size_t size)
+    {
+        ++alloc_count;
+        return __libc_valloc(size);
+    }
+
+    void * pvalloc(size_t size)
+    {
+        ++alloc_count;
+        return __libc_pvalloc(size);
+    }
+
+    void free(void * p)
+    {
+        __libc_free(p);
+    }
+}
+#else
+void * operator new(size_t size)
+{
+    ++alloc_count;
+    if (void * p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    std::free(p);
+}
+#endif
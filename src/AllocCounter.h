@@ -0,0 +1,18 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstddef>
+
+
+// Number of heap allocations made by the whole process so far.
+// AllocCounter.cpp replaces the allocator of the program it is linked into, so it is part of
+// the executables (hranol, hranol_bench), not of libhranol. Programs using libhranol keep
+// their own allocator.
+size_t heap_allocations();
+
+#endif // ALLOC_COUNTER_H
@@ -0,0 +1,91 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include "opencv2/core/mat.hpp"
+
+#include <cstdint>
+#include <ios>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+
+
+// Helpers for files holding precomputed data. Values are stored in the byte order of the host,
+// the files are meant to be read back on the same kind of machine.
+
+template< typename T>
+void write_value(std::ostream & out, T val)
+{
+    static_assert(std::is_trivially_copyable< T>::value, "Only plain values can be written");
+    out.write((const char *) &val, sizeof(T));
+}
+
+// Returns false if the stream ended or failed
+template< typename T>
+bool read_value(std::istream & in, T & val)
+{
+    static_assert(std::is_trivially_copyable< T>::value, "Only plain values can be read");
+    return (bool) in.read((char *) &val, sizeof(T));
+}
+
+// Number of bytes left in the stream, -1 if the stream can't tell (e.g. it is not seekable)
+inline std::streamoff remaining_bytes(std::istream & in)
+{
+    std::streampos pos = in.tellg();
+    if (pos == std::streampos(-1))
+        return -1;
+
+    in.seekg(0, std::ios::end);
+    std::streampos end = in.tellg();
+    in.clear();
+    in.seekg(pos);
+    return (end == std::streampos(-1)) ? -1 : (std::streamoff) (end - pos);
+}
+
+// Returns true if the stream holds at least count elements of elem_size bytes, streams that can't
+// tell are trusted. Sizes read from a file are checked before anything is allocated for them.
+inline bool has_elements(std::istream & in, uint64_t count, size_t elem_size)
+{
+    std::streamoff left = remaining_bytes(in);
+    return left < 0 || count <= (uint64_t) left / elem_size;
+}
+
+// Writes type, size and data of a 2D matrix
+inline void write_mat(std::ostream & out, const cv::Mat & m)
+{
+    write_value< int32_t>(out, m.type());
+    write_value< int32_t>(out, m.rows);
+    write_value< int32_t>(out, m.cols);
+
+    size_t row_bytes = m.cols * m.elemSize();
+    for (int r = 0; r < m.rows; ++r)
+        out.write((const char *) m.ptr(r), (std::streamsize) row_bytes);
+}
+
+// Reads matrix written by write_mat, returns false if the stream ended or failed, or if the
+// type or size is not valid
+inline bool read_mat(std::istream & in, cv::Mat & m)
+{
+    int32_t type, rows, cols;
+    if (!read_value(in, type) || !read_value(in, rows) || !read_value(in, cols) || rows < 0 || cols < 0)
+        return false;
+    if (type != CV_MAT_TYPE(type) || CV_MAT_DEPTH(type) > CV_64F)
+        return false;
+    if (!has_elements(in, (uint64_t) rows * (uint64_t) cols, CV_ELEM_SIZE(type)))
+        return false;
+
+    m = cv::Mat(rows, cols, type);
+    size_t row_bytes = m.cols * m.elemSize();
+    for (int r = 0; r < m.rows; ++r)
+        if (!in.read((char *) m.ptr(r), (std::streamsize) row_bytes))
+            return false;
+
+    return true;
+}
+
+#endif // BINARY_IO_H
@@ -0,0 +1,83 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+// BoundedQueue is a blocking FIFO queue holding at most capacity_ items. It connects
+// producer and consumer threads: push() blocks while the queue is full and pop() blocks
+// while it is empty.
+//
+// After close() no more items are accepted (push() returns false) and pop() returns false
+// once the queue is drained.
+template< typename T>
+class BoundedQueue
+{
+    std::deque< T> items_;
+    size_t capacity_;
+    bool closed_;
+
+    std::mutex mtx_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_((capacity == 0) ? 1 : capacity), closed_(false)
+    {}
+
+    bool push(T item)
+    {
+        std::unique_lock< std::mutex> lock(mtx_);
+        not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T & item)
+    {
+        std::unique_lock< std::mutex> lock(mtx_);
+        not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard< std::mutex> lock(mtx_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    // Closes the queue and returns all items that were not popped yet, so that the caller
+    // can clean them up
+    std::deque< T> abort()
+    {
+        std::lock_guard< std::mutex> lock(mtx_);
+        closed_ = true;
+        std::deque< T> ret;
+        ret.swap(items_);
+        not_full_.notify_all();
+        not_empty_.notify_all();
+        return ret;
+    }
+};
+
+#endif // BOUNDED_QUEUE_H
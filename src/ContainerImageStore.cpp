@@ -0,0 +1,329 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "ContainerImageStore.h"
+#include "HranolException.h"
+
+#include "opencv2/imgcodecs.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <string>
+#include <system_error>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    // Most pages decoded ahead of the requested ones and kept until they are loaded
+    const size_t MAX_AHEAD = 16;
+}
+
+fs::path ContainerImageStore::frame_name_(size_t i) const
+{
+    // Indices are padded to at least 6 digits so that frames sort by name
+    string idx = to_string(i);
+    size_t width = max< size_t>(6, to_string(frame_count_ - 1).size());
+    if (idx.size() < width)
+        idx.insert(0, width - idx.size(), '0');
+
+    return get_container().stem().string() + "_" + idx + ".tif";
+}
+
+string ContainerImageStore::get_img_path(size_t i) const
+{
+    assert(i < size());
+    return get_container().string() + " [frame " + to_string(i) + "]";
+}
+
+bool ContainerImageStore::is_tiff(const fs::path & container)
+{
+    string ext = container.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char) tolower(c); });
+    return ext == ".tif" || ext == ".tiff";
+}
+
+unique_ptr< ContainerImageStore> ContainerImageStore::open(fs::path dest, fs::path container)
+{
+    if (is_tiff(container))
+        return make_unique< TiffStackImageStore>(std::move(dest), std::move(container));
+
+    return make_unique< RawStackImageStore>(std::move(dest), std::move(container));
+}
+
+
+RawStackImageStore::RawStackImageStore(fs::path dest, fs::path container)
+    : ContainerImageStore(std::move(dest), std::move(container)), type_(0)
+{
+    const fs::path & path = get_container();
+    file_ = make_unique< MappedFile>(path, MappedFile::COPY_ON_WRITE);
+
+    if (!header_.parse(file_->data(), file_->size()))
+        throw HranolRuntimeException("File \"" + path.string() + "\" is not a raw stack.");
+
+    type_ = (int) header_.type;
+    if (type_ != CV_8UC1 && type_ != CV_16UC1)
+        throw HranolRuntimeException("Raw stack \"" + path.string() + "\" has unsupported frame type " + to_string(type_) + ".");
+
+    // Frames are indexed by int, the frame size then fits into 64 bits
+    if (header_.width == 0 || header_.height == 0 || header_.width > INT_MAX || header_.height > INT_MAX)
+        throw HranolRuntimeException("Raw stack \"" + path.string() + "\" has invalid frame size " +
+            to_string(header_.width) + " x " + to_string(header_.height) + ".");
+
+    uint64_t frame_bytes = (uint64_t) header_.width * header_.height * CV_ELEM_SIZE(type_);
+    if (header_.frame_stride < frame_bytes)
+        throw HranolRuntimeException("Raw stack \"" + path.string() + "\" has frame stride smaller than the frame size.");
+
+    // The last frame must end within the file, written so that nothing overflows
+    uint64_t file_size = file_->size();
+    if (header_.frame_count > 0 &&
+        (header_.data_offset > file_size || file_size - header_.data_offset < frame_bytes ||
+        header_.frame_count - 1 > (file_size - header_.data_offset - frame_bytes) / header_.frame_stride))
+        throw HranolRuntimeException("Raw stack \"" + path.string() + "\" is truncated.");
+
+    frame_count_ = (size_t) header_.frame_count;
+    loaded_imgs_.resize(frame_count_);
+}
+
+size_t RawStackImageStore::estimate_memory(size_t max_loaded)
+{
+    // Only the loaded frames take memory (their pages are copied once they are modified)
+    size_t frame_bytes = (size_t) header_.width * header_.height * CV_ELEM_SIZE(type_);
+    return frame_bytes * std::min(max_loaded, size());
+}
+
+cv::Mat & RawStackImageStore::load(size_t i)
+{
+    assert(i < size());
+
+    if (loaded_imgs_[i].empty())
+    {
+        // Pages of the frame are read from the file as they are touched
+        auto start = RunStats::Clock::now();
+        loaded_imgs_[i] = convert_depth(crop_img(frame_header_(i), get_img_path(i)));
+        stats_.add_time(RunStats::READ, start);
+        stats_.add_read((unsigned long long) header_.width * header_.height * CV_ELEM_SIZE(type_));
+    }
+
+    return loaded_imgs_[i];
+}
+
+void RawStackImageStore::release(size_t i)
+{
+    assert(i < size());
+
+    loaded_imgs_[i] = cv::Mat();
+    // Drops modified pages, the frame is read from the file again on next load
+    file_->drop((size_t) (header_.data_offset + i * header_.frame_stride), (size_t) header_.frame_stride);
+}
+
+void RawStackImageStore::save(size_t i)
+{
+    assert(i < size());
+    save_img(i, loaded_imgs_[i], frame_name_(i));
+}
+
+cv::Mat RawStackImageStore::frame_header_(size_t i)
+{
+    uchar * frame = file_->data() + header_.data_offset + i * header_.frame_stride;
+    return cv::Mat((int) header_.height, (int) header_.width, type_, frame);
+}
+
+
+TiffStackImageStore::TiffStackImageStore(fs::path dest, fs::path container)
+    : ContainerImageStore(std::move(dest), std::move(container))
+{
+    const fs::path & path = get_container();
+
+#if HRANOL_TIFF_COLLECTION
+    next_page_ = 0;
+#endif
+
+#if HRANOL_TIFF_PAGE_ACCESS
+    frame_count_ = cv::imcount(path.string(), cv::ImreadModes::IMREAD_ANYDEPTH);
+#else
+    // Depth is converted on load, read_flags() are not known yet
+    auto start = RunStats::Clock::now();
+    if (!cv::imreadmulti(path.string(), pages_, cv::ImreadModes::IMREAD_ANYDEPTH))
+        throw HranolRuntimeException("Reading multi-page TIFF: \"" + path.string() + "\" failed.");
+    frame_count_ = pages_.size();
+
+    // All pages are decoded at once
+    stats_.add_time(RunStats::DECODE, start);
+    error_code ec;
+    auto bytes = fs::file_size(path, ec);
+    if (!ec)
+        stats_.add_read(bytes);
+#endif
+}
+
+#if !HRANOL_TIFF_PAGE_ACCESS
+void TiffStackImageStore::set_roi(const cv::Rect & roi)
+{
+    IImageStore::set_roi(roi);
+    if (roi.area() == 0)
+        return;
+
+    // Copies of the regions are kept, so that the whole pages are freed
+    for (size_t i = 0; i < pages_.size(); ++i)
+        pages_[i] = crop_img(pages_[i], frame_name_(i).string()).clone();
+}
+#endif
+
+size_t TiffStackImageStore::estimate_memory(size_t max_loaded)
+{
+    if (size() == 0)
+        return 0;
+
+    size_t page_bytes = 0;
+    cv::Mat img = read_page_(0, &page_bytes);
+    size_t img_bytes = img.total() * img.elemSize();
+    size_t loaded = std::min(max_loaded, size());
+
+#if HRANOL_TIFF_PAGE_ACCESS
+    // Loaded pages hold the region only. Every thread decodes a whole page before it is cropped,
+    // with the shared decoder pages decoded ahead are kept whole as well.
+    return img_bytes * loaded + page_bytes * std::min(max_loaded + (HRANOL_TIFF_COLLECTION ? MAX_AHEAD : 0), size());
+#else
+    // All (cropped) pages are kept in memory, loaded pages are their copies
+    size_t kept = 0;
+    for (auto&& page : pages_)
+        kept += page.total() * page.elemSize();
+    return kept + img_bytes * loaded;
+#endif
+}
+
+cv::Mat & TiffStackImageStore::load(size_t i)
+{
+    assert(i < size());
+
+    {
+        lock_guard< mutex> lock(loaded_imgs_mtx_);
+        auto it = loaded_imgs_.find(i);
+        if (it != loaded_imgs_.end())
+            return it->second;
+    }
+
+    // Decoding is done outside of the lock, only the calling thread works with index i
+    cv::Mat img = read_page_(i);
+
+    lock_guard< mutex> lock(loaded_imgs_mtx_);
+    return loaded_imgs_.emplace(i, std::move(img)).first->second;
+}
+
+void TiffStackImageStore::release(size_t i)
+{
+    assert(i < size());
+
+    lock_guard< mutex> lock(loaded_imgs_mtx_);
+    auto it = loaded_imgs_.find(i);
+    if (it == loaded_imgs_.end())
+        return;
+    recycle_img(it->second);
+    loaded_imgs_.erase(it);
+}
+
+void TiffStackImageStore::save(size_t i)
+{
+    assert(i < size());
+
+    cv::Mat img;
+    {
+        lock_guard< mutex> lock(loaded_imgs_mtx_);
+        auto it = loaded_imgs_.find(i);
+        assert(it != loaded_imgs_.end());
+        img = it->second;
+    }
+
+    save_img(i, img, frame_name_(i));
+}
+
+cv::Mat TiffStackImageStore::read_page_(size_t i, size_t * page_bytes)
+{
+#if HRANOL_TIFF_PAGE_ACCESS
+    auto start = RunStats::Clock::now();
+#if HRANOL_TIFF_COLLECTION
+    cv::Mat page = decode_page_(i);
+#else
+    vector< cv::Mat> pages;
+    if (!cv::imreadmulti(get_container().string(), pages, (int) i, 1, read_flags()) || pages.empty())
+        throw HranolRuntimeException("Reading page " + to_string(i) + " of \"" + get_container().string() + "\" failed.");
+    cv::Mat page = pages[0];
+#endif
+
+    if (page_bytes)
+        *page_bytes = page.total() * page.elemSize();
+
+    // The region is copied (to a pooled buffer), a view would keep the whole page alive
+    cv::Mat img = crop_img(page, get_img_path(i));
+    if (img.size() != page.size())
+    {
+        cv::Mat region = pooled_img();
+        const uchar * buffer = region.data;
+        img.copyTo(region);
+        stats_.add_frame_buffer(region.data != buffer);
+        img = region;
+    }
+    stats_.add_time(RunStats::DECODE, start);
+    // Share of the file is counted for every page
+    error_code ec;
+    auto bytes = fs::file_size(get_container(), ec);
+    if (!ec && frame_count_ > 0)
+        stats_.add_read(bytes / frame_count_);
+#else
+    // Filters modify the image in place, the decoded page must stay intact. Pages are cropped
+    // already (see set_roi).
+    cv::Mat page = pages_[i];
+    if (page_bytes)
+        *page_bytes = page.total() * page.elemSize();
+    cv::Mat img = convert_depth(page);
+    if (img.data == page.data)
+        img = img.clone();
+#endif
+
+    if (img.depth() != CV_8U && img.depth() != CV_16U)
+        throw HranolRuntimeException("Page " + to_string(i) + " of \"" + get_container().string() + "\" is neither 8-bit nor 16-bit.");
+
+    return img;
+}
+
+#if HRANOL_TIFF_COLLECTION
+cv::Mat TiffStackImageStore::decode_page_(size_t i)
+{
+    // The decoder reads pages one after another, loads of other threads wait for it
+    lock_guard< mutex> lock(reader_mtx_);
+
+    auto it = ahead_.find(i);
+    if (it != ahead_.end())
+    {
+        cv::Mat page = std::move(it->second);
+        ahead_.erase(it);
+        return page;
+    }
+
+    if (!reader_)
+        reader_ = make_unique< cv::ImageCollection>(get_container().string(), read_flags());
+
+    auto decode = [this](size_t page_idx) {
+        cv::Mat page = reader_->at((int) page_idx);
+        reader_->releaseCache((int) page_idx);
+        if (page.empty())
+            throw HranolRuntimeException("Reading page " + to_string(page_idx) + " of \"" + get_container().string() + "\" failed.");
+        return page;
+    };
+
+    // Pages shortly after the decoder are reached by decoding the pages in between (other threads
+    // load them next), the decoder starts again from the first page for any other page
+    if (i > next_page_ && i - next_page_ + ahead_.size() <= MAX_AHEAD)
+        for (; next_page_ < i; ++next_page_)
+            ahead_.emplace(next_page_, decode(next_page_));
+
+    cv::Mat page = decode(i);
+    next_page_ = i + 1;
+    return page;
+}
+#endif
@@ -0,0 +1,155 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef CONTAINER_IMAGE_STORE_H
+#define CONTAINER_IMAGE_STORE_H
+
+#include "ImageStore.h"
+#include "MappedFile.h"
+#include "RawStack.h"
+
+#include "opencv2/core/mat.hpp"
+#include "opencv2/core/version.hpp"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// OpenCV 4.4 added reading of page ranges to imreadmulti (and imcount)
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 4)
+    #define HRANOL_TIFF_PAGE_ACCESS 1
+#else
+    #define HRANOL_TIFF_PAGE_ACCESS 0
+#endif
+
+// OpenCV 4.7 added ImageCollection, which keeps the decoder open between pages
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 7)
+    #define HRANOL_TIFF_COLLECTION 1
+    #include "opencv2/imgcodecs.hpp"
+#else
+    #define HRANOL_TIFF_COLLECTION 0
+#endif
+
+
+// ContainerImageStore presents a single container file holding many frames (a stack) as a run
+// of images. Frame i is saved as a separate image "<container stem>_<i>.tif" in dest.
+class ContainerImageStore : public IImageStore
+{
+protected:
+    size_t frame_count_;
+
+    // Name of the saved i-th frame
+    std::filesystem::path frame_name_(size_t i) const;
+
+public:
+    // Origin of the store is the container itself
+    ContainerImageStore(std::filesystem::path dest, std::filesystem::path container)
+        : IImageStore(container, std::move(dest), { container }), frame_count_(0)
+    {}
+
+    virtual size_t size() const {
+        return frame_count_;
+    }
+
+    virtual std::string get_img_path(size_t i) const;
+
+    // All frames are read from the container
+    virtual std::filesystem::path get_source(size_t) const {
+        return get_container();
+    }
+
+    const std::filesystem::path & get_container() const {
+        return img_paths_[0];
+    }
+
+    // Returns true for files that are read as multi-page TIFFs (.tif, .tiff), other containers
+    // are read as raw stacks
+    static bool is_tiff(const std::filesystem::path & container);
+
+    // Opens container with the store matching its type
+    static std::unique_ptr< ContainerImageStore> open(std::filesystem::path dest,
+        std::filesystem::path container);
+};
+
+
+// RawStackImageStore maps a raw stack (see RawStackHeader) into memory. Frames are not decoded
+// nor copied, load() returns header pointing directly into the mapping.
+//
+// The mapping is private (copy-on-write), so filters can modify frames in place without touching
+// the file. Only modified pages take memory, they are dropped on release. If frames are not page
+// aligned, pages shared by neighbouring frames are kept until the store is destroyed.
+class RawStackImageStore : public ContainerImageStore
+{
+    std::unique_ptr< MappedFile> file_;
+    RawStackHeader header_;
+    int type_;
+
+    std::vector< cv::Mat> loaded_imgs_;
+
+public:
+    RawStackImageStore(std::filesystem::path dest, std::filesystem::path container);
+
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+
+private:
+    // Header of i-th frame pointing into the mapping
+    cv::Mat frame_header_(size_t i);
+};
+
+
+// TiffStackImageStore reads pages of a multi-page TIFF on demand. Only the currently loaded pages
+// are kept in memory. One decoder is kept open and pages are decoded in order, pages decoded on
+// the way to a requested page are kept until they are loaded. OpenCV 4.4 to 4.6 has no decoder
+// to keep open, every page is read on its own and the preceding pages are skipped each time.
+// With OpenCV older than 4.4 (no page access) all pages are decoded when the store is opened
+// and kept in memory (cropped to the region of interest once it is set).
+// Loaded pages hold only the region of interest, not the whole decoded page.
+class TiffStackImageStore : public ContainerImageStore
+{
+    std::map< size_t, cv::Mat> loaded_imgs_;
+    std::mutex loaded_imgs_mtx_;
+
+#if HRANOL_TIFF_COLLECTION
+    std::unique_ptr< cv::ImageCollection> reader_;
+    // Pages decoded ahead of the requested ones and index of the page the decoder is at
+    std::map< size_t, cv::Mat> ahead_;
+    size_t next_page_;
+    std::mutex reader_mtx_;
+#endif
+
+#if !HRANOL_TIFF_PAGE_ACCESS
+    std::vector< cv::Mat> pages_;
+#endif
+
+public:
+    TiffStackImageStore(std::filesystem::path dest, std::filesystem::path container);
+
+#if !HRANOL_TIFF_PAGE_ACCESS
+    // Pages kept in memory are cropped right away
+    virtual void set_roi(const cv::Rect & roi);
+#endif
+
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+
+private:
+    // Returns i-th page cropped to the region of interest, page_bytes receives the size of the
+    // whole decoded page
+    cv::Mat read_page_(size_t i, size_t * page_bytes = nullptr);
+#if HRANOL_TIFF_COLLECTION
+    // Decodes whole page i with the shared decoder
+    cv::Mat decode_page_(size_t i);
+#endif
+};
+
+#endif // CONTAINER_IMAGE_STORE_H
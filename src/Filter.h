@@ -7,20 +7,31 @@
 #define FILTER_H
 
 #include "HranolException.h"
+#include "Accumulator.h"
+#include "BinaryIO.h"
 
 #include "opencv2/core/mat.hpp"
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <istream>
 #include <memory>
+#include <ostream>
 #include <vector>
 #include <string>
 
 
+// Filters are applied to images from several worker threads at once, therefore apply_to
+// has to be reentrant. Any data apply_to needs must be prepared beforehand (in the constructor
+// or, for filters with precomputation, in finish_precomp).
 class IFilter
 {
 public:
-    virtual void apply_to(cv::Mat & img) = 0;
+    virtual void apply_to(cv::Mat & img) const = 0;
     // Returns string describing particular filter
     virtual std::string desc() const = 0;
     virtual ~IFilter() { };
@@ -29,7 +40,11 @@ public:
 
 // Interface for pure filters
 // Pure filters do not need precomputation and have no side effects
-class IFilterPure : public IFilter {};
+class IFilterPure : public IFilter
+{
+public:
+    virtual std::unique_ptr< IFilterPure> clone() const = 0;
+};
 
 
 // Interface for filters that need precomputation
@@ -39,6 +54,59 @@ public:
     // Clears precomputed data
     virtual void clear() = 0;
     virtual void precomp_from(const cv::Mat img) = 0;
+    // Hint called after clear(): number of images precomp_from will be called with.
+    // Filters can use it to size their data.
+    virtual void reserve(size_t /* img_count */) { }
+    // Called after all images went through precomp_from. Returns true if the filter needs
+    // another pass over all images (precomp_from is then called again for every image).
+    virtual bool next_pass() { return false; }
+    // Called once after the last precomp_from and before the first apply_to. Computes
+    // everything apply_to needs from the aggregated data.
+    virtual void finish_precomp() = 0;
+
+    // Precomputation can be split into shards, e.g. one per worker thread. A shard is an
+    // empty filter of the same kind and configuration (in the same pass). After its precomp_from
+    // calls it is merged back with merge_shard (shard must come from create_shard of this filter).
+    // Shards may share data with their filter (synchronizing concurrent precomp_from calls themselves)
+    // until clear() is called on the filter.
+    virtual std::unique_ptr< IFilterWithPrecomp> create_shard() const = 0;
+    virtual void merge_shard(const IFilterWithPrecomp & shard) = 0;
+
+    // Precomputed data can be persisted once the last pass is done (before finish_precomp),
+    // so that a later run over the same images can skip precomputation. load_state replaces
+    // precomp_from calls, finish_precomp is called afterwards as usual. Filters that can't
+    // persist their data return false.
+    virtual bool save_state(std::ostream & /* out */) const { return false; }
+    virtual bool load_state(std::istream & /* in */) { return false; }
+
+    // Returns true if the filter got its data elsewhere (e.g. from a file) and does not take
+    // part in precomputation. clear() keeps such data, finish_precomp is still called.
+    virtual bool is_precomputed() const { return false; }
+};
+
+// Interface for filters that need a window of neighbouring images
+// ImageProcessor streams images in order and keeps the window [i - radius, i + radius] around
+// the filtered image i. Each image is pushed when it enters the window and popped (with its
+// original, unfiltered content) when it leaves. apply_to(img) is called for the image in the
+// middle of the current window, after prepare() was called for that window.
+class IFilterWindowed : public IFilter
+{
+public:
+    // Number of images on each side of the filtered image
+    virtual size_t radius() const = 0;
+    // Clears data from the previous run
+    virtual void clear() = 0;
+    virtual void push(const cv::Mat & img) = 0;
+    virtual void pop(const cv::Mat & img) = 0;
+    // Called once the window of the next filtered image is complete. Data used by apply_to are
+    // computed here, so that apply_to does not modify the filter.
+    virtual void prepare() {}
+    // Creates filter with the same configuration and empty window
+    virtual std::unique_ptr< IFilterWindowed> clone() const = 0;
+    // Running filter never pops images, its window holds all images pushed since clear().
+    // It can only be used for online filtering (watch mode), where the window trails the
+    // filtered image instead of being centered on it.
+    virtual bool is_running() const { return false; }
 };
 
 using PureFiltersVec = std::vector< std::unique_ptr< IFilterPure>>;
@@ -47,11 +115,26 @@ using PrecompFiltersVec = std::vector< std::unique_ptr< IFilterWithPrecomp>>;
 
 // Filters
 
+// Columns [begin, end) of a single image row
+struct MaskSpan
+{
+    int begin, end;
+};
+
+// MaskFilter zeroes pixels where the mask is 0. The mask is compiled in the constructor into
+// spans of masked out pixels in every row and the bounding box of the kept pixels, so masking
+// only clears the masked out spans in place and never touches the kept pixels.
 class MaskFilter : public IFilterPure
 {
     std::string mask_fname_;
     cv::Mat mask_;
 
+    // Masked out spans of all rows, row r has spans [row_spans_[r], row_spans_[r + 1])
+    std::vector< MaskSpan> spans_;
+    std::vector< size_t> row_spans_;
+    // Bounding box of kept pixels, empty if the whole image is masked out
+    cv::Rect bbox_;
+
 public:
     MaskFilter(std::string mask_fname)
         : mask_fname_(std::move(mask_fname))
@@ -59,6 +142,8 @@ public:
         mask_ = cv::imread(mask_fname_, cv::ImreadModes::IMREAD_GRAYSCALE);
         if (mask_.empty())
             throw HranolRuntimeException("Unable to open mask filter: \"" + mask_fname_ + "\"");
+
+        compile_();
     }
 
     static auto create(std::string mask_fname) 
@@ -66,70 +151,207 @@ public:
         return std::make_unique< MaskFilter>(std::move(mask_fname));
     }
 
-    virtual void apply_to(cv::Mat &img) 
-    {
-        cv::Mat dst;
+    // The mask data are shared with the clone, they are never modified
+    virtual std::unique_ptr< IFilterPure> clone() const {
+        return std::make_unique< MaskFilter>(*this);
+    }
 
+    virtual void apply_to(cv::Mat &img) const
+    {
         if (img.size() != mask_.size())
             throw HranolRuntimeException("Size or number of channels of image being masked and the mask did not match.");
 
-        img.copyTo(dst, mask_);
-        img = dst;
+        size_t px_size = img.elemSize();
+        for (int r = 0; r < img.rows; ++r)
+        {
+            uchar * p = img.ptr(r);
+            for (auto s = spans_begin(r); s != spans_end(r); ++s)
+                std::memset(p + s->begin * px_size, 0, (s->end - s->begin) * px_size);
+        }
     }
 
     virtual std::string desc() const {
         return "Mask with source " + mask_fname_;
     }
+
+    const cv::Mat & mask() const {
+        return mask_;
+    }
+
+    // Masked out spans of row r in increasing order
+    const MaskSpan * spans_begin(int r) const {
+        return spans_.data() + row_spans_[r];
+    }
+
+    const MaskSpan * spans_end(int r) const {
+        return spans_.data() + row_spans_[r + 1];
+    }
+
+    const cv::Rect & bounding_box() const {
+        return bbox_;
+    }
+
+    // Crops the mask to roi, so that it matches images cropped to the same region
+    void crop(const cv::Rect & roi)
+    {
+        if ((roi & cv::Rect(0, 0, mask_.cols, mask_.rows)) != roi)
+            throw HranolRuntimeException("Region of interest does not fit into mask: \"" + mask_fname_ + "\"");
+
+        mask_ = mask_(roi).clone();
+        spans_.clear();
+        row_spans_.clear();
+        bbox_ = cv::Rect();
+        compile_();
+    }
+
+private:
+    void compile_()
+    {
+        int min_col = mask_.cols, max_col = -1, min_row = mask_.rows, max_row = -1;
+
+        row_spans_.reserve(mask_.rows + 1);
+        row_spans_.push_back(0);
+        for (int r = 0; r < mask_.rows; ++r)
+        {
+            const uchar * m = mask_.ptr(r);
+            int c = 0;
+            while (c < mask_.cols)
+            {
+                // Kept pixels
+                int kept_beg = c;
+                while (c < mask_.cols && m[c] != 0)
+                    ++c;
+                if (c > kept_beg)
+                {
+                    min_col = std::min(min_col, kept_beg);
+                    max_col = std::max(max_col, c - 1);
+                    min_row = std::min(min_row, r);
+                    max_row = r;
+                }
+
+                // Masked out pixels
+                int zero_beg = c;
+                while (c < mask_.cols && m[c] == 0)
+                    ++c;
+                if (c > zero_beg)
+                    spans_.push_back({ zero_beg, c });
+            }
+            row_spans_.push_back(spans_.size());
+        }
+
+        if (max_row >= 0)
+            bbox_ = cv::Rect(min_col, min_row, max_col - min_col + 1, max_row - min_row + 1);
+    }
 };
 
-// Contrast filter maps colors in range [beg_, end_] to [0, 255]
+// Contrast filter maps colors in range [beg_, end_] to [0, max_value_]. max_value_ is 255 for
+// 8-bit images, for 16-bit images it is given by the bit depth of the sensor (e.g. 4095 for 12 bits).
+// 8-bit images filtered with a larger max_value_ (e.g. 8-bit files in a 12-bit folder) are mapped
+// the same way and the result is scaled to [0, 255].
 class ContrastFilter : public IFilterPure
 {
     // Rescale range [beg_, end_]
     int beg_, end_;
+    int max_value_;
+    // CV_8U table for 8-bit images, CV_16U table with max_value_ + 1 entries for 16-bit images
     cv::Mat lut_;
+    // CV_8U table for 8-bit images when lut_ is CV_16U
+    cv::Mat lut8_;
 
 public:
-    ContrastFilter(int beg, int end)
-        : beg_(beg), end_(end)
+    ContrastFilter(int beg, int end, int max_value = 255)
+        : beg_(beg), end_(end), max_value_(max_value)
     {
-        if (beg_ < 0 || end_ > 255 || beg_ > end_)
+        if (max_value_ < 255 || max_value_ > 65535)
+            throw HranolRuntimeException("Invalid maximal value for contrast filter " + std::to_string(max_value_));
+        if (beg_ < 0 || end_ > max_value_ || beg_ > end_)
             throw HranolRuntimeException("Invalid range for contrast filter " + range_to_str_(beg_, end_));
+
+        fill_lut_();
     }
 
-    static auto create(int beg, int end) {
-        return std::make_unique< ContrastFilter>(beg, end);
+    static auto create(int beg, int end, int max_value = 255) {
+        return std::make_unique< ContrastFilter>(beg, end, max_value);
     }
 
-    virtual void apply_to(cv::Mat & img)
+    virtual std::unique_ptr< IFilterPure> clone() const {
+        return std::make_unique< ContrastFilter>(*this);
+    }
+
+    virtual void apply_to(cv::Mat & img) const
     {
-        // Only char type matrices can be filtered with LUT
-        if (img.depth() != CV_8U)
+        if (img.depth() == CV_8U)
+        {
+            cv::LUT(img, (lut_.depth() == CV_8U) ? lut_ : lut8_, img);
+            return;
+        }
+
+        // Only char type matrices can be filtered with 8-bit LUT
+        if (lut_.depth() == CV_8U)
             throw HranolRuntimeException("ContrastFilter can only be applied to char type (grayscale) matrices.");
 
-        if (lut_.empty())
-            fill_lut_();
+        if (img.depth() != CV_16U)
+            throw HranolRuntimeException("ContrastFilter with range up to " + std::to_string(max_value_) +
+                " can only be applied to 16-bit matrices.");
 
-        cv::LUT(img, lut_, img);
+        // cv::LUT supports only 8-bit indices, values above max_value_ are mapped as max_value_
+        const ushort * p_lut = lut_.ptr< ushort>();
+        int n = img.cols * img.channels();
+        for (int r = 0; r < img.rows; ++r)
+        {
+            ushort * p = img.ptr< ushort>(r);
+            for (int c = 0; c < n; ++c)
+                p[c] = p_lut[std::min< int>(p[c], max_value_)];
+        }
     }
 
-    virtual std::string desc() const {
-        return "Contrast filter with range " + range_to_str_(beg_, end_);
+    virtual std::string desc() const
+    {
+        std::string ret = "Contrast filter with range " + range_to_str_(beg_, end_);
+        if (max_value_ != 255)
+            ret += " mapped to " + range_to_str_(0, max_value_);
+        return ret;
+    }
+
+    int max_value() const {
+        return max_value_;
+    }
+
+    // Lookup table (1 x (max_value + 1), CV_8U or CV_16U) mapping original intensities to new ones
+    const cv::Mat & lut() const {
+        return lut_;
     }
 
 private:
     void fill_lut_()
     {
-        lut_ = cv::Mat(1, 256, CV_8U);
-        uchar* p_lut = lut_.ptr();
+        if (max_value_ == 255)
+        {
+            fill_lut_< uchar>(CV_8U);
+            return;
+        }
+
+        fill_lut_< ushort>(CV_16U);
+        lut8_ = cv::Mat(1, 256, CV_8U);
+        const ushort * p_lut = lut_.ptr< ushort>();
+        uchar * p_lut8 = lut8_.ptr();
         for (int i = 0; i < 256; ++i)
+            p_lut8[i] = (uchar) ((p_lut[i] * 255 + max_value_ / 2) / max_value_);
+    }
+
+    template< typename T>
+    void fill_lut_(int depth)
+    {
+        lut_ = cv::Mat(1, max_value_ + 1, depth);
+        T* p_lut = lut_.ptr< T>();
+        for (int i = 0; i <= max_value_; ++i)
         {
             if (i < beg_)
                 p_lut[i] = 0;
             else if (i > end_)
-                p_lut[i] = 255;
+                p_lut[i] = (T) max_value_;
             else
-                p_lut[i] = ((i - beg_ + 1) * 255) / (end_ - beg_ + 2);
+                p_lut[i] = (T) (((long long) (i - beg_ + 1) * max_value_) / (end_ - beg_ + 2));
         }
     }
 
@@ -139,50 +361,61 @@ private:
 };
 
 
-// BckgSubFilter subtracts the mean value of all images with factor subtraction_factor_
+// BckgSubFilter subtracts the mean value of all images with factor subtraction_factor_.
+// The mean can also be loaded from a background file written by save_background (e.g. by a run
+// over another folder of the same scene), the filter is not precomputed then. The file holds the
+// accumulator (sum and count), so any subtraction factor can be used with it.
 class BckgSubFilter : public IFilterWithPrecomp
 {
-    // Number of images summed
-    size_t count_;
-
-    // Accumulator to hold the running sum
-    cv::Mat accumulator_;
+    // Accumulator to hold the running sum and number of images summed
+    Accumulator accumulator_;
 
-    // The apply_to method uses this precomputed factored mean from aggregated data
+    // The apply_to method uses this factored mean computed in finish_precomp
     cv::Mat factored_mean_;
-    bool is_factored_mean_valid_;
 
     double subtraction_factor_;
 
+    // Background loaded from background_file_, nullptr if the filter is precomputed. Shared by clones.
+    std::shared_ptr< const Accumulator> background_;
+    std::string background_file_;
+
 public:
     BckgSubFilter(double subtraction_factor) :
-        count_(0), is_factored_mean_valid_(false), subtraction_factor_(subtraction_factor)
+        subtraction_factor_(subtraction_factor)
     {
         if (subtraction_factor <= 0)
             throw HranolRuntimeException("Background subtraction factor must be positive: " + std::to_string(subtraction_factor));
     }
 
+    BckgSubFilter(double subtraction_factor, std::shared_ptr< const Accumulator> background, std::string background_file) :
+        BckgSubFilter(subtraction_factor)
+    {
+        background_ = std::move(background);
+        background_file_ = std::move(background_file);
+        clear();
+    }
+
     static auto create(double subtraction_factor) {
         return std::make_unique<BckgSubFilter>(subtraction_factor);
     }
 
-    virtual void apply_to(cv::Mat &img)
+    // Creates filter subtracting background loaded from file, the background must be computed
+    // from single channel images of given depth cropped to region roi (empty if not cropped)
+    static auto create(double subtraction_factor, const std::string & background_file, int depth, const cv::Rect & roi) {
+        return std::make_unique< BckgSubFilter>(subtraction_factor, load_background(background_file, depth, roi), background_file);
+    }
+
+    virtual void apply_to(cv::Mat &img) const
     {
         // Do nothing if there were no images in the precomputation
-        if (count_ == 0)
+        if (accumulator_.empty())
             return;
 
-        if (!is_factored_mean_valid_)
-        {
-            // Intention: subtraction_factor_ * (accumulator_ / count_)
-            // If the above equation was used, accumulator_ would have to be traversed twice
-            factored_mean_ = accumulator_ / (count_ / subtraction_factor_);
-            factored_mean_.convertTo(factored_mean_, CV_8U);
-            is_factored_mean_valid_ = true;
-        }
+        if (factored_mean_.empty())
+            throw HranolRuntimeException("Background subtraction was applied before precomputation was finished.");
 
-        if (img.size() != factored_mean_.size() || img.channels() != factored_mean_.channels())
-            throw HranolRuntimeException("Size or number of channels channels of processed image and images used for precomputation did not match.");
+        if (img.size() != factored_mean_.size() || img.type() != factored_mean_.type())
+            throw HranolRuntimeException("Size, depth or number of channels of processed image and images used for precomputation did not match.");
 
         // Saturated subtraction
         img -= factored_mean_;
@@ -190,29 +423,239 @@ public:
 
     virtual void precomp_from(const cv::Mat img)
     {
-        is_factored_mean_valid_ = false;
-        ++count_;
+        factored_mean_ = cv::Mat();
+        accumulator_.add(img);
+    }
 
-        // Allocate new accumulator based on the size of input image
-        if (accumulator_.empty())
-            accumulator_ = cv::Mat::zeros(img.rows, img.cols, CV_32FC(img.channels()));
+    virtual void reserve(size_t img_count) {
+        accumulator_.reserve(img_count);
+    }
+
+    virtual std::unique_ptr< IFilterWithPrecomp> create_shard() const {
+        if (background_)
+            return std::make_unique< BckgSubFilter>(subtraction_factor_, background_, background_file_);
+        return create(subtraction_factor_);
+    }
 
-        if (img.size() != accumulator_.size() || img.channels() != accumulator_.channels())
-            throw HranolRuntimeException("Size or number of channels of preprocessed image and accumulator did not match.");
+    // Sums accumulators and counts. Sums of 8-bit images are integer, so merged result
+    // is identical to the one accumulated serially.
+    virtual void merge_shard(const IFilterWithPrecomp & shard)
+    {
+        const auto & other = dynamic_cast< const BckgSubFilter &>(shard);
 
-        cv::accumulate(img, accumulator_);
+        factored_mean_ = cv::Mat();
+        accumulator_.merge(other.accumulator_);
+    }
+
+    // The state is the accumulator, so it does not depend on the subtraction factor
+    virtual bool save_state(std::ostream & out) const
+    {
+        accumulator_.save(out);
+        return true;
+    }
+
+    virtual bool load_state(std::istream & in)
+    {
+        factored_mean_ = cv::Mat();
+        return accumulator_.load(in);
+    }
+
+    virtual bool is_precomputed() const {
+        return background_ != nullptr;
+    }
+
+    virtual void finish_precomp()
+    {
+        // Mean has the depth of precomputed images, so 16-bit images get 16-bit saturated subtraction
+        factored_mean_ = accumulator_.factored_mean(subtraction_factor_, accumulator_.depth());
     }
 
     virtual void clear()
     {
-        count_ = 0;
-        accumulator_ = cv::Mat();
+        accumulator_.clear();
         factored_mean_ = cv::Mat();
-        is_factored_mean_valid_ = false;
+
+        // Loaded background is used for every run
+        if (background_)
+            accumulator_.merge(*background_);
+    }
+
+    virtual std::string desc() const {
+        std::string ret = "Background subtraction with factor " + std::to_string(subtraction_factor_);
+        if (background_)
+            ret += " and background from " + background_file_;
+        return ret;
+    }
+
+    // Mean multiplied by the subtraction factor, computed in finish_precomp. Empty if
+    // there were no precomputed images (the filter does nothing then).
+    const cv::Mat & factored_mean() const {
+        return factored_mean_;
+    }
+
+    // Writes the accumulated background (after precomputation) to file, roi is the region of
+    // interest the images were cropped to (empty if they were not)
+    void save_background(const std::filesystem::path & path, const cv::Rect & roi) const
+    {
+        std::ofstream out(path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        out.write(background_magic_(), 8);
+        for (int32_t v : { roi.x, roi.y, roi.width, roi.height })
+            write_value(out, v);
+        accumulator_.save(out);
+
+        out.close();
+        if (!out)
+            throw HranolRuntimeException("Writing background file \"" + path.string() + "\" failed.");
+    }
+
+    static std::shared_ptr< const Accumulator> load_background(const std::filesystem::path & path, int depth,
+        const cv::Rect & roi)
+    {
+        std::ifstream in(path, std::ifstream::in | std::ifstream::binary);
+        if (!in)
+            throw HranolRuntimeException("Unable to open background file: \"" + path.string() + "\"");
+
+        char magic[8];
+        int32_t saved_roi[4] = { 0, 0, 0, 0 };
+        auto ret = std::make_shared< Accumulator>();
+        bool valid = (bool) in.read(magic, 8);
+        // Files of the first version were saved before images could be cropped
+        if (valid && std::memcmp(magic, background_magic_(), 8) == 0)
+            for (auto & v : saved_roi)
+                valid = valid && read_value(in, v);
+        else if (!valid || std::memcmp(magic, "HRNLBCK1", 8) != 0)
+            valid = false;
+        if (!valid || !ret->load(in) || ret->empty())
+            throw HranolRuntimeException("File \"" + path.string() + "\" is not a valid background file.");
+
+        // Background of the same size taken at another offset would be subtracted at wrong pixels
+        if (cv::Rect(saved_roi[0], saved_roi[1], saved_roi[2], saved_roi[3]) != roi)
+            throw HranolRuntimeException("Background file \"" + path.string() + "\" was saved from " +
+                region_desc_(cv::Rect(saved_roi[0], saved_roi[1], saved_roi[2], saved_roi[3])) + ", this run filters " +
+                region_desc_(roi) + " (see --roi and --crop).");
+
+        // Images are read as grayscale, in 8 bits unless --bit-depth is above 8
+        if (ret->sum().channels() != 1)
+            throw HranolRuntimeException("Background file \"" + path.string() + "\" was not saved from grayscale images.");
+        if (ret->depth() != depth)
+            throw HranolRuntimeException("Background file \"" + path.string() + "\" was saved from " +
+                ((ret->depth() == CV_8U) ? "8-bit" : "16-bit") + " images, " +
+                ((depth == CV_8U) ? "8-bit" : "16-bit") + " images are processed (see --bit-depth).");
+
+        return ret;
+    }
+
+private:
+    // Second version records the region of interest
+    static const char * background_magic_() {
+        return "HRNLBCK2";
+    }
+
+    static std::string region_desc_(const cv::Rect & roi)
+    {
+        if (roi.area() == 0)
+            return "whole images";
+        return "region " + std::to_string(roi.x) + "," + std::to_string(roi.y) + "," +
+            std::to_string(roi.width) + "," + std::to_string(roi.height);
+    }
+};
+
+
+// WindowBckgSubFilter subtracts the mean value of images in the sliding window around each
+// image with factor subtraction_factor_. Unlike BckgSubFilter it follows slow changes of
+// the background (e.g. illumination) and needs only a single pass over the images.
+// The running sum is updated incrementally, so each image costs the same regardless of radius_.
+// The window is truncated at the beginning and the end of the run.
+//
+// Radius 0 makes a running filter (see IFilterWindowed::is_running) that subtracts the mean
+// of all images so far, it is created by create_running.
+class WindowBckgSubFilter : public IFilterWindowed
+{
+    size_t radius_;
+
+    // Running sum of the images in the window
+    Accumulator accumulator_;
+
+    double subtraction_factor_;
+
+    // Mean of the current window and its float version, computed by prepare(). They are kept
+    // between images, so that their buffers are reused.
+    cv::Mat mean_;
+    cv::Mat mean_f32_;
+
+public:
+    WindowBckgSubFilter(double subtraction_factor, size_t radius) :
+        radius_(radius), subtraction_factor_(subtraction_factor)
+    {
+        if (subtraction_factor <= 0)
+            throw HranolRuntimeException("Background subtraction factor must be positive: " + std::to_string(subtraction_factor));
+
+        if (radius_ != 0)
+            accumulator_.reserve(2 * radius_ + 1);
+    }
+
+    static auto create(double subtraction_factor, size_t radius)
+    {
+        if (radius == 0)
+            throw HranolRuntimeException("Background subtraction window radius must be positive.");
+        return std::make_unique< WindowBckgSubFilter>(subtraction_factor, radius);
+    }
+
+    static auto create_running(double subtraction_factor) {
+        return std::make_unique< WindowBckgSubFilter>(subtraction_factor, 0);
+    }
+
+    virtual void apply_to(cv::Mat &img) const
+    {
+        if (mean_.empty())
+            return;
+
+        if (img.size() != mean_.size() || img.type() != mean_.type())
+            throw HranolRuntimeException("Size, depth or number of channels of processed image and images in the window did not match.");
+
+        // Saturated subtraction
+        img -= mean_;
+    }
+
+    virtual size_t radius() const {
+        return radius_;
+    }
+
+    virtual void clear()
+    {
+        accumulator_.clear();
+        mean_.release();
+        if (radius_ != 0)
+            accumulator_.reserve(2 * radius_ + 1);
+    }
+
+    virtual void push(const cv::Mat & img) {
+        accumulator_.add(img);
+    }
+
+    virtual void pop(const cv::Mat & img) {
+        accumulator_.subtract(img);
+    }
+
+    // Images in the window have the depth of the filtered image
+    virtual void prepare() {
+        accumulator_.factored_mean(subtraction_factor_, accumulator_.depth(), mean_, mean_f32_);
+    }
+
+    virtual std::unique_ptr< IFilterWindowed> clone() const {
+        return std::make_unique< WindowBckgSubFilter>(subtraction_factor_, radius_);
+    }
+
+    virtual bool is_running() const {
+        return radius_ == 0;
     }
 
     virtual std::string desc() const {
-        return "Background subtraction with factor " + std::to_string(subtraction_factor_);
+        if (is_running())
+            return "Background subtraction with factor " + std::to_string(subtraction_factor_) +
+                " and running mean of all images so far";
+        return "Background subtraction with factor " + std::to_string(subtraction_factor_) +
+            " and sliding window of " + std::to_string(radius_) + " images on each side";
     }
 };
 
@@ -0,0 +1,62 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "FilterChain.h"
+#include "Filter.h"
+#include "MedianBckgSubFilter.h"
+
+#include <memory>
+
+using namespace std;
+
+void FilterChainConfig::add_filters(ImageProcessor & processor) const
+{
+    if (median && (window_radius != 0 || running))
+        throw HranolRuntimeException("Median background can only be computed from all images.");
+    if (!background_file.empty() && (window_radius != 0 || running || median))
+        throw HranolRuntimeException("Background file can only be used with static background subtraction.");
+    if (bit_depth < 8 || bit_depth > 16)
+        throw HranolRuntimeException("Bit depth must be in range [8, 16]: " + to_string(bit_depth));
+
+    if (crop_to_mask && mask_file.empty())
+        throw HranolRuntimeException("Images can only be cropped to the bounding box of a mask.");
+    if (crop_to_mask && roi.area() != 0)
+        throw HranolRuntimeException("Region of interest can't be both given and derived from the mask.");
+    if (roi != cv::Rect() && (roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0))
+        throw HranolRuntimeException("Invalid region of interest.");
+
+    cv::Rect region = roi;
+    if (!mask_file.empty())
+    {
+        auto mask = MaskFilter::create(mask_file);
+        if (crop_to_mask)
+        {
+            region = mask->bounding_box();
+            if (region.area() == 0)
+                throw HranolRuntimeException("Mask \"" + mask_file + "\" masks out the whole image, there is nothing to crop to.");
+        }
+        if (region.area() != 0)
+            mask->crop(region);
+        processor.add_filter(std::move(mask));
+    }
+    processor.set_roi(region);
+
+    if (subtract)
+    {
+        if (!background_file.empty())
+            processor.add_filter(BckgSubFilter::create(subtraction_factor, background_file, (bit_depth > 8) ? CV_16U : CV_8U, region));
+        else if (window_radius != 0)
+            processor.add_filter(WindowBckgSubFilter::create(subtraction_factor, window_radius));
+        else if (running)
+            processor.add_filter(WindowBckgSubFilter::create_running(subtraction_factor));
+        else if (median)
+            processor.add_filter(MedianBckgSubFilter::create(subtraction_factor));
+        else
+            processor.add_filter(BckgSubFilter::create(subtraction_factor));
+    }
+
+    if (rescale)
+        processor.add_filter(ContrastFilter::create(rescale_begin, rescale_end, (1 << bit_depth) - 1));
+}
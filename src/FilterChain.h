@@ -0,0 +1,55 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include "ImageProcessor.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <cstddef>
+#include <string>
+
+
+// FilterChainConfig selects the filters applied to every image, the same way options of hranol
+// do. A filter is used when its options are set.
+struct FilterChainConfig
+{
+    // Mask image file (-m), mask is not applied if empty
+    std::string mask_file;
+
+    // Images are cropped to the region of interest (--roi) and only the region is filtered and
+    // saved, empty rectangle keeps whole images
+    cv::Rect roi;
+    // Region of interest is the bounding box of the mask (--crop)
+    bool crop_to_mask = false;
+
+    // Background subtraction (-s) with given factor
+    bool subtract = false;
+    double subtraction_factor = 1;
+    // Radius of the sliding window (-w), 0 subtracts the background of all images
+    size_t window_radius = 0;
+    // Median of all images instead of the average (--median)
+    bool median = false;
+    // Average of all images so far instead of all images, for images filtered as they arrive
+    // (--watch without -w)
+    bool running = false;
+    // Background loaded from a file instead of being precomputed (--background-from)
+    std::string background_file;
+
+    // Contrast filter (-b, -e) mapping [rescale_begin, rescale_end] to the full range of pixel values
+    bool rescale = false;
+    int rescale_begin = 0;
+    int rescale_end = 255;
+
+    // Significant bits of input pixels (--bit-depth), determines the range of contrast filter
+    int bit_depth = 8;
+
+    // Creates the filters and adds them to processor
+    void add_filters(ImageProcessor & processor) const;
+};
+
+#endif // FILTER_CHAIN_H
@@ -5,55 +5,342 @@
 
 #include "FolderCrawler.h"
 #include "ImageStore.h"
+#include "ContainerImageStore.h"
 #include "HranolException.h"
+#include "RunManifest.h"
 
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <filesystem>
-#include <iostream>
+#include <iomanip>
+#include <memory>
 #include <regex>
+#include <sstream>
 #include <string>
+#include <system_error>
 #include <vector>
-#include <memory>
 
 using namespace std;
 namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+FnameMatcher::FnameMatcher(const string & pattern)
+{
+    if (!compile_suffixes_(pattern))
+        regex_ = regex(pattern);
+}
 
-fs::path find_subfolder_dest(const fs::path & cur_path, const string & dest_folder_prefix)
+bool FnameMatcher::match(const string & fname) const
 {
-    string origin_fname = fs::canonical(cur_path).filename().string();
+    if (suffixes_.empty())
+        return regex_match(fname, regex_);
 
-    // Finds destination folder name.
-    auto dest = cur_path / (dest_folder_prefix + "_" + origin_fname);
+    for (auto&& suffix : suffixes_)
+        if (fname.size() >= suffix.size() && fname.compare(fname.size() - suffix.size(), suffix.size(), suffix) == 0)
+            return true;
 
-    int i = 0;
-    while (i < 100 && fs::exists(dest))
+    return false;
+}
+
+bool FnameMatcher::compile_suffixes_(const string & pattern)
+{
+    // ".*\." followed by a single extension or a group of alternatives
+    const string lead = ".*\\.";
+    if (pattern.compare(0, lead.size(), lead) != 0)
+        return false;
+
+    // Alternatives have to be grouped, otherwise the leading ".*\\." belongs to the first one only
+    string alts = pattern.substr(lead.size());
+    if (!alts.empty() && alts.front() == '(' && alts.back() == ')')
+        alts = alts.substr(1, alts.size() - 2);
+    else if (alts.find('|') != string::npos)
+        return false;
+
+    vector< string> ret;
+    stringstream ss(alts);
+    string alt;
+    while (getline(ss, alt, '|'))
     {
-        // yeah, nasty padding
-        string idx = ((i < 10) ? "0" : "") + to_string(i);
-        dest = cur_path / (dest_folder_prefix + idx + "_" + origin_fname);
+        // Expansions of optional characters of this alternative
+        vector< string> expanded{ "." };
+        for (size_t i = 0; i < alt.size(); ++i)
+        {
+            if (!isalnum((unsigned char) alt[i]))
+                return false;
+
+            bool optional = (i + 1 < alt.size() && alt[i + 1] == '?');
+            size_t n = expanded.size();
+            for (size_t e = 0; e < n; ++e)
+            {
+                if (optional)
+                    expanded.push_back(expanded[e]);
+                expanded[e] += alt[i];
+            }
+            if (optional)
+                ++i;
+
+            // Patterns with many optional characters are left to regex
+            if (expanded.size() > 64)
+                return false;
+        }
+
+        if (alt.empty())
+            return false;
+        ret.insert(ret.end(), expanded.begin(), expanded.end());
+    }
+
+    if (ret.empty())
+        return false;
+
+    suffixes_ = std::move(ret);
+    return true;
+}
+
+bool natural_less(const string & a, const string & b)
+{
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size())
+    {
+        if (isdigit((unsigned char) a[i]) && isdigit((unsigned char) b[j]))
+        {
+            // Compare numbers without leading zeros: longer is bigger, same length lexicographically
+            size_t ib = i, jb = j;
+            while (ib < a.size() && a[ib] == '0')
+                ++ib;
+            while (jb < b.size() && b[jb] == '0')
+                ++jb;
+            size_t ie = ib, je = jb;
+            while (ie < a.size() && isdigit((unsigned char) a[ie]))
+                ++ie;
+            while (je < b.size() && isdigit((unsigned char) b[je]))
+                ++je;
+
+            if (ie - ib != je - jb)
+                return ie - ib < je - jb;
+            int cmp = a.compare(ib, ie - ib, b, jb, je - jb);
+            if (cmp != 0)
+                return cmp < 0;
+            // Same value, fewer leading zeros first
+            if (ie - i != je - j)
+                return ie - i < je - j;
+
+            i = ie;
+            j = je;
+            continue;
+        }
+
+        if (a[i] != b[j])
+            return (unsigned char) a[i] < (unsigned char) b[j];
         ++i;
+        ++j;
+    }
+
+    return a.size() - i < b.size() - j;
+}
+
+// Returns true if folder holds manifest of a run with configuration config (stacks have their
+// manifests in subfolders)
+bool has_manifest(const fs::path & folder, const vector< string> & config)
+{
+    if (RunManifest::matches(folder, config))
+        return true;
+
+    for (auto&& f : fs::directory_iterator(folder))
+        if (fs::is_directory(f.status()) && RunManifest::matches(f.path(), config))
+            return true;
+
+    return false;
+}
+
+fs::path find_subfolder_dest(const fs::path & cur_path, const string & origin_fname,
+    const string & dest_folder_prefix, const vector< string> * resume_config)
+{
+    // Finds destination folder name, -1 stands for the name without index
+    fs::path free_dest, resumed_dest;
+    for (int i = -1; i < 100; ++i)
+    {
+        // yeah, nasty padding
+        string idx = (i < 0) ? "" : ((i < 10) ? "0" : "") + to_string(i);
+        fs::path dest = cur_path / (dest_folder_prefix + idx + "_" + origin_fname);
+
+        if (!fs::exists(dest))
+        {
+            if (free_dest.empty())
+                free_dest = dest;
+            // Without resume the first free name is taken
+            if (!resume_config)
+                break;
+        }
+        // Names with higher indices were created later, the newest matching run is resumed
+        else if (resume_config && fs::is_directory(dest) && has_manifest(dest, *resume_config))
+            resumed_dest = dest;
     }
 
+    if (!resumed_dest.empty())
+        return resumed_dest;
+
     // All possible names were used
-    if (fs::exists(dest))
+    if (free_dest.empty())
         throw HranolRuntimeException("Suitable name for output directory could not be found.");
 
-    return dest;
+    return free_dest;
+}
+
+FolderCrawler::FolderCrawler(
+    vector< string> folders,
+    string output_folder,
+    string folder_prefix,
+    const string & fname_regex_str,
+    bool incl_folder_prefix,
+    bool recursive,
+    StoreMode store_mode,
+    bool any_depth,
+    bool stacks,
+    OutputFormat output_format,
+    Compression compression,
+    bool resume,
+    unsigned listing_threads)
+    : recursive_(recursive), store_mode_(store_mode), memory_budget_(0), huge_pages_(false), any_depth_(any_depth), stacks_(stacks),
+    output_format_(output_format), compression_(compression), resume_(resume),
+    fname_matcher_(fname_regex_str),
+    output_folder_(std::move(output_folder)), folder_prefix_(std::move(folder_prefix)),
+    incl_folder_prefix_(incl_folder_prefix), base_folders_(std::move(folders)),
+    max_listings_(resolve_thread_count(listing_threads)), listings_running_(0), folders_listed_(0), files_matched_(0),
+    listing_ns_(0)
+{
+    for (auto&& folder : base_folders_)
+    {
+        error_code ec;
+        fs::path canonical = fs::canonical(folder, ec);
+        base_names_.push_back(ec ? fs::path(folder).filename().string() : canonical.filename().string());
+    }
+
+    // Loop is reversed so that first folders in the original vector
+    // will be first in the stack
+    int folders_count = (int) base_folders_.size();
+    for (int i = folders_count - 1; i >= 0; --i)
+        crawl_stack_.push_back({ (size_t) i, ".", {} });    // "." to represent origin itself
+
+    start_listings_();
 }
 
 unique_ptr< IImageStore> FolderCrawler::get_next_run()
 {
-    auto cur_pp = crawl_stack_.top();
-    crawl_stack_.pop();
+    // Containers of the last folder go first
+    if (!containers_.empty())
+        return next_container_();
+
+    auto cur_pp = std::move(crawl_stack_.back());
+    crawl_stack_.pop_back();
     
     fs::path cur_path = base_folders_[cur_pp.base_idx] / cur_pp.path;
-    if (!fs::is_directory(cur_path))
-        throw HranolRuntimeException("Path \"" + cur_path.string() + "\" is not a directory.");
+    Listing listing = cur_pp.listing.valid() ? cur_pp.listing.get() : list_folder_(cur_path);
+
+    // Subfolders are pushed in reverse, so that they are processed in natural order
+    for (auto it = listing.subfolders.rbegin(); it != listing.subfolders.rend(); ++it)
+        crawl_stack_.push_back({ cur_pp.base_idx, cur_pp.path / *it, {} });
+    start_listings_();
+
+    vector< fs::path> img_paths = std::move(listing.files);
     
-    vector< fs::path> img_paths;
+    std::filesystem::path dest;
+    if (!output_folder_.empty())  // use output_folder
+        dest = fs::path(output_folder_) / base_names_[cur_pp.base_idx] / cur_pp.path;
+    else                          // use subfolder
+    {
+        string origin_fname = (cur_pp.path == ".") ? base_names_[cur_pp.base_idx] : cur_pp.path.filename().string();
+        dest = find_subfolder_dest(cur_path, origin_fname, folder_prefix_, resume_ ? &resume_config_ : nullptr);
+    }
+
+    dest = dest.lexically_normal();
+    cur_path = cur_path.lexically_normal();
+
+    if (stacks_)
+    {
+        // Frames of each container are written to a subfolder named after the container
+        for (auto&& p : img_paths)
+            containers_.push({ dest / p.stem(), p });
+
+        if (!containers_.empty())
+            return next_container_();
+        img_paths.clear();
+    }
+
+    unique_ptr< IImageStore> store;
+    switch (store_mode_)
+    {
+    case StoreMode::ON_DEMAND:
+        store = make_unique< OnDemandImageStore>(cur_path, dest, std::move(img_paths));
+        break;
+    case StoreMode::SPILL:
+        store = make_unique< SpillImageStore>(cur_path, dest, std::move(img_paths), fs::temp_directory_path());
+        break;
+    case StoreMode::ENCODED:
+        store = make_unique< EncodedImageStore>(cur_path, dest, std::move(img_paths));
+        break;
+    case StoreMode::BUDGET:
+        // Nothing is decoded here, the crawler only lists folders
+        store = make_unique< BudgetImageStore>(cur_path, dest, std::move(img_paths), memory_budget_);
+        break;
+    default:
+        store = make_unique< RAMImageStore>(cur_path, dest, std::move(img_paths), huge_pages_);
+        break;
+    }
+
+    store->set_any_depth(any_depth_);
+    store->set_roi(roi_);
+    store->set_output(output_format_, compression_);
+    store->stats().add_time(RunStats::CRAWL, listing.time);
+    return store;
+}
 
-    for (auto&& f : fs::directory_iterator(cur_path))
+string FolderCrawler::report() const
+{
+    ostringstream ret;
+    ret << folders_listed_ << " folders listed, " << files_matched_ << " files matched in "
+        << fixed << setprecision(2) << listing_ns_ / 1e9 << " s";
+    if (max_listings_ > 1)
+        ret << " (summed over " << max_listings_ << " threads)";
+    return ret.str();
+}
+
+void FolderCrawler::start_listings_()
+{
+    for (auto it = crawl_stack_.rbegin(); it != crawl_stack_.rend() && listings_running_ < max_listings_; ++it)
+    {
+        if (it->listing.valid())
+            continue;
+
+        ++listings_running_;
+        fs::path folder = base_folders_[it->base_idx] / it->path;
+        it->listing = async(launch::async, [this, folder]() {
+            // The listing is counted as running until it finishes, even if it throws
+            struct Running {
+                atomic< unsigned> & count;
+                ~Running() { --count; }
+            } running{ listings_running_ };
+
+            return list_folder_(folder);
+        }).share();
+    }
+}
+
+FolderCrawler::Listing FolderCrawler::list_folder_(const fs::path & folder)
+{
+    auto start = Clock::now();
+
+    if (!fs::is_directory(folder))
+        throw HranolRuntimeException("Path \"" + folder.string() + "\" is not a directory.");
+
+    Listing ret;
+    for (auto&& f : fs::directory_iterator(folder))
     {
-        if (fs::is_directory(f.status()))
+        // File type cached by the directory entry is used whenever possible
+        error_code ec;
+        if (f.is_directory(ec))
         {
             if (!recursive_)
                 continue;
@@ -62,29 +349,42 @@ unique_ptr< IImageStore> FolderCrawler::get_next_run()
             // Trick used:
             // rfind(key, 0) returns the position of the first character of the last match
             // starting at posisition 0. If no match is found, string::npos is returned.
-            if (!incl_folder_prefix_ && f.path().filename().string().rfind(folder_prefix_, 0) == 0)
+            string name = f.path().filename().string();
+            if (!incl_folder_prefix_ && name.rfind(folder_prefix_, 0) == 0)
                 continue;
 
-            crawl_stack_.emplace(cur_pp.base_idx, cur_pp.path / f.path().filename()) ;
+            ret.subfolders.push_back(std::move(name));
         }
-        else if (fs::is_regular_file(f.status())) 
+        else if (f.is_regular_file(ec)) 
         {
-            if (regex_match(f.path().filename().string(), fname_regex_))
-                img_paths.push_back(f.path());
+            if (fname_matcher_.match(f.path().filename().string()))
+                ret.files.push_back(f.path());
         }
     }
-    
-    std::filesystem::path dest;
-    if (!output_folder_.empty())  // use output_folder
-        dest = output_folder_ / fs::canonical(base_folders_[cur_pp.base_idx]).filename() / cur_pp.path;
-    else                          // use subfolder
-        dest = find_subfolder_dest(cur_path, folder_prefix_);
 
-    dest = dest.lexically_normal();
-    cur_path = cur_path.lexically_normal();
+    // Directory iteration order is unspecified, images are processed in natural order of their names
+    sort(ret.files.begin(), ret.files.end(), [](const fs::path & a, const fs::path & b) {
+        return natural_less(a.filename().string(), b.filename().string());
+    });
+    sort(ret.subfolders.begin(), ret.subfolders.end(), [](const fs::path & a, const fs::path & b) {
+        return natural_less(a.string(), b.string());
+    });
+
+    ++folders_listed_;
+    files_matched_ += ret.files.size();
+    ret.time = Clock::now() - start;
+    listing_ns_ += chrono::duration_cast< chrono::nanoseconds>(ret.time).count();
+    return ret;
+}
 
-    if (ram_friendly_)
-        return make_unique< OnDemandImageStore>(cur_path, dest, std::move(img_paths));
-    else 
-        return make_unique< RAMImageStore>(cur_path, dest, std::move(img_paths));
-}
\ No newline at end of file
+unique_ptr< IImageStore> FolderCrawler::next_container_()
+{
+    auto pc = std::move(containers_.front());
+    containers_.pop();
+
+    auto store = ContainerImageStore::open(pc.dest, pc.container);
+    store->set_any_depth(any_depth_);
+    store->set_roi(roi_);
+    store->set_output(output_format_, compression_);
+    return store;
+}
@@ -8,34 +8,126 @@
 
 #include "ImageStore.h"
 
-#include <regex>
-#include <vector>
-#include <string>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
-#include <stack>
+#include <future>
 #include <memory>
+#include <queue>
+#include <regex>
+#include <string>
+#include <vector>
+
+// Type of IImageStore created for each run
+enum class StoreMode {
+    RAM,        // RAMImageStore
+    ON_DEMAND,  // OnDemandImageStore
+    SPILL,      // SpillImageStore with scratch file in the system temporary directory
+    ENCODED,    // EncodedImageStore
+    BUDGET      // BudgetImageStore, keeps the whole folder like RAMImageStore if it fits into the budget
+};
+
+// FnameMatcher matches file names against ECMAScript regex. Patterns of the form
+// ".*\.(ext1|ext2|...)" (e.g. the default one), where extensions consist of letters and digits
+// optionally followed by "?", are compiled into a list of suffixes, so no regex is run for them.
+class FnameMatcher
+{
+    std::regex regex_;
+    // Suffixes including the dot, empty if regex_ is used
+    std::vector< std::string> suffixes_;
+
+public:
+    explicit FnameMatcher(const std::string & pattern);
+
+    bool match(const std::string & fname) const;
+
+    // Returns true if the pattern was compiled into suffixes
+    bool is_suffix_matcher() const {
+        return !suffixes_.empty();
+    }
+
+private:
+    // Expands pattern into suffixes, returns false if it is not of the supported form
+    bool compile_suffixes_(const std::string & pattern);
+};
+
+// Returns true if a goes before b in natural order, where runs of digits are compared by
+// their numeric value ("frame2.png" < "frame10.png")
+bool natural_less(const std::string & a, const std::string & b);
+
+// Returns destination subfolder "<prefix>_<origin_fname>" in cur_path, or the first free "<prefix><NN>_<origin_fname>"
+// if it exists already. With resume_config set, the newest existing destination holding a manifest
+// with that configuration (see RunManifest::matches) is returned instead. Destinations with other
+// configurations are never reused.
+std::filesystem::path find_subfolder_dest(const std::filesystem::path & cur_path,
+    const std::string & origin_fname, const std::string & dest_folder_prefix,
+    const std::vector< std::string> * resume_config);
 
 // FolderCrawler is used to crawl (potentially recursively) folders in crawl_stack_ and picks
 // the files that should be filtered.
 class FolderCrawler {
-    // PathPair contains index to base_folders_ vector and path extension from this base 
+    // Files and subfolders of a single folder
+    struct Listing {
+        std::vector< std::filesystem::path> files;
+        std::vector< std::filesystem::path> subfolders;
+        // Time it took to list the folder
+        std::chrono::steady_clock::duration time;
+    };
+
+    // PathPair contains index to base_folders_ vector and path extension from this base.
+    // Listing of the folder runs ahead on another thread, listing is not valid until it is started.
     struct PathPair {
         size_t base_idx;
         std::filesystem::path path;
-
-        PathPair(size_t base_idx_p, std::filesystem::path path_p)
-            : base_idx(base_idx_p), path(std::move(path_p)) { }
+        std::shared_future< Listing> listing;
     };
 
     bool recursive_;
-    bool ram_friendly_;
-    std::regex fname_regex_;
+    StoreMode store_mode_;
+    // Memory budget of a single run in StoreMode::BUDGET
+    size_t memory_budget_;
+    // Passed to created RAMImageStores
+    bool huge_pages_;
+    // Passed to IImageStore::set_any_depth of created stores
+    bool any_depth_;
+    // Passed to IImageStore::set_roi of created stores
+    cv::Rect roi_;
+    // Each matched file is a container (stack of frames) processed as a separate run
+    bool stacks_;
+    // Passed to IImageStore::set_output of created stores
+    OutputFormat output_format_;
+    Compression compression_;
+    // Output subfolder of an interrupted run with configuration resume_config_ is reused
+    // instead of creating a new one
+    bool resume_;
+    std::vector< std::string> resume_config_;
+    FnameMatcher fname_matcher_;
     std::string output_folder_;
     std::string folder_prefix_;
     bool incl_folder_prefix_;
 
     std::vector< std::string> base_folders_;
-    std::stack< PathPair> crawl_stack_;
+    // Names of base folders (canonical paths are resolved only once)
+    std::vector< std::string> base_names_;
+
+    // Maximal number of folders listed concurrently ahead of get_next_run
+    unsigned max_listings_;
+    std::atomic< unsigned> listings_running_;
+    // Statistics of the discovery
+    std::atomic< size_t> folders_listed_;
+    std::atomic< size_t> files_matched_;
+    std::atomic< long long> listing_ns_;
+
+    // Declared after the counters, so that running listings finish before the counters are destroyed.
+    // The top of the stack is the back of the vector.
+    std::vector< PathPair> crawl_stack_;
+
+    // Containers found in the last crawled folder that were not returned as runs yet
+    struct PendingContainer {
+        std::filesystem::path dest;
+        std::filesystem::path container;
+    };
+    std::queue< PendingContainer> containers_;
 
 public:
     FolderCrawler(
@@ -45,26 +137,52 @@ public:
         const std::string & fname_regex_str,
         bool incl_folder_prefix,
         bool recursive, 
-        bool ram_friendly) 
-        : recursive_(recursive), ram_friendly_(ram_friendly), fname_regex_(fname_regex_str),
-        output_folder_(std::move(output_folder)), folder_prefix_(std::move(folder_prefix)),
-        incl_folder_prefix_(incl_folder_prefix), base_folders_(std::move(folders))
-
-    {
-        // Loop is reversed so that first folders in the original vector
-        // will be first in the stack
-        int folders_count = (int) base_folders_.size();
-        for (int i = folders_count - 1; i >= 0; --i)
-            crawl_stack_.emplace((size_t) i, ".");    // "." to represent origin itself
-    }
+        StoreMode store_mode,
+        bool any_depth = false,
+        bool stacks = false,
+        OutputFormat output_format = OutputFormat::FILES,
+        Compression compression = Compression::DEFAULT,
+        bool resume = false,
+        unsigned listing_threads = 0);  // folders listed concurrently, 0 for the number of cores
 
     // Inspects a single folder and returns IImageStore that contains
-    // all files from the folder that matched fname_regex_
+    // all files from the folder that matched fname_regex_. With stacks_ each matched
+    // file is returned as a separate run (ContainerImageStore).
     std::unique_ptr< IImageStore> get_next_run();
 
+    // Memory budget of a single run in bytes, used by StoreMode::BUDGET
+    void set_memory_budget(size_t budget) {
+        memory_budget_ = budget;
+    }
+
+    // Decoded images of RAMImageStores are backed by transparent huge pages
+    void set_huge_pages(bool huge_pages) {
+        huge_pages_ = huge_pages;
+    }
+
+    // Images of created stores are cropped to roi
+    void set_roi(const cv::Rect & roi) {
+        roi_ = roi;
+    }
+
+    // Configuration of runs that can be resumed (see ImageProcessor::manifest_config)
+    void set_resume_config(std::vector< std::string> config) {
+        resume_config_ = std::move(config);
+    }
+
     bool has_next_run() {
-        return !crawl_stack_.empty();
+        return !crawl_stack_.empty() || !containers_.empty();
     }
+
+    // Describes the discovery so far, e.g. "12 folders listed, 50000 files matched in 0.8 s"
+    std::string report() const;
+
+private:
+    std::unique_ptr< IImageStore> next_container_();
+    // Starts listings of folders closest to the top of the crawl stack, so that at most
+    // max_listings_ listings run at once
+    void start_listings_();
+    Listing list_folder_(const std::filesystem::path & folder);
 };
 
 #endif // FOLDER_CRAWLER_H
@@ -0,0 +1,296 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "FolderWatcher.h"
+#include "HranolException.h"
+
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+using namespace std;
+namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+namespace
+{
+    // Listed file that was not modified for this long is considered written
+    const auto SETTLE_TIME = chrono::seconds(1);
+    // Interval of checks of listed files while waiting
+    const int SETTLE_POLL_MS = 200;
+}
+
+FolderWatcher::FolderWatcher(
+    vector< string> folders,
+    string output_folder,
+    string folder_prefix,
+    const string & fname_regex_str,
+    bool recursive,
+    bool any_depth,
+    Compression compression)
+    : recursive_(recursive), any_depth_(any_depth), compression_(compression),
+    fname_matcher_(fname_regex_str), output_folder_(std::move(output_folder)),
+    folder_prefix_(std::move(folder_prefix)), base_folders_(std::move(folders)), fd_(-1)
+{
+#ifdef __linux__
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0)
+        throw HranolRuntimeException(string("Starting the watch failed: ") + strerror(errno));
+
+    for (auto&& folder : base_folders_)
+    {
+        error_code ec;
+        fs::path canonical = fs::canonical(folder, ec);
+        base_names_.push_back(ec ? fs::path(folder).filename().string() : canonical.filename().string());
+    }
+
+    try {
+        for (size_t i = 0; i < base_folders_.size(); ++i)
+            add_folder_(i, ".");
+    }
+    catch (...) {
+        close(fd_);
+        throw;
+    }
+#else
+    throw HranolRuntimeException("Watch mode is supported only on Linux.");
+#endif
+}
+
+FolderWatcher::~FolderWatcher()
+{
+#ifdef __linux__
+    if (fd_ >= 0)
+        close(fd_);
+#endif
+}
+
+vector< unique_ptr< IImageStore>> FolderWatcher::wait(int timeout_ms)
+{
+#ifdef __linux__
+    // Events that do not pick up any image (e.g. a file being created) do not end the wait.
+    // Files picked up while listing new folders are returned without waiting.
+    auto deadline = Clock::now() + chrono::milliseconds(max(0, timeout_ms));
+    do
+    {
+        int remaining_ms = timeout_ms;
+        if (timeout_ms >= 0)
+            remaining_ms = (int) max< long long>(0,
+                chrono::duration_cast< chrono::milliseconds>(deadline - Clock::now()).count());
+
+        int poll_ms = found_.empty() ? remaining_ms : 0;
+        if (!pending_.empty() && (poll_ms < 0 || poll_ms > SETTLE_POLL_MS))
+            poll_ms = SETTLE_POLL_MS;
+
+        pollfd pfd{ fd_, POLLIN, 0 };
+        int ready = poll(&pfd, 1, poll_ms);
+        if (ready < 0 && errno != EINTR)
+            throw HranolRuntimeException(string("Waiting for new images failed: ") + strerror(errno));
+        if (ready > 0)
+            read_events_();
+        pick_settled_();
+    } while (found_.empty() && (timeout_ms < 0 || Clock::now() < deadline));
+#else
+    (void) timeout_ms;
+#endif
+
+    // Files are grouped by folders in order of the first file of each folder
+    vector< size_t> order;
+    map< size_t, vector< fs::path>> files;
+    for (auto&& f : found_)
+    {
+        auto & folder_files = files[f.first];
+        if (folder_files.empty())
+            order.push_back(f.first);
+        folder_files.push_back(std::move(f.second));
+    }
+    found_.clear();
+
+    vector< unique_ptr< IImageStore>> ret;
+    for (size_t idx : order)
+    {
+        const Folder & folder = folders_[idx];
+        fs::path origin = (fs::path(base_folders_[folder.base_idx]) / folder.path).lexically_normal();
+
+        auto store = make_unique< OnDemandImageStore>(origin, folder.dest, std::move(files[idx]));
+        store->set_any_depth(any_depth_);
+        store->set_roi(roi_);
+        store->set_output(OutputFormat::FILES, compression_);
+        ret.push_back(std::move(store));
+    }
+    return ret;
+}
+
+void FolderWatcher::add_folder_(size_t base_idx, const fs::path & path)
+{
+#ifdef __linux__
+    fs::path cur_path = fs::path(base_folders_[base_idx]) / path;
+
+    // New subfolders are reported by IN_CREATE (or IN_MOVED_TO) with IN_ISDIR
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+    if (recursive_)
+        mask |= IN_CREATE;
+    int wd = inotify_add_watch(fd_, cur_path.c_str(), mask);
+    if (wd < 0)
+        throw HranolRuntimeException("Watching folder \"" + cur_path.string() + "\" failed: " + strerror(errno));
+
+    // Folder can be added twice, e.g. when it is created while its parent is being listed
+    if (watches_.count(wd) != 0)
+        return;
+
+    fs::path dest;
+    if (!output_folder_.empty())
+        dest = fs::path(output_folder_) / base_names_[base_idx] / path;
+    else
+    {
+        string origin_fname = (path == ".") ? base_names_[base_idx] : path.filename().string();
+        dest = find_subfolder_dest(cur_path, origin_fname, folder_prefix_, nullptr);
+    }
+
+    size_t idx = folders_.size();
+    folders_.push_back({ base_idx, path, dest.lexically_normal() });
+    watches_.emplace(wd, idx);
+
+    // Images written before the watch was added. Those written meanwhile are reported
+    // by inotify as well, seen_ filters them out. Listed images may still be written, they
+    // wait in pending_ until they are closed or settle.
+    vector< fs::path> files, subfolders;
+    error_code ec;
+    for (auto&& f : fs::directory_iterator(cur_path, ec))
+    {
+        string fname = f.path().filename().string();
+        error_code type_ec;
+        if (f.is_directory(type_ec))
+        {
+            if (recursive_ && !is_excluded_(fname))
+                subfolders.push_back(fname);
+        }
+        else if (f.is_regular_file(type_ec) && fname_matcher_.match(fname))
+            files.push_back(f.path().lexically_normal());
+    }
+
+    auto by_name = [](const fs::path & a, const fs::path & b) {
+        return natural_less(a.filename().string(), b.filename().string());
+    };
+    sort(files.begin(), files.end(), by_name);
+    sort(subfolders.begin(), subfolders.end(), by_name);
+
+    for (auto&& f : files)
+        if (seen_.count(f) == 0)
+            pending_.emplace_back(idx, f);
+
+    for (auto&& sub : subfolders)
+        add_folder_(base_idx, path / sub);
+#else
+    (void) base_idx;
+    (void) path;
+#endif
+}
+
+void FolderWatcher::read_events_()
+{
+#ifdef __linux__
+    alignas(inotify_event) char buf[64 * 1024];
+    for (;;)
+    {
+        ssize_t len = read(fd_, buf, sizeof(buf));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            throw HranolRuntimeException(string("Reading watch events failed: ") + strerror(errno));
+        }
+
+        for (char * p = buf; p < buf + len; )
+        {
+            const inotify_event * ev = (const inotify_event *) p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                cerr << "\nWarning: too many events at once, some new images were missed." << endl;
+                continue;
+            }
+
+            auto it = watches_.find(ev->wd);
+            if (it == watches_.end())
+                continue;
+            size_t idx = it->second;
+
+            // Watched folder was removed
+            if (ev->mask & IN_IGNORED)
+            {
+                watches_.erase(it);
+                continue;
+            }
+
+            if (ev->len == 0)
+                continue;
+            string fname = ev->name;
+            // Copied, add_folder_ appends to folders_
+            Folder folder = folders_[idx];
+
+            if (ev->mask & IN_ISDIR)
+            {
+                if (recursive_ && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && !is_excluded_(fname))
+                {
+                    // Folder may be gone already
+                    try {
+                        add_folder_(folder.base_idx, folder.path / fname);
+                    }
+                    catch (const HranolException & e) {
+                        cerr << "\nWarning: " << e.what() << endl;
+                    }
+                }
+            }
+            else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && fname_matcher_.match(fname))
+            {
+                fs::path file = (fs::path(base_folders_[folder.base_idx]) / folder.path / fname).lexically_normal();
+                pending_.erase(remove_if(pending_.begin(), pending_.end(),
+                    [&file](const pair< size_t, fs::path> & p) { return p.second == file; }), pending_.end());
+                if (seen_.insert(file).second)
+                    found_.emplace_back(idx, std::move(file));
+            }
+        }
+    }
+#endif
+}
+
+void FolderWatcher::pick_settled_()
+{
+    auto now = fs::file_time_type::clock::now();
+    for (auto it = pending_.begin(); it != pending_.end(); )
+    {
+        error_code ec;
+        auto mtime = fs::last_write_time(it->second, ec);
+        if (!ec && now - mtime < SETTLE_TIME)
+        {
+            ++it;
+            continue;
+        }
+
+        // Files removed meanwhile are dropped
+        if (!ec && seen_.insert(it->second).second)
+            found_.push_back(std::move(*it));
+        it = pending_.erase(it);
+    }
+}
+
+bool FolderWatcher::is_excluded_(const string & folder_name) const
+{
+    // Outputs are written into the watched folders, they must not be filtered again
+    return folder_name.compare(0, folder_prefix_.size(), folder_prefix_) == 0;
+}
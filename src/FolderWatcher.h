@@ -0,0 +1,98 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef FOLDER_WATCHER_H
+#define FOLDER_WATCHER_H
+
+#include "FolderCrawler.h"
+#include "ImageStore.h"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// FolderWatcher watches folders (potentially recursively) for new images, which are then
+// filtered in watch mode. An image is picked up once it was written and closed or moved
+// into a watched folder, so a partially written file is never read. Images that are in the
+// folders when the watch starts (or when their folder is created) are picked up as well, in
+// natural order, once they are closed or were not modified for a while (they may still be
+// written when listed). Every file is picked up only once.
+//
+// Subfolders starting with the folder prefix (e.g. outputs of hranol) are never watched.
+// Destinations of the folders are resolved as with FolderCrawler. Watching uses inotify,
+// so it is supported only on Linux.
+class FolderWatcher
+{
+    struct Folder {
+        size_t base_idx;
+        // Path relative to the base folder, "." for the base folder itself
+        std::filesystem::path path;
+        std::filesystem::path dest;
+    };
+
+    bool recursive_;
+    // Passed to created stores
+    bool any_depth_;
+    cv::Rect roi_;
+    Compression compression_;
+    FnameMatcher fname_matcher_;
+    std::string output_folder_;
+    std::string folder_prefix_;
+
+    std::vector< std::string> base_folders_;
+    std::vector< std::string> base_names_;
+
+    // inotify instance
+    int fd_;
+    std::vector< Folder> folders_;
+    // Watch descriptor -> index to folders_
+    std::map< int, size_t> watches_;
+    // Files picked up but not returned yet (index to folders_ and path)
+    std::vector< std::pair< size_t, std::filesystem::path>> found_;
+    // Listed files that may still be written, picked up once they settle
+    std::vector< std::pair< size_t, std::filesystem::path>> pending_;
+    std::set< std::filesystem::path> seen_;
+
+public:
+    FolderWatcher(
+        std::vector< std::string> folders,
+        std::string output_folder,
+        std::string folder_prefix,
+        const std::string & fname_regex_str,
+        bool recursive,
+        bool any_depth,
+        Compression compression);
+
+    ~FolderWatcher();
+
+    FolderWatcher(const FolderWatcher &) = delete;
+    FolderWatcher & operator=(const FolderWatcher &) = delete;
+
+    // Images of created stores are cropped to roi
+    void set_roi(const cv::Rect & roi) {
+        roi_ = roi;
+    }
+
+    // Waits at most timeout_ms milliseconds (forever if negative) for new images. Returns
+    // a store for every folder with new images, images are in order of their arrival.
+    // Returns no stores if nothing arrived in time.
+    std::vector< std::unique_ptr< IImageStore>> wait(int timeout_ms);
+
+private:
+    // Starts watching the folder and picks up images it already holds. With recursive_
+    // its subfolders are added as well.
+    void add_folder_(size_t base_idx, const std::filesystem::path & path);
+    void read_events_();
+    // Moves pending files that were not modified recently to found_
+    void pick_settled_();
+    bool is_excluded_(const std::string & folder_name) const;
+};
+
+#endif // FOLDER_WATCHER_H
@@ -0,0 +1,55 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "FrameFilter.h"
+
+#include <utility>
+
+using namespace std;
+
+FrameFilter::FrameFilter(const FilterChainConfig & config, Callback callback, unsigned threads)
+    : callback_(std::move(callback)), threads_((threads == 0) ? 1 : threads)
+{
+    config.add_filters(processor_);
+    processor_.set_threads(threads_);
+    // Frames are not tied to any folder, there is nothing to report
+    processor_.set_quiet(true);
+}
+
+void FrameFilter::filter(vector< cv::Mat> frames)
+{
+    MemoryImageStore store(std::move(frames), callback_);
+    store.set_roi(processor_.get_roi());
+    processor_.apply_filters(&store);
+}
+
+void FrameFilter::push(vector< cv::Mat> frames)
+{
+    if (!online_)
+    {
+        if (processor_.needs_precomputation())
+            throw HranolRuntimeException("Filters that need precomputation can't filter frames as they arrive.");
+        online_ = make_unique< OnlineRun>(processor_, threads_);
+    }
+
+    // Indices of the store start from 0 with every push
+    size_t first = online_->count();
+    MemoryImageStore store(std::move(frames), [this, first](size_t i, const cv::Mat & frame) {
+        callback_(first + i, frame);
+    });
+    store.set_roi(processor_.get_roi());
+    online_->filter(&store);
+}
+
+void FrameFilter::push(cv::Mat frame)
+{
+    push(vector< cv::Mat>{ std::move(frame) });
+}
+
+void FrameFilter::push(void * data, int rows, int cols, int type, size_t step)
+{
+    // Header only, the frame is filtered in the caller's buffer
+    push(cv::Mat(rows, cols, type, data, step));
+}
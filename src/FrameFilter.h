@@ -0,0 +1,69 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef FRAME_FILTER_H
+#define FRAME_FILTER_H
+
+#include "FilterChain.h"
+#include "ImageProcessor.h"
+#include "ImageStore.h"
+#include "OnlineRun.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+
+// FrameFilter is the in-memory interface of libhranol. It applies the filters of hranol to
+// frames that are already in memory (e.g. coming from a frame grabber), nothing is read from
+// or written to disk. Frames are filtered in place, without copying, and every filtered frame
+// is passed to the callback. Pass a copy of a frame if its original content is still needed.
+//
+// A complete sequence can be filtered at once with filter(), the same way hranol filters a folder
+// (including the precomputation pass over all frames). Frames coming one by one are filtered with
+// push() as in watch mode: there is no precomputation pass, background is the running average
+// (FilterChainConfig::running) or the average of the sliding window of preceding frames.
+//
+// With a region of interest (FilterChainConfig::roi or crop_to_mask) only the region of every
+// frame is filtered and the callback gets a header of the region within the frame.
+//
+// With more than one thread the callback is called concurrently from the worker threads.
+class FrameFilter
+{
+public:
+    // Called with index of the frame and the filtered frame, the frame stays valid
+    // until its owner frees it
+    using Callback = MemoryImageStore::SaveFn;
+
+private:
+    ImageProcessor processor_;
+    Callback callback_;
+    unsigned threads_;
+    // Filters pushed frames, created by the first push
+    std::unique_ptr< OnlineRun> online_;
+
+public:
+    FrameFilter(const FilterChainConfig & config, Callback callback, unsigned threads = 1);
+
+    // Filters a complete sequence of frames, frames are indexed from 0 within the sequence.
+    // 8-bit and 16-bit single channel frames are supported.
+    void filter(std::vector< cv::Mat> frames);
+
+    // Filters frames as they arrive, pushed frames are indexed from 0 in order of their arrival.
+    // Filters that need precomputation can be used only with background loaded from a file.
+    void push(std::vector< cv::Mat> frames);
+    void push(cv::Mat frame);
+    // Frame of given size and type (CV_8UC1 or CV_16UC1) at data, rows are step bytes apart
+    void push(void * data, int rows, int cols, int type, size_t step);
+
+    // Number of frames pushed so far
+    size_t pushed() const {
+        return online_ ? online_->count() : 0;
+    }
+};
+
+#endif // FRAME_FILTER_H
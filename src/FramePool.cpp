@@ -0,0 +1,43 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "FramePool.h"
+
+#include <utility>
+
+using namespace std;
+
+cv::Mat FramePool::acquire()
+{
+    lock_guard< mutex> lock(mtx_);
+    if (free_.empty())
+        return cv::Mat();
+
+    // The most recently freed buffer is the most likely to be still in cache
+    cv::Mat ret = std::move(free_.back());
+    free_.pop_back();
+    return ret;
+}
+
+void FramePool::recycle(cv::Mat & img)
+{
+    // Headers of external memory have no allocation, submatrices are not the whole buffer
+    bool owned = img.u != nullptr && img.u->refcount == 1 && !img.isSubmatrix();
+    if (!owned)
+    {
+        img.release();
+        return;
+    }
+
+    lock_guard< mutex> lock(mtx_);
+    free_.push_back(std::move(img));
+    img.release();
+}
+
+size_t FramePool::size()
+{
+    lock_guard< mutex> lock(mtx_);
+    return free_.size();
+}
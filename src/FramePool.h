@@ -0,0 +1,44 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include "opencv2/core/mat.hpp"
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+
+// FramePool keeps buffers of images that are not needed anymore, so that the next image of
+// the same size and type is decoded (or copied) into one of them instead of a new allocation.
+// All images of a run usually have the same geometry, so after the first few images nothing
+// is allocated per image. The pool holds at most as many buffers as were in use at once.
+// acquire() and recycle() can be called from multiple threads.
+class FramePool
+{
+    std::vector< cv::Mat> free_;
+    std::mutex mtx_;
+
+public:
+    FramePool() {}
+
+    FramePool(const FramePool &) = delete;
+    FramePool & operator=(const FramePool &) = delete;
+
+    // Returns a free buffer, or an empty Mat if there is none. OpenCV reuses the buffer when
+    // an image of the same size and type is decoded or copied into it.
+    cv::Mat acquire();
+
+    // Returns the buffer of img to the pool and leaves img empty. Buffers still referenced by
+    // another Mat and memory img does not own (e.g. slab or scratch file) are only released.
+    void recycle(cv::Mat & img);
+
+    // Number of free buffers
+    size_t size();
+};
+
+#endif // FRAME_POOL_H
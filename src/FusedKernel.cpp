@@ -0,0 +1,157 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "FusedKernel.h"
+#include "MedianBckgSubFilter.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+    // Number of pixels processed at once, small enough for a block to stay in L1 cache
+    const int BLOCK_SIZE = 4096;
+
+    // The loops below are simple enough to be vectorized by the compiler
+
+    template< typename T>
+    void subtract_block(T * p, const T * mean, int n)
+    {
+        for (int i = 0; i < n; ++i)
+            p[i] = (p[i] > mean[i]) ? (T) (p[i] - mean[i]) : 0;
+    }
+
+    // Values above max_value are looked up as max_value
+    template< typename T>
+    void lut_block(T * p, const ushort * lut, int max_value, int n)
+    {
+        for (int i = 0; i < n; ++i)
+            p[i] = (T) lut[min< int>(p[i], max_value)];
+    }
+}
+
+FusedKernel::FusedKernel()
+    : lut_(256), max_value_(255), has_lut_(false), mask_(nullptr), fill_(0)
+{
+    for (int i = 0; i < 256; ++i)
+        lut_[i] = (ushort) i;
+}
+
+unique_ptr< FusedKernel> FusedKernel::create(const PrecompFiltersVec & precomp_filters,
+    const PureFiltersVec & pure_filters)
+{
+    unique_ptr< FusedKernel> ret(new FusedKernel());
+
+    for (auto&& of : precomp_filters)
+    {
+        if (!ret->mean_.empty())
+            return nullptr;
+
+        if (auto bckg = dynamic_cast< const BckgSubFilter *>(of.get()))
+            ret->mean_ = bckg->factored_mean();
+        else if (auto median = dynamic_cast< const MedianBckgSubFilter *>(of.get()))
+            ret->mean_ = median->factored_median();
+        else
+            return nullptr;
+    }
+
+    for (auto&& of : pure_filters)
+    {
+        if (auto contrast = dynamic_cast< const ContrastFilter *>(of.get()))
+        {
+            if (!ret->has_lut_ && contrast->max_value() != ret->max_value_)
+            {
+                // First contrast filter decides the depth of the table
+                ret->max_value_ = contrast->max_value();
+                ret->lut_.resize(ret->max_value_ + 1);
+                for (int i = 0; i <= ret->max_value_; ++i)
+                    ret->lut_[i] = (ushort) i;
+            }
+            else if (contrast->max_value() != ret->max_value_)
+                return nullptr;
+
+            // Composition lut_ := contrast_lut(lut_)
+            const cv::Mat & contrast_lut = contrast->lut();
+            for (auto&& v : ret->lut_)
+                v = (contrast_lut.depth() == CV_8U) ? contrast_lut.ptr()[v] : contrast_lut.ptr< ushort>()[v];
+            ret->fill_ = (contrast_lut.depth() == CV_8U) ? contrast_lut.ptr()[ret->fill_] : contrast_lut.ptr< ushort>()[ret->fill_];
+            ret->has_lut_ = true;
+        }
+        else if (auto mask = dynamic_cast< const MaskFilter *>(of.get()))
+        {
+            if (ret->mask_ != nullptr)
+                return nullptr;
+
+            ret->mask_ = mask;
+            // Masked out pixels are 0, only contrast filters applied after the mask change them
+            ret->fill_ = 0;
+        }
+        else
+            return nullptr;
+    }
+
+    return ret;
+}
+
+bool FusedKernel::apply_to(cv::Mat & img) const
+{
+    // Contrast table decides the depth, without it both 8-bit and 16-bit images can be filtered
+    int depth = img.depth();
+    if (img.channels() != 1 || (depth != CV_8U && depth != CV_16U))
+        return false;
+    if (has_lut_ && depth != ((max_value_ == 255) ? CV_8U : CV_16U))
+        return false;
+    if (!mean_.empty() && (mean_.type() != img.type() || mean_.size() != img.size()))
+        return false;
+    if (mask_ && mask_->mask().size() != img.size())
+        return false;
+
+    if (depth == CV_8U)
+        apply_rows_< uchar>(img);
+    else
+        apply_rows_< ushort>(img);
+
+    return true;
+}
+
+template< typename T>
+void FusedKernel::apply_rows_(cv::Mat & img) const
+{
+    for (int r = 0; r < img.rows; ++r)
+    {
+        T * p = img.ptr< T>(r);
+        const T * mean = mean_.empty() ? nullptr : mean_.ptr< T>(r);
+
+        if (mask_ == nullptr)
+        {
+            filter_span_(p, mean, 0, img.cols);
+            continue;
+        }
+
+        // Kept pixels are filtered, masked out spans are filled without reading the pixels
+        int c = 0;
+        for (auto s = mask_->spans_begin(r); s != mask_->spans_end(r); ++s)
+        {
+            filter_span_(p, mean, c, s->begin);
+            fill_n(p + s->begin, s->end - s->begin, (T) fill_);
+            c = s->end;
+        }
+        filter_span_(p, mean, c, img.cols);
+    }
+}
+
+template< typename T>
+void FusedKernel::filter_span_(T * p, const T * mean, int begin, int end) const
+{
+    for (int c = begin; c < end; c += BLOCK_SIZE)
+    {
+        int n = min(BLOCK_SIZE, end - c);
+        if (mean)
+            subtract_block(p + c, mean + c, n);
+        if (has_lut_)
+            lut_block(p + c, lut_.data(), max_value_, n);
+    }
+}
@@ -0,0 +1,61 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef FUSED_KERNEL_H
+#define FUSED_KERNEL_H
+
+#include "Filter.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <memory>
+#include <vector>
+
+
+// FusedKernel applies the standard filter chain (background subtraction, contrast filters
+// and mask) in a single sweep over the image instead of one sweep per filter. Each row is
+// processed in short blocks that stay in cache: saturated subtraction of the factored mean
+// and lookup in the composition of all contrast LUTs. Masked out spans of the row are skipped
+// and just filled with the resulting value of masked out pixels.
+//
+// The result is identical to applying the filters one by one.
+class FusedKernel
+{
+    // Factored mean of BckgSubFilter, empty if there is no background subtraction
+    cv::Mat mean_;
+    // Composition of LUTs of all contrast filters, max_value_ + 1 entries
+    std::vector< ushort> lut_;
+    // Maximal value of contrast filters, 255 for 8-bit images
+    int max_value_;
+    bool has_lut_;
+    // Mask filter (its spans are used), nullptr if there is no mask. The filter must outlive the kernel.
+    const MaskFilter * mask_;
+    // Value of masked out pixels (0 transformed by contrast filters following the mask)
+    int fill_;
+
+    FusedKernel();
+
+    // T is uchar for 8-bit and ushort for 16-bit images
+    template< typename T>
+    void apply_rows_(cv::Mat & img) const;
+    // Filters pixels [begin, end) of the row p, mean is the corresponding row of mean_ or nullptr
+    template< typename T>
+    void filter_span_(T * p, const T * mean, int begin, int end) const;
+
+public:
+    // Creates fused kernel for given filters (precomputation must be finished), in the order
+    // ImageProcessor applies them. Returns nullptr if the chain can't be fused, i.e. it contains
+    // other filters than BckgSubFilter, ContrastFilter and MaskFilter, or more than one mask.
+    static std::unique_ptr< FusedKernel> create(const PrecompFiltersVec & precomp_filters,
+        const PureFiltersVec & pure_filters);
+
+    // Filters img in place. Returns false (and leaves img untouched) if the kernel can't be
+    // used for img, e.g. img is not single-channel 8-bit or 16-bit image (matching the depth
+    // of contrast filters) or has an unexpected size.
+    // The generic filter chain should be used in that case.
+    bool apply_to(cv::Mat & img) const;
+};
+
+#endif // FUSED_KERNEL_H
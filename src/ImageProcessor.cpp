@@ -4,13 +4,25 @@
 // 
 
 #include "ImageProcessor.h"
+#include "BoundedQueue.h"
 #include "ImageStore.h"
 #include "Filter.h"
+#include "Parallel.h"
+#include "Pipeline.h"
+#include "Progress.h"
+#include "RunManifest.h"
 
 #include "opencv2/core/core.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include <iomanip> // put_time
@@ -18,74 +30,577 @@
 
 using namespace std;
 
+namespace
+{
+    // Beginning of the file holding precomputed data of all filters with precomputation
+    const char * STATE_MAGIC = "HRNLPRC1";
+}
+
+
+unique_ptr< ImageProcessor> ImageProcessor::clone() const
+{
+    auto ret = make_unique< ImageProcessor>();
+    ret->threads_ = threads_;
+    ret->queue_depth_ = queue_depth_;
+    ret->quiet_ = quiet_;
+    ret->fusion_enabled_ = fusion_enabled_;
+    ret->save_background_ = save_background_;
+    ret->resume_ = resume_;
+    ret->print_stats_ = print_stats_;
+    ret->roi_ = roi_;
+
+    if (windowed_)
+        ret->windowed_ = windowed_->clone();
+
+    for (auto&& of : pure_filters_)
+        ret->pure_filters_.push_back(of->clone());
+
+    // Shards can share precomputation data with their filter, clear() gives the clone its own
+    for (auto&& of : precomp_filters_)
+    {
+        ret->precomp_filters_.push_back(of->create_shard());
+        ret->precomp_filters_.back()->clear();
+    }
+
+    return ret;
+}
+
+size_t ImageProcessor::max_loaded_images(unsigned threads) const
+{
+    // Images of the window (loaded ahead of the filtered one or copies behind it), the filtered
+    // one and the images finished by the workers or waiting for them
+    if (windowed_)
+        return 2 * windowed_->radius() + 2 + 2 * (size_t) threads;
+
+    // One image per worker of every pipeline stage plus the images waiting in the queues
+    if (queue_depth_ > 0)
+        return 3 * threads + 2 * queue_depth_;
+
+    return threads;
+}
 
 void ImageProcessor::apply_filters(IImageStore * imstore)
 {
     // Print currently processing folder 
-    cout << "\"" << imstore->get_origin().string() << "\":" << endl;
+    if (!quiet_)
+        cout << "\"" << imstore->get_origin().string() << "\":" << endl;
+
+    auto store_sz = imstore->size();
 
     // Clear precomputed data from previous run in precomp_filters_
     // Pure filters do not store any run-specific data so they do not
     // have to be cleared
     for (auto&& of : precomp_filters_)
+    {
         of->clear();
-
-    auto store_sz = imstore->size();
+        of->reserve(store_sz);
+    }
      
     // If there is no work to do, return
     if (store_sz == 0)
         return;
 
-    if (!precomp_filters_.empty()) 
+    if (windowed_ && windowed_->is_running())
+        throw HranolRuntimeException("Running background subtraction can only be used in watch mode.");
+
+    imstore->set_pool(pool_);
+    RunStats & stats = imstore->stats();
+    stats.start();
+    track_stats_(stats);
+    // stats_ points into the store, it must not outlive the run even if the run fails (the
+    // processor is reused by OnlineRun and FrameFilter)
+    struct StatsReset
+    {
+        ImageProcessor * processor;
+        ~StatsReset() { processor->stats_ = nullptr; }
+    } stats_reset{ this };
+
+    // Stores without an output folder (see MemoryImageStore) keep no records on disk
+    bool on_disk = !imstore->get_dest().empty();
+    unique_ptr< RunManifest> manifest;
+    if (on_disk)
     {
+        imstore->create_dest();
+        manifest = make_unique< RunManifest>(imstore, manifest_config(imstore->get_any_depth()));
+    }
+    // Stacks are written from scratch, so their frames can't be reused
+    bool resumed = manifest && resume_ && imstore->get_output_format() == OutputFormat::FILES && manifest->load();
+
+    bool state_loaded = false;
+    if (resumed && needs_precomputation() && manifest->has_state() && manifest->inputs_unchanged())
+        state_loaded = load_state_(manifest->state_path());
+
+    // Images filtered by the previous run are kept unless they (or images they depend on) changed
+    vector< char> keep(store_sz, 0);
+    if (resumed)
         for (size_t i = 0; i < store_sz; ++i)
-        {
-            cout << "\r\tPrecomputing: " << to_string(i + 1) << " / " << to_string(store_sz) << flush;
+            keep[i] = manifest->done(i) && reusable_(*manifest, i, store_sz);
+
+    if (manifest)
+        manifest->start(keep, state_loaded);
+
+    vector< size_t> pending;
+    for (size_t i = 0; i < store_sz; ++i)
+        if (!keep[i])
+            pending.push_back(i);
+    stats.reserve_frames(pending.size());
+
+    // Nothing has to be precomputed if all images are kept
+    bool precomputed = state_loaded;
+    if (needs_precomputation() && !state_loaded && !pending.empty())
+    {
+        precompute_(imstore);
+        precomputed = true;
+        if (manifest && save_state_(manifest->state_path()))
+            manifest->mark_state();
+    }
+
+    if (!save_background_.empty() && precomputed)
+        save_background_file_(imstore);
+
+    prepare_filters_();
+    if (fused_)
+        fused_stage_ = stats.add_stage("apply fused kernel");
+
+    if (!quiet_ && pending.size() < store_sz)
+        cout << "\tResuming: " << store_sz - pending.size() << " / " << store_sz << " images already filtered"
+            << (state_loaded ? ", precomputed data reused" : "") << endl;
+
+    auto saved = [&](size_t i) {
+        if (manifest)
+            manifest->mark_done(i);
+    };
+
+    Progress progress("Filtering", pending.size(), !quiet_);
+    if (windowed_)
+    {
+        // Windowed filter needs images in order, they are streamed in a single pass
+        if (!pending.empty())
+            filter_windowed_(imstore, keep, saved, progress);
+        progress.finish();
+    }
+    // Once the precomputation is done, images are independent of each other and can
+    // be filtered in parallel
+    else if (queue_depth_ > 0)
+    {
+        FilterPipeline pipeline(queue_depth_, threads_);
+        pipeline.run(imstore, pending, [this](cv::Mat & img) { filter_img_(img); }, saved, progress);
+        // Endline after "Filtering: ..." message
+        progress.finish();
+        if (!quiet_)
+            cout << "\tStages busy: " << pipeline.report() << endl;
+    }
+    else
+    {
+        parallel_for(pending.size(), threads_, [&](size_t k, unsigned) {
+            size_t i = pending[k];
             try 
             {
+                auto start = RunStats::Clock::now();
                 cv::Mat & img = imstore->load(i);
-
-                for (auto&& of : precomp_filters_) 
-                    of->precomp_from(img);
-                
+                filter_img_(img);
+                imstore->save(i);
                 imstore->release(i);
+                stats.add_latency(RunStats::Clock::now() - start);
             }
             catch (HranolException &e)
             {
-                e.append("\nPrecomputing failed for image: " + imstore->get_img_path(i));
+                e.append("\nApplying filter(s) failed for image: " + imstore->get_img_path(i));
                 throw;
             }
-        }
-        // Endline after "Precopmuting: ..." message 
-        cout << endl;
+            saved(i);
+            progress.tick();
+        });
+        // Endline after "Filtering: ..." message
+        progress.finish();
+    }
+
+    // E.g. TIFF stack is not readable until its index is written
+    imstore->finish_output();
+
+    stats_ = nullptr;
+    stats.stop();
+    if (on_disk)
+    {
+        manifest->mark_complete();
+        create_log_(imstore);
+        stats.write_json(imstore->get_dest() / "fltrd_stats.json", imstore->get_origin(), imstore->get_dest(), pending.size());
     }
+    if (print_stats_ && !quiet_)
+        cout << stats.summary();
+}
+
+void ImageProcessor::track_stats_(RunStats & stats)
+{
+    stats_ = &stats;
+    if (windowed_)
+        windowed_stage_ = stats.add_stage("apply " + windowed_->desc());
+
+    precomp_stages_.clear();
+    apply_stages_.clear();
+    for (auto&& of : precomp_filters_)
+        precomp_stages_.push_back(stats.add_stage("precompute " + of->desc()));
+    for (auto&& of : precomp_filters_)
+        apply_stages_.push_back(stats.add_stage("apply " + of->desc()));
+    for (auto&& of : pure_filters_)
+        apply_stages_.push_back(stats.add_stage("apply " + of->desc()));
+}
+
+void ImageProcessor::prepare_filters_()
+{
+    for (auto&& of : precomp_filters_)
+        of->finish_precomp();
+
+    // A single filter already needs only one sweep over the image, fusing pays off
+    // from two filters on
+    fused_ = nullptr;
+    if (fusion_enabled_ && precomp_filters_.size() + pure_filters_.size() >= 2)
+        fused_ = FusedKernel::create(precomp_filters_, pure_filters_);
+}
 
-    for (size_t i = 0; i < imstore->size(); ++i)
+void ImageProcessor::filter_img_(cv::Mat & img) const
+{
+    auto start = RunStats::Clock::now();
+    if (fused_ && fused_->apply_to(img))
     {
-        cout << "\r\tFiltering: " << to_string(i + 1) << " / " << to_string(store_sz) << flush;
-        try 
+        record_(fused_stage_, start);
+        return;
+    }
+
+    size_t filter = 0;
+    for (auto&& of : precomp_filters_)
+    {
+        start = RunStats::Clock::now();
+        of->apply_to(img);
+        record_apply_(filter++, start);
+    }
+
+    for (auto&& of : pure_filters_)
+    {
+        start = RunStats::Clock::now();
+        of->apply_to(img);
+        record_apply_(filter++, start);
+    }
+}
+
+cv::Mat ImageProcessor::pooled_copy_(const cv::Mat & img) const
+{
+    cv::Mat ret = pool_->acquire();
+    const uchar * buffer = ret.data;
+    img.copyTo(ret);
+    if (stats_)
+        stats_->add_frame_buffer(ret.data != buffer);
+    return ret;
+}
+
+void ImageProcessor::filter_windowed_(IImageStore * imstore, const vector< char> & keep,
+    const function< void(size_t)> & saved, Progress & progress)
+{
+    auto store_sz = imstore->size();
+    size_t radius = windowed_->radius();
+    windowed_->clear();
+
+    // Original content of images [lo, hi) in the window, image j is in slot j % ring_sz. Images
+    // ahead of the filtered one are still loaded and unmodified, their slots refer to the store.
+    // Images are filtered in place, so an image gets a pooled copy of its original content
+    // right before it is filtered.
+    size_t ring_sz = 2 * radius + 1;
+    vector< cv::Mat> ring(ring_sz);
+    // Load times of the images in the window
+    vector< RunStats::Clock::time_point> loaded(ring_sz);
+    size_t lo = 0, hi = 0;
+
+    // The window has to see images in order, so this thread slides it. Images that went through
+    // the window are finished by the workers: the rest of the filters, save and release.
+    struct Finished
+    {
+        size_t idx;
+        RunStats::Clock::time_point loaded;
+    };
+    BoundedQueue< Finished> finished(threads_);
+
+    exception_ptr first_error;
+    mutex error_mtx;
+    // Stores the exception being handled and stops the workers
+    auto fail = [&]() {
+        lock_guard< mutex> lock(error_mtx);
+        if (!first_error)
+            first_error = current_exception();
+        finished.abort();
+    };
+
+    auto worker = [&]() {
+        Finished item;
+        while (finished.pop(item))
         {
+            try
+            {
+                cv::Mat & img = imstore->load(item.idx);
+                filter_img_(img);
+                imstore->save(item.idx);
+                imstore->release(item.idx);
+                if (stats_)
+                    stats_->add_latency(RunStats::Clock::now() - item.loaded);
+                saved(item.idx);
+            }
+            catch (HranolException &e)
+            {
+                e.append("\nApplying filter(s) failed for image: " + imstore->get_img_path(item.idx));
+                fail();
+                break;
+            }
+            catch (...)
+            {
+                fail();
+                break;
+            }
+            progress.tick();
+        }
+    };
+
+    vector< thread> workers;
+    for (unsigned t = 0; t < threads_; ++t)
+        workers.emplace_back(worker);
+
+    for (size_t i = 0; i < store_sz; ++i)
+    {
+        try
+        {
+            // Window of i-th image is [i - radius, i + radius] truncated to [0, store_sz).
+            // Images leave the window before new ones enter, they share the slots.
+            for (; lo + radius < i; ++lo)
+            {
+                auto start = RunStats::Clock::now();
+                windowed_->pop(ring[lo % ring_sz]);
+                record_(windowed_stage_, start);
+                pool_->recycle(ring[lo % ring_sz]);
+            }
+
+            for (; hi < min(store_sz, i + radius + 1); ++hi)
+            {
+                loaded[hi % ring_sz] = RunStats::Clock::now();
+                ring[hi % ring_sz] = imstore->load(hi);
+                auto start = RunStats::Clock::now();
+                windowed_->push(ring[hi % ring_sz]);
+                record_(windowed_stage_, start);
+            }
+
             cv::Mat & img = imstore->load(i);
+            ring[i % ring_sz] = pooled_copy_(img);
 
-            for (auto&& of : precomp_filters_)
-                of->apply_to(img);
+            // Images kept from the previous run are only needed in the window
+            if (keep[i])
+            {
+                imstore->release(i);
+                continue;
+            }
 
-            for (auto&& of : pure_filters_)
-                of->apply_to(img);
-            
-            imstore->save(i);
-            imstore->release(i);
+            auto start = RunStats::Clock::now();
+            windowed_->prepare();
+            windowed_->apply_to(img);
+            record_(windowed_stage_, start);
         }
         catch (HranolException &e)
         {
             e.append("\nApplying filter(s) failed for image: " + imstore->get_img_path(i));
-            throw;
+            fail();
+            break;
         }
+        catch (...)
+        {
+            fail();
+            break;
+        }
+
+        // Queue is aborted if a worker failed
+        if (!finished.push({ i, loaded[i % ring_sz] }))
+            break;
+    }
+
+    finished.close();
+    for (auto&& w : workers)
+        w.join();
+
+    if (first_error)
+        rethrow_exception(first_error);
+}
+
+void ImageProcessor::precompute_(IImageStore * imstore)
+{
+    auto store_sz = imstore->size();
+    unsigned workers = (unsigned) std::min< size_t>(threads_, store_sz);
+
+    // Filters taking part in the current pass over the images and their stages
+    vector< IFilterWithPrecomp *> active;
+    vector< size_t> active_stages;
+    for (size_t f = 0; f < precomp_filters_.size(); ++f)
+        if (!precomp_filters_[f]->is_precomputed())
+        {
+            active.push_back(precomp_filters_[f].get());
+            active_stages.push_back(precomp_stages_[f]);
+        }
+
+    for (unsigned pass = 1; !active.empty(); ++pass)
+    {
+        // Each worker precomputes into its own set of shards, so no locking is needed while
+        // accumulating. With a single worker the filters are used directly.
+        vector< PrecompFiltersVec> shards;
+        if (workers > 1)
+        {
+            shards.resize(workers);
+            for (auto&& worker_shards : shards)
+                for (auto of : active)
+                {
+                    worker_shards.push_back(of->create_shard());
+                    // Any worker can get all of the images
+                    worker_shards.back()->reserve(store_sz);
+                }
+        }
+
+        string label = (pass == 1) ? "Precomputing" : "Precomputing (pass " + to_string(pass) + ")";
+        Progress progress(label, store_sz, !quiet_);
+        parallel_for(store_sz, workers, [&](size_t i, unsigned worker) {
+            try 
+            {
+                cv::Mat & img = imstore->load(i);
+
+                for (size_t f = 0; f < active.size(); ++f)
+                {
+                    auto start = RunStats::Clock::now();
+                    if (workers > 1)
+                        shards[worker][f]->precomp_from(img);
+                    else
+                        active[f]->precomp_from(img);
+                    record_(active_stages[f], start);
+                }
+                
+                imstore->release(i);
+            }
+            catch (HranolException &e)
+            {
+                e.append("\nPrecomputing failed for image: " + imstore->get_img_path(i));
+                throw;
+            }
+            progress.tick();
+        });
+        // Endline after "Precopmuting: ..." message 
+        progress.finish();
+
+        // Reduction of partial results, always in the same order
+        for (auto&& worker_shards : shards)
+            for (size_t f = 0; f < active.size(); ++f)
+                active[f]->merge_shard(*worker_shards[f]);
+
+        // Only filters that need another pass stay active
+        vector< IFilterWithPrecomp *> next_active;
+        vector< size_t> next_stages;
+        for (size_t f = 0; f < active.size(); ++f)
+            if (active[f]->next_pass())
+            {
+                next_active.push_back(active[f]);
+                next_stages.push_back(active_stages[f]);
+            }
+        active.swap(next_active);
+        active_stages.swap(next_stages);
+    }
+}
+
+string ImageProcessor::roi_desc_() const
+{
+    return "Cropped to region of interest at offset " + to_string(roi_.x) + ", " + to_string(roi_.y) +
+        " of size " + to_string(roi_.width) + " x " + to_string(roi_.height);
+}
+
+vector< string> ImageProcessor::manifest_config(bool any_depth) const
+{
+    // Filters and the depth images are processed in determine the content of saved images
+    vector< string> ret;
+    ret.push_back(string("depth ") + (any_depth ? "native" : "8-bit"));
+    if (roi_.area() != 0)
+        ret.push_back(roi_desc_());
+
+    if (windowed_)
+        ret.push_back(windowed_->desc());
+    for (auto&& of : precomp_filters_)
+        ret.push_back(of->desc());
+    for (auto&& of : pure_filters_)
+        ret.push_back(of->desc());
+
+    return ret;
+}
+
+bool ImageProcessor::reusable_(const RunManifest & manifest, size_t i, size_t store_sz) const
+{
+    // Precomputed data depend on all of the images
+    if (needs_precomputation())
+        return manifest.inputs_unchanged();
+
+    // Filtered image depends on the images in its window
+    if (windowed_)
+    {
+        size_t radius = windowed_->radius();
+        size_t lo = (i > radius) ? i - radius : 0;
+        size_t hi = min(store_sz, i + radius + 1);
+        for (size_t j = lo; j < hi; ++j)
+            if (!manifest.unchanged_at(j))
+                return false;
     }
-    // Endline after "Filtering: ..." message
-    cout << endl;
 
-    create_log_(imstore);    
+    return true;
+}
+
+bool ImageProcessor::save_state_(const std::filesystem::path & path) const
+{
+    ofstream out(path, ofstream::out | ofstream::binary | ofstream::trunc);
+    out.write(STATE_MAGIC, 8);
+
+    bool saved = true;
+    for (auto&& of : precomp_filters_)
+        saved = saved && of->save_state(out);
+
+    out.close();
+    if (!saved || !out)
+    {
+        // Filter that can't save its state makes the whole file useless
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        return false;
+    }
+    return true;
+}
+
+bool ImageProcessor::load_state_(const std::filesystem::path & path)
+{
+    ifstream in(path, ifstream::in | ifstream::binary);
+    char magic[8];
+    bool loaded = in.read(magic, 8) && memcmp(magic, STATE_MAGIC, 8) == 0;
+
+    for (auto&& of : precomp_filters_)
+        loaded = loaded && of->load_state(in);
+
+    if (!loaded)
+    {
+        // Precomputation starts from scratch
+        for (auto&& of : precomp_filters_)
+            of->clear();
+    }
+    return loaded;
+}
+
+void ImageProcessor::save_background_file_(const IImageStore * imstore) const
+{
+    std::filesystem::path path = save_background_;
+    if (std::filesystem::is_directory(path))
+        path /= imstore->get_dest().filename().string() + ".bckg";
+
+    for (auto&& of : precomp_filters_)
+        if (auto bckg = dynamic_cast< const BckgSubFilter *>(of.get()))
+        {
+            bckg->save_background(path, imstore->get_roi());
+            if (!quiet_)
+                cout << "\tBackground saved to \"" << path.string() << "\"" << endl;
+            return;
+        }
 }
 
 void ImageProcessor::create_log_(const IImageStore * imstore)
@@ -100,11 +615,18 @@ void ImageProcessor::create_log_(const IImageStore * imstore)
     
     // Filters used
     log << "Filters used: " << endl;
+    if (windowed_)
+        log << " - " << windowed_->desc() << endl;
+
     for (auto&& of : precomp_filters_)
         log << " - " << of->desc() << endl;
 
     for (auto&& of : pure_filters_)
         log << " - " << of->desc() << endl;
 
+    // Position of saved images within the original ones
+    if (roi_.area() != 0)
+        log << roi_desc_() << endl;
+
     log.close();
 }
@@ -8,29 +8,193 @@
 
 #include "ImageStore.h"
 #include "Filter.h"
+#include "FramePool.h"
+#include "FusedKernel.h"
+#include "Progress.h"
+#include "RunManifest.h"
+#include "RunStats.h"
 
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 // Stores filters and applies them to images
 class ImageProcessor
 {
+    // Filters images of watch mode with the filters of a clone
+    friend class OnlineRun;
+
     PureFiltersVec pure_filters_;
     PrecompFiltersVec precomp_filters_;
+    // Applied first, before precomputation filters. Precomputation filters are not used
+    // together with windowed filter.
+    std::unique_ptr< IFilterWindowed> windowed_;
+
+    // Number of worker threads used in the filtering pass
+    unsigned threads_;
+    // If non-zero, filtering pass runs as decode -> filter -> encode pipeline
+    // with queues of this depth between the stages
+    size_t queue_depth_;
+    // If not empty, background of BckgSubFilter is saved to this file after precomputation
+    std::filesystem::path save_background_;
+    // Images filtered by an interrupted run (see RunManifest) are not filtered again
+    bool resume_;
+    // Quiet processor does not print progress, used when several folders are processed at once
+    bool quiet_;
+    // Images are cropped to the region of interest before they are filtered, empty rectangle
+    // keeps whole images
+    cv::Rect roi_;
+
+    // Whether the standard filter chain may be applied by a FusedKernel
+    bool fusion_enabled_;
+    // Fused kernel for the current run, nullptr if the generic filter chain is used
+    std::unique_ptr< FusedKernel> fused_;
+
+    // Buffers of images dropped by the store and of the copies in the window, every clone
+    // has its own pool
+    std::shared_ptr< FramePool> pool_;
+
+    // Statistics of the current run (owned by its store), nullptr outside of apply_filters
+    RunStats * stats_;
+    // Stages of the filters registered in stats_, apply_stages_ holds precomp_filters_
+    // followed by pure_filters_
+    size_t windowed_stage_;
+    std::vector< size_t> precomp_stages_;
+    std::vector< size_t> apply_stages_;
+    size_t fused_stage_;
+    // Summary of the statistics is printed after every run
+    bool print_stats_;
 
 public:
-    ImageProcessor() {}
+    ImageProcessor() : threads_(1), queue_depth_(0), resume_(false), quiet_(false), fusion_enabled_(true),
+        pool_(std::make_shared< FramePool>()), stats_(nullptr), windowed_stage_(0), fused_stage_(0), print_stats_(false) {}
+
+    // Creates processor with the same settings and copies of all filters. Precomputation
+    // filters are copied without precomputed data, so the clone can process another folder
+    // concurrently with this processor.
+    std::unique_ptr< ImageProcessor> clone() const;
+
+    void set_threads(unsigned threads) {
+        threads_ = (threads == 0) ? 1 : threads;
+    }
+
+    void set_queue_depth(size_t queue_depth) {
+        queue_depth_ = queue_depth;
+    }
+
+    // Background is saved after precomputation of every run. If path is a directory, the file
+    // is named after the output folder of the run.
+    void set_save_background(std::filesystem::path path) {
+        save_background_ = std::move(path);
+    }
+
+    void set_resume(bool resume) {
+        resume_ = resume;
+    }
+
+    // Lines describing the configuration in the manifest of a run, resumed runs must match them.
+    // any_depth tells whether images are read in their native depth.
+    std::vector< std::string> manifest_config(bool any_depth) const;
+
+    void set_quiet(bool quiet) {
+        quiet_ = quiet;
+    }
+
+    void set_fusion_enabled(bool enabled) {
+        fusion_enabled_ = enabled;
+    }
+
+    // Images are cropped to roi by their stores (see IImageStore::set_roi), the processor records
+    // it in the log. The mask (if any) must be cropped to the same region.
+    void set_roi(const cv::Rect & roi) {
+        roi_ = roi;
+    }
+
+    const cv::Rect & get_roi() const {
+        return roi_;
+    }
+
+    // Summary is printed by quiet processor's caller
+    void set_print_stats(bool print_stats) {
+        print_stats_ = print_stats;
+    }
+
+    bool get_print_stats() const {
+        return print_stats_;
+    }
 
     void add_filter(std::unique_ptr< IFilterPure> filter) {
         pure_filters_.push_back(std::move(filter));
     }
 
     void add_filter(std::unique_ptr< IFilterWithPrecomp> filter) {
+        if (windowed_)
+            throw HranolRuntimeException("Filters with precomputation can't be combined with windowed filter.");
         precomp_filters_.push_back(std::move(filter));
     }
+
+    void add_filter(std::unique_ptr< IFilterWindowed> filter) {
+        if (windowed_ || !precomp_filters_.empty())
+            throw HranolRuntimeException("Windowed filter can't be combined with another windowed filter or filters with precomputation.");
+        windowed_ = std::move(filter);
+    }
+
+    // Returns true if images are streamed in order through a windowed filter
+    bool is_windowed() const {
+        return windowed_ != nullptr;
+    }
+
+    // Maximal number of images loaded from a store at once when filtering with given
+    // number of threads (stores that keep everything in memory aside)
+    size_t max_loaded_images(unsigned threads) const;
     
+    // Returns true if images have to go through precomputation pass before being filtered
+    bool needs_precomputation() const {
+        for (auto&& of : precomp_filters_)
+            if (!of->is_precomputed())
+                return true;
+        return false;
+    }
+
     void apply_filters(IImageStore * imstore);
 
 private:
+    // Finishes precomputation of all precomp_filters_ and creates the fused kernel
+    void prepare_filters_();
+    // Applies all filters to a single image. Precomputation must be finished.
+    void filter_img_(cv::Mat & img) const;
+    // Copy of img for the window of windowed_, in a buffer from pool_
+    cv::Mat pooled_copy_(const cv::Mat & img) const;
+    // Registers stages of all filters in stats and starts recording to it
+    void track_stats_(RunStats & stats);
+    // Adds time elapsed since start to the stage unless stats are not recorded
+    void record_(size_t stage, RunStats::Clock::time_point start) const {
+        if (stats_)
+            stats_->add_time(stage, start);
+    }
+    // Same as record_ for the apply stage of filter-th filter, stages are registered only
+    // when stats are recorded
+    void record_apply_(size_t filter, RunStats::Clock::time_point start) const {
+        if (stats_)
+            stats_->add_time(apply_stages_[filter], start);
+    }
+    // Streams images in order through windowed_ on the calling thread, the rest of the filters
+    // is applied by threads_ workers. Images with non-zero keep[i] only go through the window.
+    // saved is called by the workers with index of each saved image.
+    void filter_windowed_(IImageStore * imstore, const std::vector< char> & keep,
+        const std::function< void(size_t)> & saved, Progress & progress);
+    // Runs precomputation of all precomp_filters_ over the images of imstore
+    void precompute_(IImageStore * imstore);
+    // Offset and size of roi_ in the original images
+    std::string roi_desc_() const;
+    // Returns true if i-th image saved by the previous run is still valid
+    bool reusable_(const RunManifest & manifest, size_t i, size_t store_sz) const;
+    // Persist precomputed data of all precomp_filters_, return false if some filter can't
+    bool save_state_(const std::filesystem::path & path) const;
+    bool load_state_(const std::filesystem::path & path);
+    void save_background_file_(const IImageStore * imstore) const;
     void create_log_(const IImageStore * imstore);
 };
 #endif // IMAGE_PROCESSOR_H
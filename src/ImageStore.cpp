@@ -9,10 +9,22 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <string>
 #include <filesystem>
 #include <stdexcept>
+#include <mutex>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <system_error>
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -23,60 +35,245 @@ inline bool validate_idx(size_t i, size_t sz)
     return i < sz;
 }
 
+namespace
+{
+    // Reads the whole file into buf, returns false if it fails. Apart from growing buf, nothing
+    // is allocated (std::ifstream would allocate its stream buffer for every file).
+    bool read_whole_file(const fs::path & p, std::vector< uchar> & buf)
+    {
+#ifdef _WIN32
+        ifstream in(p, ifstream::in | ifstream::binary);
+        error_code ec;
+        auto bytes = fs::file_size(p, ec);
+        if (!in || ec)
+            return false;
+
+        buf.resize((size_t) bytes);
+        return (bool) in.read((char *) buf.data(), (streamsize) bytes);
+#else
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        size_t bytes = (size_t) st.st_size, done = 0;
+        buf.resize(bytes);
+        while (done < bytes)
+        {
+            ssize_t n = read(fd, buf.data() + done, bytes - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += (size_t) n;
+        }
+        close(fd);
+        return done == bytes;
+#endif
+    }
+}
+
 std::string IImageStore::get_img_path(size_t i) const
 {
     assert(validate_idx(i, this->size()));
     return img_paths_[i].string();
 }
 
+fs::path IImageStore::get_source(size_t i) const
+{
+    assert(validate_idx(i, this->size()));
+    return img_paths_[i];
+}
+
+int IImageStore::read_flags() const
+{
+    return any_depth_ ? cv::ImreadModes::IMREAD_ANYDEPTH : cv::ImreadModes::IMREAD_GRAYSCALE;
+}
+
+cv::Mat IImageStore::convert_depth(cv::Mat img) const
+{
+    if (any_depth_ || img.depth() == CV_8U)
+        return img;
+
+    cv::Mat ret;
+    img.convertTo(ret, CV_MAKETYPE(CV_8U, img.channels()), 1.0 / 256);
+    return ret;
+}
+
 cv::Mat IImageStore::read_img(const fs::path & p)
 {
-    cv::Mat ret = cv::imread(p.string(), cv::ImreadModes::IMREAD_GRAYSCALE);
-    if (ret.empty())
-        throw HranolRuntimeException("Reading image: \"" + p.string() + "\" failed.");
+    // Unlike cv::imread, neither the file nor the image needs a new buffer
+    thread_local std::vector< uchar> buf;
+    read_file(p, buf);
 
+    cv::Mat ret = pooled_img();
+    decode_img(buf, p, ret);
     return ret;
 }
 
-void IImageStore::save_img(const cv::Mat img, const fs::path & img_src)
+void IImageStore::read_file(const fs::path & p, std::vector< uchar> & buf)
 {
-    if (!dest_created_)
-        create_dest();
+    auto start = RunStats::Clock::now();
+    if (!read_whole_file(p, buf))
+        throw HranolRuntimeException("Reading image: \"" + p.string() + "\" failed.");
 
-    fs::path img_dest = dest_ / img_src.filename().string();
-    try {
-        cv::imwrite(img_dest.string(), img);
-    }
-    catch (const runtime_error & e) {
-        throw HranolRuntimeException("Writing image: \"" + img_dest.string() + "\" failed: " + e.what());
-    }
+    stats_.add_time(RunStats::READ, start);
+    stats_.add_read(buf.size());
+}
+
+void IImageStore::decode_img(const std::vector< uchar> & buf, const fs::path & p, cv::Mat & dst)
+{
+    auto start = RunStats::Clock::now();
+    const uchar * buffer = dst.data;
+
+    // With a region of interest the whole image is decoded into a buffer of the thread and
+    // only the region is copied to dst
+    thread_local cv::Mat whole;
+    cv::Mat * decoded = (roi_.area() == 0) ? &dst : &whole;
+
+    cv::imdecode(buf, read_flags(), decoded);
+    if (decoded->empty())
+        throw HranolRuntimeException("Decoding image: \"" + p.string() + "\" failed.");
+    if (decoded->depth() != CV_8U && decoded->depth() != CV_16U)
+        throw HranolRuntimeException("Image: \"" + p.string() + "\" is neither 8-bit nor 16-bit.");
+    if (decoded != &dst)
+        crop_img(*decoded, p.string()).copyTo(dst);
+
+    stats_.add_time(RunStats::DECODE, start);
+    stats_.add_frame_buffer(dst.data != buffer);
+}
+
+cv::Mat IImageStore::crop_img(const cv::Mat & img, const std::string & name) const
+{
+    if (roi_.area() == 0)
+        return img;
+
+    if ((roi_ & cv::Rect(0, 0, img.cols, img.rows)) != roi_)
+        throw HranolRuntimeException("Region of interest does not fit into image: \"" + name + "\".");
+    return img(roi_);
+}
+
+cv::Mat IImageStore::pooled_img()
+{
+    return pool_ ? pool_->acquire() : cv::Mat();
+}
+
+void IImageStore::recycle_img(cv::Mat & img)
+{
+    if (pool_)
+        pool_->recycle(img);
+    else
+        img.release();
+}
+
+void IImageStore::save_img(size_t i, const cv::Mat img, const fs::path & img_src)
+{
+    // Destination and sink are created only once even if images are saved from multiple threads
+    create_dest();
+    std::call_once(sink_created_, [this]() {
+        sink_ = IOutputSink::create(output_format_, compression_, dest_, size());
+        sink_->set_stats(&stats_);
+    });
+
+    sink_->write(i, img, img_src.filename());
+}
+
+void IImageStore::finish_output()
+{
+    // Nothing was saved if the sink does not exist
+    if (sink_)
+        sink_->finish();
 }
 
 void IImageStore::create_dest()
 {
-    if (dest_created_)
-        return;
-    
-    // Remove trailling slash because fs::create_directories cannot create path ending
-    // with fs::path::preferred_separator
-    if (dest_.string().back() == fs::path::preferred_separator) {
-        dest_ = dest_.parent_path();
-    }
-    
-    fs::create_directories(dest_);
-    dest_created_ = true;
+    std::call_once(dest_created_, [this]() {
+        // Remove trailling slash because fs::create_directories cannot create path ending
+        // with fs::path::preferred_separator
+        if (dest_.string().back() == fs::path::preferred_separator) {
+            dest_ = dest_.parent_path();
+        }
+
+        fs::create_directories(dest_);
+    });
+}
+
+size_t RAMImageStore::estimate_memory(size_t)
+{
+    if (size() == 0)
+        return 0;
+
+    // The first image stays loaded, so it is not decoded twice
+    const cv::Mat & img = load(0);
+    return img.total() * img.elemSize() * size();
 }
 
 cv::Mat & RAMImageStore::load(size_t i)
 {
     assert(validate_idx(i, this->size()));
 
-    if (imgs_[i].empty())
-        imgs_[i] = read_img(img_paths_[i]);
+    if (!imgs_[i].empty())
+        return imgs_[i];
+
+    // Buffer for the file is reused by all loads of the thread
+    thread_local std::vector< uchar> buf;
+    read_file(img_paths_[i], buf);
+
+    cv::Mat img = slot_header_(i);
+    uchar * slot = img.data;
+    decode_img(buf, img_paths_[i], img);
 
+    // OpenCV decodes an image that does not match the slot (or the very first one) into a new buffer
+    if (img.data != slot)
+        to_slab_(i, img);
+
+    imgs_[i] = img;
     return imgs_[i];
 }
 
+cv::Mat RAMImageStore::slot_header_(size_t i)
+{
+    lock_guard< mutex> lock(slab_mtx_);
+    if (!slab_)
+        return cv::Mat();
+
+    return cv::Mat(slot_rows_, slot_cols_, slot_type_, slab_->data() + i * slot_stride_);
+}
+
+bool RAMImageStore::to_slab_(size_t i, cv::Mat & img)
+{
+    {
+        lock_guard< mutex> lock(slab_mtx_);
+        if (!slab_)
+        {
+            // The first decoded image determines geometry of all slots
+            slot_rows_ = img.rows;
+            slot_cols_ = img.cols;
+            slot_type_ = img.type();
+
+            // Slots are aligned to cache lines
+            size_t img_bytes = img.total() * img.elemSize();
+            slot_stride_ = (img_bytes + 63) / 64 * 64;
+
+            slab_ = make_unique< Slab>(slot_stride_ * size(), huge_pages_);
+        }
+    }
+
+    if (img.rows != slot_rows_ || img.cols != slot_cols_ || img.type() != slot_type_)
+        return false;
+
+    cv::Mat slot(slot_rows_, slot_cols_, slot_type_, slab_->data() + i * slot_stride_);
+    img.copyTo(slot);
+    img = slot;
+    return true;
+}
+
 void RAMImageStore::release(size_t i)
 {
     assert(validate_idx(i, this->size()));
@@ -86,36 +283,322 @@ void RAMImageStore::release(size_t i)
 void RAMImageStore::save(size_t i)
 {
     validate_idx(i, this->size());
-    save_img(imgs_[i], img_paths_[i]);
+    save_img(i, imgs_[i], img_paths_[i]);
 }
 
-cv::Mat & OnDemandImageStore::load(size_t i)
+size_t EncodedImageStore::estimate_memory(size_t max_loaded)
+{
+    if (size() == 0)
+        return 0;
+
+    // Bytes of the first file are kept, so it is not read twice
+    size_t img_bytes;
+    {
+        const cv::Mat & img = load(0);
+        img_bytes = img.total() * img.elemSize();
+    }
+    release(0);
+
+    // Bytes of all files plus the decoded images loaded at once
+    size_t files_bytes = 0;
+    for (auto&& p : img_paths_)
+    {
+        error_code ec;
+        auto bytes = fs::file_size(p, ec);
+        if (!ec)
+            files_bytes += (size_t) bytes;
+    }
+    return files_bytes + img_bytes * std::min(max_loaded, size());
+}
+
+cv::Mat & EncodedImageStore::load(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+
+    if (!loaded_imgs_[i].empty())
+        return loaded_imgs_[i];
+
+    if (encoded_[i].empty())
+        read_file(img_paths_[i], encoded_[i]);
+
+    cv::Mat img = pooled_img();
+    decode_img(encoded_[i], img_paths_[i], img);
+    loaded_imgs_[i] = img;
+    return loaded_imgs_[i];
+}
+
+void EncodedImageStore::release(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    recycle_img(loaded_imgs_[i]);
+}
+
+void EncodedImageStore::save(size_t i)
 {
     assert(validate_idx(i, this->size()));
-    assert(!is_img_loaded_ || i == loaded_img_idx_);
 
-    if (!is_img_loaded_)
+    save_img(i, loaded_imgs_[i], img_paths_[i]);
+    // The image is not loaded again after its save
+    std::vector< uchar>().swap(encoded_[i]);
+}
+
+size_t BudgetImageStore::estimate_memory(size_t max_loaded)
+{
+    if (size() == 0)
+        return 0;
+
+    // The first image stays cached, so it is not decoded twice. The scheduler estimates memory
+    // of a run right before it starts, not on the crawl thread.
+    size_t img_bytes;
     {
-        loaded_img_ = read_img(img_paths_[i]);
-        loaded_img_idx_ = i;
-        is_img_loaded_ = true;
+        const cv::Mat & img = load(0);
+        img_bytes = img.total() * img.elemSize();
     }
+    release(0);
 
-    return loaded_img_;
+    // A folder that fits into the budget is kept whole, as by RAMImageStore. Otherwise cached
+    // images never exceed the budget, only the images being filtered can go over it.
+    return std::min(img_bytes * size(), budget_ + img_bytes * std::min(max_loaded, size()));
 }
 
-void OnDemandImageStore::release(size_t i)
+cv::Mat & BudgetImageStore::load(size_t i)
 {
     assert(validate_idx(i, this->size()));
-    assert(i == loaded_img_idx_);
 
-    is_img_loaded_ = false;
+    {
+        lock_guard< mutex> lock(mtx_);
+        if (!imgs_[i].empty())
+        {
+            cached_.erase(i);
+            return imgs_[i];
+        }
+    }
+
+    // Decoding is done outside of the lock, only the calling thread works with index i
+    cv::Mat img = read_img(img_paths_[i]);
+
+    lock_guard< mutex> lock(mtx_);
+    used_ += img.total() * img.elemSize();
+    imgs_[i] = std::move(img);
+    // Loaded image can't be evicted, but other images can make room for it
+    evict_();
+    return imgs_[i];
+}
+
+void BudgetImageStore::release(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+
+    lock_guard< mutex> lock(mtx_);
+    if (saved_[i])
+        drop_(i);
+    else
+    {
+        cached_.insert(i);
+        evict_();
+    }
+}
+
+void BudgetImageStore::save(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    save_img(i, imgs_[i], img_paths_[i]);
+
+    lock_guard< mutex> lock(mtx_);
+    saved_[i] = 1;
+}
+
+void BudgetImageStore::evict_()
+{
+    while (used_ > budget_ && !cached_.empty())
+    {
+        // Image needed last by the next pass
+        size_t i = *cached_.rbegin();
+        cached_.erase(i);
+        drop_(i);
+    }
+}
+
+void BudgetImageStore::drop_(size_t i)
+{
+    used_ -= imgs_[i].total() * imgs_[i].elemSize();
+    recycle_img(imgs_[i]);
+}
+
+size_t OnDemandImageStore::estimate_memory(size_t max_loaded)
+{
+    if (size() == 0)
+        return 0;
+
+    cv::Mat img = read_img(img_paths_[0]);
+    size_t img_bytes = img.total() * img.elemSize();
+    // The first load decodes into the buffer of this image
+    recycle_img(img);
+
+    return img_bytes * std::min(max_loaded, size());
+}
+
+cv::Mat & OnDemandImageStore::load(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+
+    if (loaded_imgs_[i].empty())
+        loaded_imgs_[i] = read_img(img_paths_[i]);
+    return loaded_imgs_[i];
+}
+
+void OnDemandImageStore::release(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    recycle_img(loaded_imgs_[i]);
 }
 
 void OnDemandImageStore::save(size_t i)
 {
     assert(validate_idx(i, this->size()));
-    assert(is_img_loaded_ && i == loaded_img_idx_);
+    save_img(i, loaded_imgs_[i], img_paths_[i]);
+}
+
+size_t SpillImageStore::estimate_memory(size_t max_loaded)
+{
+    if (size() == 0)
+        return 0;
+
+    // Image is spilled, so the next load won't decode it again
+    const cv::Mat & img = load(0);
+    size_t img_bytes = img.total() * img.elemSize();
+    release(0);
+
+    return img_bytes * std::min(max_loaded, size());
+}
+
+cv::Mat & SpillImageStore::load(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+
+    if (!loaded_imgs_[i].empty())
+        return loaded_imgs_[i];
+
+    if (spilled_[i])
+    {
+        loaded_imgs_[i] = slot_header_(i);
+        return loaded_imgs_[i];
+    }
+
+    cv::Mat img = read_img(img_paths_[i]);
+    if (spill_(i, img))
+    {
+        loaded_imgs_[i] = slot_header_(i);
+        // The decoded copy is not needed, the next image is decoded into its buffer
+        recycle_img(img);
+    }
+    else
+        loaded_imgs_[i] = img;
+
+    return loaded_imgs_[i];
+}
+
+void SpillImageStore::release(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+
+    recycle_img(loaded_imgs_[i]);
+    if (spilled_[i])
+        scratch_->drop(i * slot_stride_, slot_stride_);
+}
+
+void SpillImageStore::save(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    save_img(i, loaded_imgs_[i], img_paths_[i]);
+}
+
+bool SpillImageStore::spill_(size_t i, const cv::Mat & img)
+{
+    {
+        lock_guard< mutex> lock(scratch_mtx_);
+        if (!scratch_)
+        {
+            // The first decoded image determines geometry of all slots
+            slot_rows_ = img.rows;
+            slot_cols_ = img.cols;
+            slot_type_ = img.type();
 
-    save_img(loaded_img_, img_paths_[loaded_img_idx_]);
+            size_t page = MappedFile::page_size();
+            size_t img_bytes = img.total() * img.elemSize();
+            slot_stride_ = (img_bytes + page - 1) / page * page;
+
+            scratch_ = make_unique< MappedFile>(scratch_dir_, MappedFile::SCRATCH, slot_stride_ * size());
+        }
+    }
+
+    if (img.rows != slot_rows_ || img.cols != slot_cols_ || img.type() != slot_type_)
+        return false;
+
+    uchar * slot = scratch_->data() + i * slot_stride_;
+    size_t row_bytes = img.cols * img.elemSize();
+    for (int r = 0; r < img.rows; ++r)
+        memcpy(slot + r * row_bytes, img.ptr(r), row_bytes);
+
+    spilled_[i] = 1;
+    return true;
+}
+
+cv::Mat SpillImageStore::slot_header_(size_t i)
+{
+    return cv::Mat(slot_rows_, slot_cols_, slot_type_, scratch_->data() + i * slot_stride_);
+}
+
+MemoryImageStore::MemoryImageStore(std::vector< cv::Mat> frames, SaveFn save_fn)
+    : IImageStore(fs::path(), fs::path(), {}), frames_(std::move(frames)), save_fn_(std::move(save_fn))
+{
+    // Frames keep their depth, there is nothing to convert them from
+    any_depth_ = true;
+
+    for (size_t i = 0; i < frames_.size(); ++i)
+        if (frames_[i].type() != CV_8UC1 && frames_[i].type() != CV_16UC1)
+            throw HranolRuntimeException("Frame " + std::to_string(i) + " is neither 8-bit nor 16-bit single channel image.");
+}
+
+std::string MemoryImageStore::get_img_path(size_t i) const
+{
+    assert(validate_idx(i, this->size()));
+    return "frame " + std::to_string(i);
+}
+
+fs::path MemoryImageStore::get_source(size_t i) const
+{
+    assert(validate_idx(i, this->size()));
+    return fs::path();
+}
+
+void MemoryImageStore::set_roi(const cv::Rect & roi)
+{
+    IImageStore::set_roi(roi);
+    for (size_t i = 0; i < frames_.size(); ++i)
+        frames_[i] = crop_img(frames_[i], get_img_path(i));
+}
+
+size_t MemoryImageStore::estimate_memory(size_t /* max_loaded */)
+{
+    // Frames are in memory already
+    return 0;
+}
+
+cv::Mat & MemoryImageStore::load(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    return frames_[i];
+}
+
+void MemoryImageStore::release(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    // Frames belong to the caller, release does nothing
+}
+
+void MemoryImageStore::save(size_t i)
+{
+    assert(validate_idx(i, this->size()));
+    save_fn_(i, frames_[i]);
 }
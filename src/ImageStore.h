@@ -6,40 +6,81 @@
 #ifndef IMAGE_STORE_H
 #define IMAGE_STORE_H
 
+#include "FramePool.h"
+#include "MappedFile.h"
+#include "OutputSink.h"
+#include "RunStats.h"
+#include "Slab.h"
+
 #include "opencv2/core/mat.hpp"
 
 #include <filesystem>
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <set>
 
 
 // IImageStore is an interface class for accessing the images that will be filtered.
 //
 // You can access a single image using load() method and save the changes using save().
-// After finishing the work with the image, you have to release() it, otherwise you can't
-// load() another image.
-// It is designed this way because OnDemandImageStore can store only one image. If you
-// release() the current one, you can load() another one.
+// After finishing the work with the image, you have to release() it. Stores are free to
+// drop released images from memory (OnDemandImageStore does so). Buffers of dropped images
+// go to the frame pool (if set), the next images are decoded into them.
+//
+// load(), save() and release() can be called concurrently from multiple threads as long as
+// each thread works with different indices. A single index must not be used by two threads
+// at the same time. The reference returned by load(i) stays valid until release(i).
 class IImageStore 
 {
 protected:
     std::filesystem::path origin_;
     std::filesystem::path dest_;
-    bool dest_created_;
+    std::once_flag dest_created_;
+    std::once_flag sink_created_;
     const std::vector< std::filesystem::path> img_paths_;
+    // Images are read in their native depth (8-bit or 16-bit) instead of being converted to 8 bits
+    bool any_depth_;
+    OutputFormat output_format_;
+    Compression compression_;
+    // Created together with dest_ by the first save
+    std::unique_ptr< IOutputSink> sink_;
+    RunStats stats_;
+    // Buffers of dropped images, shared with the processor filtering the store
+    std::shared_ptr< FramePool> pool_;
+    // Images are cropped to roi_ as they are loaded, empty roi_ keeps whole images
+    cv::Rect roi_;
 
+    // Flags for cv::imread and friends according to any_depth_
+    int read_flags() const;
+    // Converts 16-bit image to 8 bits unless any_depth_ is set, as cv::imread does
+    cv::Mat convert_depth(cv::Mat img) const;
+    // Reads and decodes image s into a buffer from the pool
     cv::Mat read_img(const std::filesystem::path & s);
-    void save_img(cv::Mat img, const std::filesystem::path & img_src);
-    void create_dest();
+    // Reads whole file p to buf, the capacity of buf is reused
+    void read_file(const std::filesystem::path & p, std::vector< uchar> & buf);
+    // Decodes image p from its bytes in buf to dst. Buffer of dst is reused if the decoded image
+    // has the same size and type.
+    void decode_img(const std::vector< uchar> & buf, const std::filesystem::path & p, cv::Mat & dst);
+    // Header of the region of interest of img named name, img itself if there is no region
+    cv::Mat crop_img(const cv::Mat & img, const std::string & name) const;
+    // Free buffer of the pool to decode an image into, empty Mat if there is none
+    cv::Mat pooled_img();
+    // Drops img, its buffer goes back to the pool
+    void recycle_img(cv::Mat & img);
+    // Passes i-th image to the output sink, img_src is the original image (its file name is kept)
+    void save_img(size_t i, cv::Mat img, const std::filesystem::path & img_src);
 
 public:
     IImageStore(
         std::filesystem::path origin,
         std::filesystem::path dest,
         std::vector< std::filesystem::path> img_paths)
-        : origin_(std::move(origin)), dest_(std::move(dest)), dest_created_(false),
-        img_paths_(std::move(img_paths))
+        : origin_(std::move(origin)), dest_(std::move(dest)),
+        img_paths_(std::move(img_paths)), any_depth_(false),
+        output_format_(OutputFormat::FILES), compression_(Compression::DEFAULT)
     {}
 
     virtual ~IImageStore() { }
@@ -56,7 +97,61 @@ public:
         return dest_;
     }
 
-    std::string get_img_path(size_t i) const;
+    virtual std::string get_img_path(size_t i) const;
+
+    // File the i-th image is read from
+    virtual std::filesystem::path get_source(size_t i) const;
+
+    OutputFormat get_output_format() const {
+        return output_format_;
+    }
+
+    // Creates the destination folder unless it exists, can be called multiple times
+    void create_dest();
+
+    // By default images are converted to 8-bit grayscale. With any_depth 16-bit images
+    // (e.g. from 10-bit or 12-bit sensors) keep their depth. Must be set before the first load.
+    void set_any_depth(bool any_depth) {
+        any_depth_ = any_depth;
+    }
+
+    bool get_any_depth() const {
+        return any_depth_;
+    }
+
+    // Selects how saved images are written, by default every image goes to its own file.
+    // Must be set before the first save.
+    void set_output(OutputFormat format, Compression compression) {
+        output_format_ = format;
+        compression_ = compression;
+    }
+
+    // Images are cropped to roi (e.g. the bounding box of the mask), so that filters and the
+    // output deal only with the region. Must be set before the first load.
+    virtual void set_roi(const cv::Rect & roi) {
+        roi_ = roi;
+    }
+
+    const cv::Rect & get_roi() const {
+        return roi_;
+    }
+
+    // Dropped images are recycled through pool. Must be set before the first load.
+    void set_pool(std::shared_ptr< FramePool> pool) {
+        pool_ = std::move(pool);
+    }
+
+    // Statistics of the run filtering this store
+    RunStats & stats() {
+        return stats_;
+    }
+
+    // Completes the output after all images were saved (e.g. writes the index of a TIFF stack)
+    void finish_output();
+
+    // Estimates memory (in bytes) taken by decoded images of this store while at most
+    // max_loaded images are loaded at once. Size of the first image is used for all images.
+    virtual size_t estimate_memory(size_t max_loaded) = 0;
     
     virtual cv::Mat & load(size_t i) = 0;
     virtual void release(size_t i) = 0;
@@ -66,39 +161,231 @@ public:
 
 // RAMImageStore loads all of the images to imgs_ vector. Therefore multiple gets of the same
 // image are fast.
+//
+// Images are decoded straight into slots of a single slab sized by the geometry of the first
+// image, so there is no allocation per image and the images lie next to each other in memory.
+// Images of a different size or type get their own buffer.
 class RAMImageStore : public IImageStore
 {
     std::vector< cv::Mat> imgs_;
 
+    // Slab is backed by transparent huge pages
+    bool huge_pages_;
+    std::unique_ptr< Slab> slab_;
+    // Guards creation of slab_
+    std::mutex slab_mtx_;
+
+    // Geometry of a slot in slab_
+    int slot_rows_;
+    int slot_cols_;
+    int slot_type_;
+    size_t slot_stride_;
+
 public:
     RAMImageStore(std::filesystem::path origin,
         std::filesystem::path dest,
-        std::vector< std::filesystem::path> img_paths)
-        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths))
+        std::vector< std::filesystem::path> img_paths,
+        bool huge_pages = false)
+        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths)),
+        huge_pages_(huge_pages), slot_rows_(0), slot_cols_(0), slot_type_(0), slot_stride_(0)
     { 
         imgs_.resize(img_paths_.size());
     }
+    virtual size_t estimate_memory(size_t max_loaded);
     virtual cv::Mat & load(size_t i);
     virtual void release(size_t i);
     virtual void save(size_t i);
+
+private:
+    // Header of i-th slot, empty until the slab is created by the first decoded image
+    cv::Mat slot_header_(size_t i);
+    // Moves img to i-th slot, returns false if img does not fit the slot
+    bool to_slab_(size_t i, cv::Mat & img);
 };
 
 
-// OnDemandImageStore loads only one image. When an image is loaded, subsequent load() of a different
-// image from the loaded one must be preceded with release() of the currently loaded image.
+// OnDemandImageStore keeps in memory only the images that are currently loaded (one per worker
+// thread). Image is dropped as soon as it is released.
 class OnDemandImageStore : public IImageStore
 {
-    cv::Mat loaded_img_;
-    size_t loaded_img_idx_;
-    bool is_img_loaded_;
+    // Currently loaded images, empty if the image is not loaded. Each index is used by a single
+    // thread at a time, so the elements need no lock.
+    std::vector< cv::Mat> loaded_imgs_;
 
 public:
     OnDemandImageStore(std::filesystem::path origin,
         std::filesystem::path dest,
         std::vector< std::filesystem::path> img_paths)
-        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths)), is_img_loaded_(false)
-         {}
+        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths))
+    {
+        loaded_imgs_.resize(img_paths_.size());
+    }
     
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+};
+
+
+// EncodedImageStore reads every file only once. Its bytes are kept in memory after the first
+// load and subsequent loads decode the image from them, so e.g. filtering after precomputation
+// does not read the files again. Encoded PNG or TIFF images are several times smaller than
+// decoded ones. Decoded images are dropped as soon as they are released, as with
+// OnDemandImageStore, the encoded bytes once the image is saved.
+class EncodedImageStore : public IImageStore
+{
+    // Bytes of the files read so far, empty if the file was not read yet
+    std::vector< std::vector< uchar>> encoded_;
+    // Currently loaded images, as in OnDemandImageStore
+    std::vector< cv::Mat> loaded_imgs_;
+
+public:
+    EncodedImageStore(std::filesystem::path origin,
+        std::filesystem::path dest,
+        std::vector< std::filesystem::path> img_paths)
+        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths))
+    {
+        encoded_.resize(img_paths_.size());
+        loaded_imgs_.resize(img_paths_.size());
+    }
+
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+
+};
+
+
+// BudgetImageStore keeps decoded images in memory as long as they fit into the memory budget,
+// so images loaded again (e.g. by the filtering pass after precomputation) are not decoded twice.
+// Unlike RAMImageStore, a saved image is dropped as soon as it is released, it is not needed anymore.
+// A folder that fits into the budget is thus decoded only once, as with RAMImageStore.
+//
+// When the budget is exceeded, released images that will be needed last are evicted. Every pass
+// goes over the images in order, so these are the ones with the highest indices. In a second pass
+// the images at the beginning are then found in memory, while evicting the least recently used
+// images would leave only those at the end, which are needed last. Loaded images are never
+// evicted, so the budget can be exceeded by the images that are currently loaded.
+class BudgetImageStore : public IImageStore
+{
+    size_t budget_;
+    // Loaded and cached images, empty if the image is neither
+    std::vector< cv::Mat> imgs_;
+    // saved_[i] is non-zero once i-th image was saved
+    std::vector< char> saved_;
+    // Cached images that are not loaded, candidates for eviction
+    std::set< size_t> cached_;
+    // Bytes taken by imgs_
+    size_t used_;
+    std::mutex mtx_;
+
+public:
+    BudgetImageStore(std::filesystem::path origin,
+        std::filesystem::path dest,
+        std::vector< std::filesystem::path> img_paths,
+        size_t budget)
+        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths)), budget_(budget), used_(0)
+    {
+        imgs_.resize(img_paths_.size());
+        saved_.resize(img_paths_.size(), 0);
+    }
+
+    // Decoded size of the whole folder (estimated from the first image) if it fits into the
+    // budget, the budget and the loaded images otherwise
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+
+private:
+    // Evicts cached images until they fit into the budget, mtx_ must be locked
+    void evict_();
+    // Drops i-th image, mtx_ must be locked
+    void drop_(size_t i);
+};
+
+
+// SpillImageStore decodes every image only once. When an image is loaded for the first time,
+// it is decoded and copied to a memory-mapped scratch file. Subsequent loads return a header
+// pointing directly into the mapping, without decoding or copying. Released images are dropped
+// from the process memory as with OnDemandImageStore, but they are kept in the scratch file.
+//
+// Scratch file slots have the geometry of the first decoded image. Images of a different size
+// or type are not spilled and they are decoded on every load.
+class SpillImageStore : public IImageStore
+{
+    std::filesystem::path scratch_dir_;
+    std::unique_ptr< MappedFile> scratch_;
+    // Guards creation of scratch_
+    std::mutex scratch_mtx_;
+
+    // Geometry of a slot in scratch_
+    int slot_rows_;
+    int slot_cols_;
+    int slot_type_;
+    // Slots are aligned to memory pages so that they can be dropped independently
+    size_t slot_stride_;
+
+    // Currently loaded images, for spilled images these are headers pointing to scratch_
+    std::vector< cv::Mat> loaded_imgs_;
+    // spilled_[i] is non-zero if i-th image is stored in scratch_
+    std::vector< char> spilled_;
+
+public:
+    SpillImageStore(std::filesystem::path origin,
+        std::filesystem::path dest,
+        std::vector< std::filesystem::path> img_paths,
+        std::filesystem::path scratch_dir)
+        : IImageStore(std::move(origin), std::move(dest), std::move(img_paths)),
+        scratch_dir_(std::move(scratch_dir)), slot_rows_(0), slot_cols_(0), slot_type_(0), slot_stride_(0)
+    {
+        loaded_imgs_.resize(img_paths_.size());
+        spilled_.resize(img_paths_.size(), 0);
+    }
+
+    virtual size_t estimate_memory(size_t max_loaded);
+    virtual cv::Mat & load(size_t i);
+    virtual void release(size_t i);
+    virtual void save(size_t i);
+
+private:
+    // Copies img to i-th slot of scratch file, returns false if img does not fit the slot
+    bool spill_(size_t i, const cv::Mat & img);
+    cv::Mat slot_header_(size_t i);
+};
+
+
+// MemoryImageStore holds frames that are already in memory (see FrameFilter). Nothing is read
+// from or written to disk: frames are filtered in place and every saved frame is passed to
+// a callback. The store has no origin nor output folder. With a region of interest only the
+// region of each frame is filtered and passed to the callback.
+class MemoryImageStore : public IImageStore
+{
+public:
+    // Called with index of the saved frame and the frame
+    using SaveFn = std::function< void(size_t, const cv::Mat &)>;
+
+private:
+    std::vector< cv::Mat> frames_;
+    SaveFn save_fn_;
+
+public:
+    // Frames must be 8-bit or 16-bit single channel images
+    MemoryImageStore(std::vector< cv::Mat> frames, SaveFn save_fn);
+
+    virtual size_t size() const {
+        return frames_.size();
+    }
+
+    virtual std::string get_img_path(size_t i) const;
+    virtual std::filesystem::path get_source(size_t i) const;
+
+    // Frames are cropped right away
+    virtual void set_roi(const cv::Rect & roi);
+
+    virtual size_t estimate_memory(size_t max_loaded);
     virtual cv::Mat & load(size_t i);
     virtual void release(size_t i);
     virtual void save(size_t i);
@@ -0,0 +1,231 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "MappedFile.h"
+#include "HranolException.h"
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+
+namespace
+{
+    string last_error()
+    {
+        return "error code " + to_string(GetLastError());
+    }
+}
+
+MappedFile::MappedFile(const fs::path & path, Mode mode, size_t size)
+    : data_(nullptr), size_(0), path_(path), file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+{
+    DWORD access = GENERIC_READ;
+    DWORD disposition = OPEN_EXISTING;
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+
+    if (mode != READ_ONLY && mode != COPY_ON_WRITE)
+        access |= GENERIC_WRITE;
+
+    if (mode == CREATE)
+        disposition = CREATE_ALWAYS;
+    else if (mode == SCRATCH)
+    {
+        static atomic< unsigned> scratch_counter(0);
+        path_ = path / ("hranol_scratch_" + to_string(GetCurrentProcessId()) + "_" + to_string(scratch_counter++));
+        disposition = CREATE_ALWAYS;
+        attributes = FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE;
+    }
+
+    file_ = CreateFileW(path_.wstring().c_str(), access, FILE_SHARE_READ, nullptr, disposition, attributes, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+        throw HranolRuntimeException("Opening file \"" + path_.string() + "\" failed: " + last_error());
+
+    if (mode == CREATE || mode == SCRATCH)
+        size_ = size;
+    else
+    {
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_, &file_size);
+        size_ = (size_t) file_size.QuadPart;
+    }
+
+    // Empty files can't be mapped
+    if (size_ == 0)
+        return;
+
+    DWORD protect = PAGE_READWRITE;
+    if (mode == READ_ONLY)
+        protect = PAGE_READONLY;
+    else if (mode == COPY_ON_WRITE)
+        protect = PAGE_WRITECOPY;
+
+    mapping_ = CreateFileMappingW(file_, nullptr, protect, (DWORD) ((unsigned long long) size_ >> 32),
+        (DWORD) (size_ & 0xFFFFFFFF), nullptr);
+    if (mapping_ == nullptr)
+    {
+        CloseHandle(file_);
+        throw HranolRuntimeException("Mapping file \"" + path_.string() + "\" failed: " + last_error());
+    }
+
+    DWORD view_access = FILE_MAP_WRITE;
+    if (mode == READ_ONLY)
+        view_access = FILE_MAP_READ;
+    else if (mode == COPY_ON_WRITE)
+        view_access = FILE_MAP_COPY;
+
+    data_ = (unsigned char *) MapViewOfFile(mapping_, view_access, 0, 0, size_);
+    if (data_ == nullptr)
+    {
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+        throw HranolRuntimeException("Mapping file \"" + path_.string() + "\" failed: " + last_error());
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != nullptr)
+        UnmapViewOfFile(data_);
+    if (mapping_ != nullptr)
+        CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+}
+
+void MappedFile::drop(size_t offset, size_t len)
+{
+    size_t page = page_size();
+    size_t beg = (offset + page - 1) / page * page;
+    size_t end = (offset + len) / page * page;
+    if (data_ == nullptr || beg >= end)
+        return;
+
+    // Removes the pages from the working set of the process, data stay in the file
+    VirtualUnlock(data_ + beg, end - beg);
+}
+
+size_t MappedFile::page_size()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+}
+
+#else // POSIX
+
+namespace
+{
+    string last_error()
+    {
+        return strerror(errno);
+    }
+}
+
+MappedFile::MappedFile(const fs::path & path, Mode mode, size_t size)
+    : data_(nullptr), size_(0), path_(path), fd_(-1)
+{
+    if (mode == SCRATCH)
+    {
+        string tmpl = (path / "hranol_scratch_XXXXXX").string();
+        fd_ = mkstemp(&tmpl[0]);
+        if (fd_ < 0)
+            throw HranolRuntimeException("Creating scratch file in \"" + path.string() + "\" failed: " + last_error());
+
+        // Unlinked file lives until it is closed, so nothing is left behind
+        path_ = tmpl;
+        unlink(tmpl.c_str());
+    }
+    else
+    {
+        int flags = (mode == READ_ONLY || mode == COPY_ON_WRITE) ? O_RDONLY : O_RDWR;
+        if (mode == CREATE)
+            flags |= O_CREAT | O_TRUNC;
+
+        fd_ = ::open(path.c_str(), flags, 0644);
+        if (fd_ < 0)
+            throw HranolRuntimeException("Opening file \"" + path.string() + "\" failed: " + last_error());
+    }
+
+    if (mode == CREATE || mode == SCRATCH)
+    {
+        size_ = size;
+        if (ftruncate(fd_, (off_t) size_) != 0)
+        {
+            string err = last_error();
+            ::close(fd_);
+            throw HranolRuntimeException("Resizing file \"" + path_.string() + "\" failed: " + err);
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+        {
+            string err = last_error();
+            ::close(fd_);
+            throw HranolRuntimeException("Reading size of file \"" + path_.string() + "\" failed: " + err);
+        }
+        size_ = (size_t) st.st_size;
+    }
+
+    // Empty files can't be mapped
+    if (size_ == 0)
+        return;
+
+    int prot = (mode == READ_ONLY) ? PROT_READ : (PROT_READ | PROT_WRITE);
+    int share = (mode == COPY_ON_WRITE) ? MAP_PRIVATE : MAP_SHARED;
+    void * addr = mmap(nullptr, size_, prot, share, fd_, 0);
+    if (addr == MAP_FAILED)
+    {
+        string err = last_error();
+        ::close(fd_);
+        throw HranolRuntimeException("Mapping file \"" + path_.string() + "\" failed: " + err);
+    }
+    data_ = (unsigned char *) addr;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != nullptr)
+        munmap(data_, size_);
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+void MappedFile::drop(size_t offset, size_t len)
+{
+    size_t page = page_size();
+    size_t beg = (offset + page - 1) / page * page;
+    size_t end = (offset + len) / page * page;
+    if (data_ == nullptr || beg >= end)
+        return;
+
+    // For shared file mappings the data are kept in the file (page cache), private pages
+    // are read from the file again
+    madvise(data_ + beg, end - beg, MADV_DONTNEED);
+}
+
+size_t MappedFile::page_size()
+{
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+#endif // _WIN32
@@ -0,0 +1,79 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <filesystem>
+
+
+// MappedFile maps whole file into memory. Mapping is shared (except of COPY_ON_WRITE mode),
+// so writes to the mapped memory end up in the file. Works on POSIX systems and Windows.
+class MappedFile
+{
+public:
+    enum Mode {
+        // Maps existing file for reading
+        READ_ONLY,
+        // Maps existing file for reading and writing
+        READ_WRITE,
+        // Maps existing file for reading and writing, writes are private to the process and
+        // never reach the file (copy-on-write)
+        COPY_ON_WRITE,
+        // Creates (or truncates) file of given size and maps it for reading and writing
+        CREATE,
+        // Creates temporary file of given size in given directory and maps it for reading
+        // and writing. The file is deleted when the mapping is destroyed (or the process dies).
+        SCRATCH
+    };
+
+private:
+    unsigned char * data_;
+    size_t size_;
+    std::filesystem::path path_;
+
+#ifdef _WIN32
+    void * file_;
+    void * mapping_;
+#else
+    int fd_;
+#endif
+
+public:
+    // size is used only with CREATE and SCRATCH modes, for SCRATCH path is a directory
+    MappedFile(const std::filesystem::path & path, Mode mode, size_t size = 0);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    unsigned char * data() {
+        return data_;
+    }
+
+    const unsigned char * data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    const std::filesystem::path & path() const {
+        return path_;
+    }
+
+    // Lets the system drop pages of range [offset, offset + len) from the process memory.
+    // The data are kept in the file and are read back on next access. Only pages fully
+    // inside of the range are dropped. On POSIX systems private (COPY_ON_WRITE) changes of
+    // dropped pages are discarded.
+    void drop(size_t offset, size_t len);
+
+    // Size of the memory page, mappings and drop() work with whole pages
+    static size_t page_size();
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,358 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "MedianBckgSubFilter.h"
+#include "BinaryIO.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+    const int BINS = 16;
+    const int DIGIT_BITS = 4;
+    // Upper bound on the number of row bands of the shared histogram
+    const int MAX_BANDS = 64;
+}
+
+MedianBckgSubFilter::MedianBckgSubFilter(double subtraction_factor)
+    : subtraction_factor_(subtraction_factor), expected_count_(0), count_(0), type_(-1),
+    bits_(0), shift_(0), hist_(make_shared< Histogram>()), start_band_(0)
+{
+    if (subtraction_factor <= 0)
+        throw HranolRuntimeException("Background subtraction factor must be positive: " + std::to_string(subtraction_factor));
+}
+
+void MedianBckgSubFilter::apply_to(cv::Mat & img) const
+{
+    // Do nothing if there were no images in the precomputation
+    if (count_ == 0)
+        return;
+
+    if (factored_median_.empty())
+        throw HranolRuntimeException("Median background subtraction was applied before precomputation was finished.");
+
+    if (img.size() != factored_median_.size() || img.channels() != factored_median_.channels())
+        throw HranolRuntimeException("Size or number of channels channels of processed image and images used for precomputation did not match.");
+
+    // Saturated subtraction
+    img -= factored_median_;
+}
+
+void MedianBckgSubFilter::precomp_from(const cv::Mat img)
+{
+    factored_median_ = cv::Mat();
+
+    if (type_ == -1)
+        init_(img);
+
+    if (img.type() != type_ || img.size() != size_)
+        throw HranolRuntimeException("Size or type of preprocessed image and previous images did not match.");
+
+    // Images are counted only in the first pass
+    if (shift_ == bits_ - DIGIT_BITS)
+        ++count_;
+
+    // Other shards may histogram other images at the same time, each band is locked while
+    // it is updated and the shards start with different bands
+    int bands = band_count_();
+    for (int k = 0; k < bands; ++k)
+    {
+        int band = (start_band_ + k) % bands;
+        int row_beg = band * hist_->band_rows;
+        int row_end = std::min(row_beg + hist_->band_rows, size_.height);
+
+        lock_guard< mutex> lock(hist_->band_mtx[band]);
+        if (bits_ == 8)
+        {
+            if (hist_->narrow)
+                histogram_< uchar>(img, hist_->counts16, row_beg, row_end);
+            else
+                histogram_< uchar>(img, hist_->counts32, row_beg, row_end);
+        }
+        else
+        {
+            if (hist_->narrow)
+                histogram_< ushort>(img, hist_->counts16, row_beg, row_end);
+            else
+                histogram_< ushort>(img, hist_->counts32, row_beg, row_end);
+        }
+    }
+}
+
+void MedianBckgSubFilter::reserve(size_t img_count)
+{
+    expected_count_ = img_count;
+}
+
+bool MedianBckgSubFilter::next_pass()
+{
+    if (count_ == 0)
+        return false;
+
+    if (!state_)
+    {
+        // Lower median of count_ values has rank (count_ - 1) / 2
+        state_ = make_shared< SearchState>();
+        state_->prefix.assign(elems_(), 0);
+        state_->rank.assign(elems_(), (uint32_t) ((count_ - 1) / 2));
+    }
+
+    if (hist_->narrow)
+        select_bins_(hist_->counts16);
+    else
+        select_bins_(hist_->counts32);
+
+    if (shift_ == 0)
+    {
+        // All digits are known, the histogram is not needed anymore
+        hist_->counts16 = vector< uint16_t>();
+        hist_->counts32 = vector< uint32_t>();
+        return false;
+    }
+
+    shift_ -= DIGIT_BITS;
+    return true;
+}
+
+void MedianBckgSubFilter::finish_precomp()
+{
+    if (count_ == 0 || !state_)
+        return;
+
+    cv::Mat median(size_, type_);
+    int n = size_.width * median.channels();
+    for (int r = 0; r < size_.height; ++r)
+    {
+        const uint16_t * prefix = state_->prefix.data() + (size_t) r * n;
+        if (bits_ == 8)
+        {
+            uchar * p = median.ptr(r);
+            for (int c = 0; c < n; ++c)
+                p[c] = (uchar) prefix[c];
+        }
+        else
+        {
+            ushort * p = median.ptr< ushort>(r);
+            for (int c = 0; c < n; ++c)
+                p[c] = prefix[c];
+        }
+    }
+
+    median.convertTo(factored_median_, type_, subtraction_factor_);
+}
+
+unique_ptr< IFilterWithPrecomp> MedianBckgSubFilter::create_shard() const
+{
+    auto ret = create(subtraction_factor_);
+    ret->expected_count_ = expected_count_;
+    ret->hist_ = hist_;
+    {
+        lock_guard< mutex> lock(hist_->mtx);
+        ret->start_band_ = ++hist_->next_start;
+    }
+
+    // In later passes the shard needs the digits found so far
+    if (type_ != -1)
+    {
+        ret->type_ = type_;
+        ret->size_ = size_;
+        ret->bits_ = bits_;
+        ret->shift_ = shift_;
+        ret->state_ = state_;
+    }
+    return ret;
+}
+
+void MedianBckgSubFilter::merge_shard(const IFilterWithPrecomp & shard)
+{
+    const auto & other = dynamic_cast< const MedianBckgSubFilter &>(shard);
+    if (other.hist_ != hist_)
+        throw HranolRuntimeException("Median background subtraction can merge only its own shards.");
+    if (other.type_ == -1)
+        return;
+
+    factored_median_ = cv::Mat();
+
+    // The shard histogrammed into the shared histogram, only its geometry and count are taken
+    if (type_ == -1)
+    {
+        type_ = other.type_;
+        size_ = other.size_;
+        bits_ = other.bits_;
+        shift_ = other.shift_;
+    }
+    else if (other.type_ != type_ || other.size_ != size_ || other.shift_ != shift_)
+        throw HranolRuntimeException("Size or type of precomputed images did not match.");
+
+    count_ += other.count_;
+}
+
+void MedianBckgSubFilter::clear()
+{
+    expected_count_ = 0;
+    count_ = 0;
+    type_ = -1;
+    size_ = cv::Size();
+    bits_ = 0;
+    shift_ = 0;
+    state_ = nullptr;
+    // Shards of the previous precomputation keep the old histogram
+    hist_ = make_shared< Histogram>();
+    start_band_ = 0;
+    factored_median_ = cv::Mat();
+}
+
+bool MedianBckgSubFilter::save_state(ostream & out) const
+{
+    // After the last pass the prefixes are the medians
+    write_value< uint64_t>(out, count_);
+    if (count_ == 0)
+        return true;
+
+    write_value< int32_t>(out, type_);
+    write_value< int32_t>(out, size_.height);
+    write_value< int32_t>(out, size_.width);
+    out.write((const char *) state_->prefix.data(), (streamsize) (state_->prefix.size() * sizeof(uint16_t)));
+    return true;
+}
+
+bool MedianBckgSubFilter::load_state(istream & in)
+{
+    clear();
+
+    uint64_t count;
+    if (!read_value(in, count))
+        return false;
+    if (count == 0)
+        return true;
+
+    int32_t type, rows, cols;
+    if (!read_value(in, type) || !read_value(in, rows) || !read_value(in, cols) || rows < 0 || cols < 0)
+        return false;
+    if (type != CV_MAT_TYPE(type) || (CV_MAT_DEPTH(type) != CV_8U && CV_MAT_DEPTH(type) != CV_16U))
+        return false;
+    if (!has_elements(in, (uint64_t) rows * (uint64_t) cols * CV_MAT_CN(type), sizeof(uint16_t)))
+        return false;
+
+    type_ = type;
+    size_ = cv::Size(cols, rows);
+    bits_ = (CV_MAT_DEPTH(type_) == CV_8U) ? 8 : 16;
+    shift_ = 0;
+
+    auto state = make_shared< SearchState>();
+    state->prefix.resize(elems_());
+    if (!in.read((char *) state->prefix.data(), (streamsize) (state->prefix.size() * sizeof(uint16_t))))
+    {
+        clear();
+        return false;
+    }
+
+    state_ = std::move(state);
+    count_ = (size_t) count;
+    return true;
+}
+
+size_t MedianBckgSubFilter::elems_() const
+{
+    return (size_t) size_.area() * CV_MAT_CN(type_);
+}
+
+int MedianBckgSubFilter::band_count_() const
+{
+    return (size_.height + hist_->band_rows - 1) / hist_->band_rows;
+}
+
+void MedianBckgSubFilter::init_(const cv::Mat & img)
+{
+    switch (img.depth())
+    {
+    case CV_8U:
+        bits_ = 8;
+        break;
+    case CV_16U:
+        bits_ = 16;
+        break;
+    default:
+        throw HranolRuntimeException("Median background subtraction supports only 8-bit and 16-bit images.");
+    }
+
+    lock_guard< mutex> lock(hist_->mtx);
+    if (hist_->type == -1)
+    {
+        hist_->type = img.type();
+        hist_->size = img.size();
+        hist_->narrow = expected_count_ != 0 && expected_count_ <= numeric_limits< uint16_t>::max();
+
+        size_t counters = img.total() * img.channels() * BINS;
+        if (hist_->narrow)
+            hist_->counts16.assign(counters, 0);
+        else
+            hist_->counts32.assign(counters, 0);
+
+        hist_->band_rows = std::max(1, (img.rows + MAX_BANDS - 1) / MAX_BANDS);
+        hist_->band_mtx = make_unique< mutex[]>((img.rows + hist_->band_rows - 1) / hist_->band_rows);
+    }
+    else if (img.type() != hist_->type || img.size() != hist_->size)
+        throw HranolRuntimeException("Size or type of preprocessed image and previous images did not match.");
+
+    type_ = hist_->type;
+    size_ = hist_->size;
+    shift_ = bits_ - DIGIT_BITS;
+}
+
+template< typename TI, typename TC>
+void MedianBckgSubFilter::histogram_(const cv::Mat & img, vector< TC> & hist, int row_beg, int row_end)
+{
+    int n = img.cols * img.channels();
+    // In the first pass there are no digits to match
+    bool first_pass = (shift_ == bits_ - DIGIT_BITS);
+    int match_shift = shift_ + DIGIT_BITS;
+
+    for (int r = row_beg; r < row_end; ++r)
+    {
+        const TI * p = img.ptr< TI>(r);
+        TC * h = hist.data() + (size_t) r * n * BINS;
+
+        if (first_pass)
+        {
+            for (int c = 0; c < n; ++c)
+                ++h[c * BINS + (p[c] >> shift_)];
+        }
+        else
+        {
+            const uint16_t * prefix = state_->prefix.data() + (size_t) r * n;
+            for (int c = 0; c < n; ++c)
+                if ((p[c] >> match_shift) == (prefix[c] >> match_shift))
+                    ++h[c * BINS + ((p[c] >> shift_) & 0xF)];
+        }
+    }
+}
+
+template< typename TC>
+void MedianBckgSubFilter::select_bins_(vector< TC> & hist)
+{
+    size_t n = elems_();
+    auto & prefix = state_->prefix;
+    auto & rank = state_->rank;
+
+    for (size_t e = 0; e < n; ++e)
+    {
+        TC * h = hist.data() + e * BINS;
+        for (int b = 0; b < BINS; ++b)
+        {
+            if (rank[e] < h[b])
+            {
+                prefix[e] = (uint16_t) (prefix[e] | (b << shift_));
+                break;
+            }
+            rank[e] -= h[b];
+        }
+    }
+
+    fill(hist.begin(), hist.end(), 0);
+}
@@ -0,0 +1,124 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef MEDIAN_BCKG_SUB_FILTER_H
+#define MEDIAN_BCKG_SUB_FILTER_H
+
+#include "Filter.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// MedianBckgSubFilter subtracts the per-pixel median of all images with factor subtraction_factor_.
+// Unlike the mean, the median is not smeared by objects moving through the scene.
+//
+// Keeping all images in memory is not needed. The median is found digit by digit, one hexadecimal
+// digit (4 bits) per pass over the images: each pass fills a 16-bin histogram per pixel of the digit
+// values of images that match the digits found so far and picks the bin containing the median.
+// 8-bit images take 2 passes, 16-bit images 4 passes. The memory used depends only on the image
+// size, not on the number of images: 16 counters plus the digits found so far per pixel.
+// Shards share the histogram of their filter and lock its rows band by band, so the memory
+// does not grow with the number of precomputing threads.
+class MedianBckgSubFilter : public IFilterWithPrecomp
+{
+    // Per-pixel state of the search shared by the filter and its shards (read-only for shards)
+    struct SearchState
+    {
+        // Digits of the median determined in previous passes
+        std::vector< uint16_t> prefix;
+        // Rank of the median among values matching the prefix
+        std::vector< uint32_t> rank;
+    };
+
+    // Histogram shared by the filter and its shards, 16 counters per pixel (and channel)
+    struct Histogram
+    {
+        // Guards the geometry and allocation below
+        std::mutex mtx;
+        // Type and size of histogrammed images, type is -1 until the first image is seen
+        int type = -1;
+        cv::Size size;
+        // 16-bit counters are used when the number of images allows
+        bool narrow = false;
+        std::vector< uint16_t> counts16;
+        std::vector< uint32_t> counts32;
+
+        // Rows are histogrammed in bands, each guarded by its own mutex
+        int band_rows = 0;
+        std::unique_ptr< std::mutex[]> band_mtx;
+        // Band the next shard starts with, so that shards do not wait for the same band
+        int next_start = 0;
+    };
+
+    double subtraction_factor_;
+    size_t expected_count_;
+
+    // Number of images precomputed in the first pass
+    size_t count_;
+    // Type and size of precomputed images, type_ is -1 until the first image is seen
+    int type_;
+    cv::Size size_;
+    // Bits per pixel value (8 or 16)
+    int bits_;
+    // Current pass looks at digit (value >> shift_) & 0xF
+    int shift_;
+
+    std::shared_ptr< SearchState> state_;
+    std::shared_ptr< Histogram> hist_;
+    // Band this filter starts histogramming with
+    int start_band_;
+
+    // The apply_to method uses this factored median computed in finish_precomp
+    cv::Mat factored_median_;
+
+public:
+    MedianBckgSubFilter(double subtraction_factor);
+
+    static auto create(double subtraction_factor) {
+        return std::make_unique< MedianBckgSubFilter>(subtraction_factor);
+    }
+
+    virtual void apply_to(cv::Mat & img) const;
+    virtual void precomp_from(const cv::Mat img);
+    virtual void reserve(size_t img_count);
+    virtual bool next_pass();
+    virtual void finish_precomp();
+    virtual std::unique_ptr< IFilterWithPrecomp> create_shard() const;
+    virtual void merge_shard(const IFilterWithPrecomp & shard);
+    virtual void clear();
+    virtual bool save_state(std::ostream & out) const;
+    virtual bool load_state(std::istream & in);
+
+    virtual std::string desc() const {
+        return "Median background subtraction with factor " + std::to_string(subtraction_factor_);
+    }
+
+    // Median multiplied by the subtraction factor, computed in finish_precomp. Empty if
+    // there were no precomputed images (the filter does nothing then).
+    const cv::Mat & factored_median() const {
+        return factored_median_;
+    }
+
+private:
+    // Number of histogrammed elements (pixels times channels)
+    size_t elems_() const;
+    int band_count_() const;
+    // Initializes geometry from the first image, the histogram is allocated by the first
+    // filter sharing it that sees an image
+    void init_(const cv::Mat & img);
+
+    template< typename TI, typename TC>
+    void histogram_(const cv::Mat & img, std::vector< TC> & hist, int row_beg, int row_end);
+    template< typename TC>
+    void select_bins_(std::vector< TC> & hist);
+};
+
+#endif // MEDIAN_BCKG_SUB_FILTER_H
@@ -0,0 +1,104 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "OnlineRun.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
+
+OnlineRun::OnlineRun(const ImageProcessor & processor, unsigned threads)
+    : processor_(processor.clone()), window_size_(0), count_(0)
+{
+    processor_->set_threads(threads);
+    if (processor_->needs_precomputation())
+        throw HranolRuntimeException("Filters that need precomputation can't be used in watch mode.");
+
+    // Loaded background is merged back by clear()
+    for (auto&& of : processor_->precomp_filters_)
+        of->clear();
+    processor_->prepare_filters_();
+
+    if (processor_->windowed_)
+    {
+        processor_->windowed_->clear();
+        if (!processor_->windowed_->is_running())
+            window_size_ = 2 * processor_->windowed_->radius() + 1;
+    }
+}
+
+void OnlineRun::filter(IImageStore * imstore)
+{
+    size_t store_sz = imstore->size();
+    if (store_sz == 0)
+        return;
+
+    imstore->set_pool(processor_->pool_);
+
+    // Stores without an output folder (see MemoryImageStore) keep no log
+    if (count_ == 0 && !imstore->get_dest().empty())
+    {
+        imstore->create_dest();
+        processor_->create_log_(imstore);
+    }
+
+    auto & windowed = processor_->windowed_;
+    unsigned threads = processor_->threads_;
+
+    // Images are decoded in parallel, go through the window one by one in order and the rest
+    // of the filters is applied in parallel again. Big batches (e.g. images that were already
+    // in the folder when the watch started) are split, so that only a few images are loaded at once.
+    size_t chunk = max< size_t>(16, 4 * threads);
+    for (size_t beg = 0; beg < store_sz; beg += chunk)
+    {
+        size_t end = min(store_sz, beg + chunk);
+
+        auto for_each_img = [&](unsigned workers, auto body) {
+            parallel_for(end - beg, workers, [&](size_t k, unsigned) {
+                size_t i = beg + k;
+                try {
+                    body(i);
+                }
+                catch (HranolException &e) {
+                    e.append("\nApplying filter(s) failed for image: " + imstore->get_img_path(i));
+                    throw;
+                }
+            });
+        };
+
+        for_each_img(threads, [&](size_t i) { imstore->load(i); });
+
+        if (windowed)
+            for_each_img(1, [&](size_t i) {
+                cv::Mat & img = imstore->load(i);
+                if (window_size_ != 0)
+                {
+                    window_.push_back(processor_->pooled_copy_(img));
+                    windowed->push(window_.back());
+                    if (window_.size() > window_size_)
+                    {
+                        windowed->pop(window_.front());
+                        processor_->pool_->recycle(window_.front());
+                        window_.pop_front();
+                    }
+                }
+                else
+                    windowed->push(img);
+
+                windowed->prepare();
+                windowed->apply_to(img);
+            });
+
+        for_each_img(threads, [&](size_t i) {
+            processor_->filter_img_(imstore->load(i));
+            imstore->save(i);
+            imstore->release(i);
+        });
+
+        count_ += end - beg;
+    }
+}
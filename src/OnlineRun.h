@@ -0,0 +1,47 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef ONLINE_RUN_H
+#define ONLINE_RUN_H
+
+#include "ImageProcessor.h"
+#include "ImageStore.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <deque>
+#include <memory>
+
+
+// OnlineRun filters images of a single folder in watch mode. Images arrive in batches
+// (see FolderWatcher) and every batch is filtered and saved right away, there is no
+// precomputation pass. Windowed filter gets a trailing window instead of the centered one:
+// the last 2 * radius + 1 images including the filtered one, or all images so far if the
+// filter is running. Filters with precomputation must already have their data (background
+// loaded from a file).
+class OnlineRun
+{
+    // Clone of the processor, so that the window of this run is not shared with other runs
+    std::unique_ptr< ImageProcessor> processor_;
+    // Original content of the images in the window, not kept for running filter
+    std::deque< cv::Mat> window_;
+    // Maximal number of images in the window, 0 if the window is not limited
+    size_t window_size_;
+    // Number of images filtered so far
+    size_t count_;
+
+public:
+    OnlineRun(const ImageProcessor & processor, unsigned threads);
+
+    // Filters and saves all images of imstore in order. The log of the run is written
+    // together with the first batch.
+    void filter(IImageStore * imstore);
+
+    size_t count() const {
+        return count_;
+    }
+};
+
+#endif // ONLINE_RUN_H
@@ -0,0 +1,394 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "OutputSink.h"
+#include "HranolException.h"
+
+#include "opencv2/imgcodecs.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    // TIFF field types
+    const int TIFF_SHORT = 3;
+    const int TIFF_LONG = 4;
+    const int TIFF_ASCII = 2;
+    const int TIFF_LONG8 = 16;
+
+    const int TIFF_PACKBITS = 32773;
+
+    // Number of tags in every page directory
+    const int TIFF_TAGS = 11;
+
+    // Image data start after the header of BigTIFF (classic TIFF header takes 8 bytes)
+    const uint64_t TIFF_DATA_OFFSET = 16;
+
+    // Appends PackBits encoded bytes [p, p + n) to out
+    void packbits(const unsigned char * p, size_t n, vector< unsigned char> & out)
+    {
+        size_t i = 0;
+        while (i < n)
+        {
+            size_t j = i + 1;
+            while (j < n && j - i < 128 && p[j] == p[i])
+                ++j;
+
+            if (j - i >= 2)
+            {
+                // Run of equal bytes, count is stored as 1 - length
+                out.push_back((unsigned char) (257 - (j - i)));
+                out.push_back(p[i]);
+                i = j;
+                continue;
+            }
+
+            // Literal bytes up to the next run, count is stored as length - 1
+            size_t beg = i++;
+            while (i < n && i - beg < 128 && !(i + 1 < n && p[i] == p[i + 1]))
+                ++i;
+
+            out.push_back((unsigned char) (i - beg - 1));
+            out.insert(out.end(), p + beg, p + i);
+        }
+    }
+}
+
+unique_ptr< IOutputSink> IOutputSink::create(OutputFormat format, Compression compression,
+    const fs::path & dest, size_t count)
+{
+    switch (format)
+    {
+    case OutputFormat::RAW_STACK:
+        if (compression == Compression::FAST)
+            throw HranolRuntimeException("Raw stack output can not be compressed.");
+        return make_unique< RawStackSink>(dest / "frames.bin", count);
+    case OutputFormat::TIFF_STACK:
+        return make_unique< TiffStackSink>(dest / "frames.tif", count, compression == Compression::FAST);
+    default:
+        return make_unique< FileSink>(dest, compression);
+    }
+}
+
+
+FileSink::FileSink(fs::path dest, Compression compression)
+    : dest_(std::move(dest))
+{
+    // Compression levels apply to PNG files only, other encoders ignore them
+    if (compression == Compression::NONE)
+        params_ = { cv::IMWRITE_PNG_COMPRESSION, 0 };
+    else if (compression == Compression::FAST)
+        params_ = { cv::IMWRITE_PNG_COMPRESSION, 1 };
+}
+
+void FileSink::write(size_t, const cv::Mat & img, const fs::path & name)
+{
+    fs::path img_dest = dest_ / name.filename().string();
+    auto start = RunStats::Clock::now();
+    try {
+        cv::imwrite(img_dest.string(), img, params_);
+    }
+    catch (const runtime_error & e) {
+        throw HranolRuntimeException("Writing image: \"" + img_dest.string() + "\" failed: " + e.what());
+    }
+
+    if (stats_)
+    {
+        stats_->add_time(RunStats::ENCODE, start);
+        error_code ec;
+        auto bytes = fs::file_size(img_dest, ec);
+        if (!ec)
+            stats_->add_written(bytes);
+    }
+}
+
+
+void RawStackSink::write(size_t i, const cv::Mat & img, const fs::path & name)
+{
+    std::call_once(created_, [&]() { create_(img); });
+
+    if (img.cols != (int) header_.width || img.rows != (int) header_.height || img.type() != (int) header_.type)
+        throw HranolRuntimeException("Image: \"" + name.string() + "\" does not match the geometry of the raw stack \"" +
+            path_.string() + "\".");
+
+    auto start = RunStats::Clock::now();
+    size_t offset = (size_t) (header_.data_offset + i * header_.frame_stride);
+    uchar * slot = file_->data() + offset;
+    size_t row_bytes = img.cols * img.elemSize();
+    for (int r = 0; r < img.rows; ++r)
+        memcpy(slot + r * row_bytes, img.ptr(r), row_bytes);
+
+    // Written pages stay in the page cache until the system flushes them to the file
+    file_->drop(offset, (size_t) header_.frame_stride);
+
+    if (stats_)
+    {
+        stats_->add_time(RunStats::WRITE, start);
+        stats_->add_written(row_bytes * img.rows);
+    }
+}
+
+void RawStackSink::finish()
+{
+    // Unmaps the stack, nothing was written if it was never created
+    file_.reset();
+}
+
+void RawStackSink::create_(const cv::Mat & img)
+{
+    if (img.type() != CV_8UC1 && img.type() != CV_16UC1)
+        throw HranolRuntimeException("Only 8-bit and 16-bit grayscale images can be written to a raw stack.");
+
+    // Header takes the first page, so every slot starts at a page boundary
+    size_t page = MappedFile::page_size();
+    size_t frame_bytes = img.total() * img.elemSize();
+
+    header_.width = (uint32_t) img.cols;
+    header_.height = (uint32_t) img.rows;
+    header_.type = (uint32_t) img.type();
+    header_.frame_count = count_;
+    header_.data_offset = page;
+    header_.frame_stride = (frame_bytes + page - 1) / page * page;
+
+    file_ = make_unique< MappedFile>(path_, MappedFile::CREATE,
+        (size_t) (header_.data_offset + count_ * header_.frame_stride));
+    header_.write(file_->data());
+}
+
+
+void TiffStackSink::write(size_t i, const cv::Mat & img, const fs::path & name)
+{
+    if (img.channels() != 1 || (img.depth() != CV_8U && img.depth() != CV_16U))
+        throw HranolRuntimeException("Only 8-bit and 16-bit grayscale images can be written to a TIFF stack.");
+
+    auto start = RunStats::Clock::now();
+    // Buffers of the thread are reused by its next images
+    thread_local vector< unsigned char> data, row;
+    encode_(img, row, data);
+    if (stats_)
+        stats_->add_time(RunStats::ENCODE, start);
+
+    lock_guard< mutex> lock(mtx_);
+    start = RunStats::Clock::now();
+    if (!out_.is_open())
+        open_();
+
+    Page & page = pages_[i];
+    page.offset = end_;
+    page.bytes = data.size();
+    page.width = img.cols;
+    page.height = img.rows;
+    page.bits = (img.depth() == CV_8U) ? 8 : 16;
+    page.name = name.filename().string();
+
+    out_.write((const char *) data.data(), (streamsize) data.size());
+    end_ += data.size();
+    if (!out_)
+        throw HranolRuntimeException("Writing image: \"" + name.string() + "\" to \"" + path_.string() + "\" failed.");
+    // Only completely written pages get a directory
+    page.written = true;
+
+    if (stats_)
+    {
+        stats_->add_time(RunStats::WRITE, start);
+        stats_->add_written(data.size());
+    }
+}
+
+TiffStackSink::~TiffStackSink()
+{
+    // The run failed before finish(), pages written so far are kept readable
+    try {
+        finish();
+    }
+    catch (...) {
+    }
+}
+
+void TiffStackSink::finish()
+{
+    lock_guard< mutex> lock(mtx_);
+    if (!out_.is_open())
+        return;
+
+    // Places page names that do not fit into a directory entry and the directories after
+    // the image data. Pages that were not written are left out. Offsets of classic TIFF are
+    // 32-bit, BigTIFF is used if the directories do not fit below 4 GB.
+    size_t value_size = 0;
+    uint64_t ifd_size = 0;
+    vector< uint64_t> name_offsets(pages_.size(), 0);
+    vector< uint64_t> ifd_offsets(pages_.size(), 0);
+    size_t total = 0;
+
+    auto layout = [&]() {
+        value_size = big_ ? 8 : 4;
+        ifd_size = big_ ? (8 + TIFF_TAGS * 20 + 8) : (2 + TIFF_TAGS * 12 + 4);
+        fill(name_offsets.begin(), name_offsets.end(), 0);
+        total = 0;
+
+        uint64_t pos = end_;
+        for (size_t p = 0; p < pages_.size(); ++p)
+        {
+            if (!pages_[p].written)
+                continue;
+            ++total;
+
+            if (pages_[p].name.size() + 1 > value_size)
+            {
+                name_offsets[p] = pos;
+                pos += pages_[p].name.size() + 1;
+            }
+            // Directories start on a word boundary
+            pos += pos & 1;
+            ifd_offsets[p] = pos;
+            pos += ifd_size;
+        }
+        return pos;
+    };
+
+    big_ = false;
+    if (layout() > 0xFFFFFFFFull)
+    {
+        big_ = true;
+        layout();
+    }
+
+    // Writes a directory entry, the value is left-justified in the value field
+    auto entry = [&](int tag, int type, uint64_t count, uint64_t value) {
+        put_((uint64_t) tag, 2);
+        put_((uint64_t) type, 2);
+        put_(count, (int) value_size);
+        put_(value, (int) value_size);
+    };
+
+    uint64_t first_ifd = 0;
+    uint64_t * prev_next = &first_ifd;
+    vector< uint64_t> next_ifd(pages_.size(), 0);
+    for (size_t p = 0; p < pages_.size(); ++p)
+    {
+        if (!pages_[p].written)
+            continue;
+        *prev_next = ifd_offsets[p];
+        prev_next = &next_ifd[p];
+    }
+
+    size_t written = 0;
+    for (size_t p = 0; p < pages_.size(); ++p)
+    {
+        const Page & page = pages_[p];
+        if (!page.written)
+            continue;
+
+        uint64_t name_value = 0;
+        if (name_offsets[p] != 0)
+        {
+            out_.write(page.name.c_str(), (streamsize) page.name.size() + 1);
+            name_value = name_offsets[p];
+            end_ += page.name.size() + 1;
+        }
+        else
+        {
+            for (size_t c = 0; c < page.name.size(); ++c)
+                name_value |= (uint64_t) (unsigned char) page.name[c] << (8 * c);
+        }
+
+        if (end_ & 1)
+        {
+            out_.put(0);
+            ++end_;
+        }
+
+        // Tags must be sorted in ascending order
+        int offset_type = big_ ? TIFF_LONG8 : TIFF_LONG;
+        put_(TIFF_TAGS, big_ ? 8 : 2);
+        entry(256, TIFF_LONG, 1, (uint64_t) page.width);            // ImageWidth
+        entry(257, TIFF_LONG, 1, (uint64_t) page.height);           // ImageLength
+        entry(258, TIFF_SHORT, 1, (uint64_t) page.bits);            // BitsPerSample
+        entry(259, TIFF_SHORT, 1, packbits_ ? TIFF_PACKBITS : 1);   // Compression
+        entry(262, TIFF_SHORT, 1, 1);                               // PhotometricInterpretation, BlackIsZero
+        entry(273, offset_type, 1, page.offset);                    // StripOffsets
+        entry(277, TIFF_SHORT, 1, 1);                               // SamplesPerPixel
+        entry(278, TIFF_LONG, 1, (uint64_t) page.height);           // RowsPerStrip, single strip
+        entry(279, offset_type, 1, page.bytes);                     // StripByteCounts
+        entry(285, TIFF_ASCII, page.name.size() + 1, name_value);   // PageName, original file name
+        // PageNumber, index of the page and number of pages
+        entry(297, TIFF_SHORT, 2, (uint64_t) (written & 0xFFFF) | ((uint64_t) (total & 0xFFFF) << 16));
+        put_(next_ifd[p], (int) value_size);
+
+        end_ += ifd_size;
+        ++written;
+    }
+
+    // Header linking the first directory, classic TIFF leaves the rest of the reserved space unused
+    out_.seekp(0);
+    out_.write("II", 2);
+    if (big_)
+    {
+        put_(43, 2);
+        put_(8, 2);
+        put_(0, 2);
+    }
+    else
+        put_(42, 2);
+    put_(first_ifd, (int) value_size);
+
+    out_.close();
+    if (!out_)
+        throw HranolRuntimeException("Writing TIFF stack \"" + path_.string() + "\" failed.");
+}
+
+void TiffStackSink::open_()
+{
+    out_.open(path_, ofstream::out | ofstream::binary | ofstream::trunc);
+    if (!out_)
+        throw HranolRuntimeException("Opening file \"" + path_.string() + "\" failed.");
+
+    // The header is written by finish() once the format is known
+    put_(0, (int) TIFF_DATA_OFFSET);
+    end_ = TIFF_DATA_OFFSET;
+}
+
+void TiffStackSink::encode_(const cv::Mat & img, vector< unsigned char> & row, vector< unsigned char> & ret) const
+{
+    size_t row_bytes = img.cols * img.elemSize();
+    row.resize(row_bytes);
+    ret.clear();
+    ret.reserve(img.total() * img.elemSize());
+
+    for (int r = 0; r < img.rows; ++r)
+    {
+        const unsigned char * src = img.ptr(r);
+        if (img.depth() == CV_16U)
+        {
+            // Samples are stored little-endian regardless of the host byte order
+            const uint16_t * px = img.ptr< uint16_t>(r);
+            for (int c = 0; c < img.cols; ++c)
+            {
+                row[2 * c] = (unsigned char) (px[c] & 0xFF);
+                row[2 * c + 1] = (unsigned char) (px[c] >> 8);
+            }
+            src = row.data();
+        }
+
+        // Each row is packed separately as required by TIFF
+        if (packbits_)
+            packbits(src, row_bytes, ret);
+        else
+            ret.insert(ret.end(), src, src + row_bytes);
+    }
+}
+
+void TiffStackSink::put_(uint64_t val, int bytes)
+{
+    for (int i = 0; i < bytes; ++i, val >>= 8)
+        out_.put((char) (val & 0xFF));
+}
@@ -0,0 +1,149 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include "MappedFile.h"
+#include "RawStack.h"
+#include "RunStats.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Where filtered images of a run are written
+enum class OutputFormat {
+    FILES,      // Every image to its own file named after the original image (cv::imwrite)
+    RAW_STACK,  // All images to a single memory-mapped raw stack "frames.bin" (see RawStackHeader)
+    TIFF_STACK  // All images to a single multi-page TIFF "frames.tif"
+};
+
+enum class Compression {
+    DEFAULT,    // Default of the output format (encoder defaults for FILES, none for stacks)
+    NONE,       // No compression (PNG level 0 for FILES)
+    FAST        // Fast compression (PNG level 1 for FILES, PackBits for TIFF_STACK)
+};
+
+
+// IOutputSink receives filtered images of a single run. write() can be called concurrently
+// from multiple threads with different indices, in any order. finish() is called once after
+// all images were written.
+class IOutputSink
+{
+protected:
+    // Encoding and writing are recorded here if set
+    RunStats * stats_ = nullptr;
+
+public:
+    // i is the index of the image in the run, name is its original file name
+    virtual void write(size_t i, const cv::Mat & img, const std::filesystem::path & name) = 0;
+    virtual void finish() = 0;
+    virtual ~IOutputSink() { }
+
+    void set_stats(RunStats * stats) {
+        stats_ = stats;
+    }
+
+    // Creates sink writing count images of a run to dest (which must exist)
+    static std::unique_ptr< IOutputSink> create(OutputFormat format, Compression compression,
+        const std::filesystem::path & dest, size_t count);
+};
+
+
+// FileSink writes every image to its own file with cv::imwrite
+class FileSink : public IOutputSink
+{
+    std::filesystem::path dest_;
+    std::vector< int> params_;
+
+public:
+    FileSink(std::filesystem::path dest, Compression compression);
+
+    virtual void write(size_t i, const cv::Mat & img, const std::filesystem::path & name);
+    virtual void finish() { }
+};
+
+
+// RawStackSink copies images to their slots of a preallocated memory-mapped raw stack. Slots are
+// aligned to memory pages and written pages are dropped from the process memory right away.
+// The stack is created on the first write, all images must have the geometry of the first one.
+// Slots of images that were not written stay zeroed.
+class RawStackSink : public IOutputSink
+{
+    std::filesystem::path path_;
+    size_t count_;
+
+    std::unique_ptr< MappedFile> file_;
+    std::once_flag created_;
+    RawStackHeader header_;
+
+public:
+    RawStackSink(std::filesystem::path path, size_t count)
+        : path_(std::move(path)), count_(count)
+    {}
+
+    virtual void write(size_t i, const cv::Mat & img, const std::filesystem::path & name);
+    virtual void finish();
+
+private:
+    void create_(const cv::Mat & img);
+};
+
+
+// TiffStackSink writes images to a multi-page grayscale TIFF. Image data are appended in the order
+// they arrive (compression runs outside of the lock), the directories indexing the pages in order of
+// their indices are written at the end by finish(). Pages of images that were not written are left out.
+// Space for the larger BigTIFF header is kept, so the format is chosen by finish() from the actual
+// size of the file: BigTIFF is used when it exceeds 4 GB. If the run fails before finish(), pages
+// written so far are indexed when the sink is destroyed.
+class TiffStackSink : public IOutputSink
+{
+    struct Page
+    {
+        uint64_t offset = 0;
+        uint64_t bytes = 0;
+        int width = 0, height = 0, bits = 0;
+        // Original file name, stored as the page name
+        std::string name;
+        bool written = false;
+    };
+
+    std::filesystem::path path_;
+    bool packbits_;
+    bool big_;
+
+    std::ofstream out_;
+    uint64_t end_;
+    std::vector< Page> pages_;
+    std::mutex mtx_;
+
+public:
+    TiffStackSink(std::filesystem::path path, size_t count, bool packbits)
+        : path_(std::move(path)), packbits_(packbits), big_(false), end_(0),
+        pages_(count)
+    {}
+
+    virtual ~TiffStackSink();
+
+    virtual void write(size_t i, const cv::Mat & img, const std::filesystem::path & name);
+    virtual void finish();
+
+private:
+    // Creates the file with space for the header, called under the lock with the first image
+    void open_();
+    // Encodes image data (little-endian samples, optionally PackBits compressed by rows) to dst,
+    // row is scratch for a single row. Buffers of both are reused.
+    void encode_(const cv::Mat & img, std::vector< unsigned char> & row, std::vector< unsigned char> & dst) const;
+    void put_(uint64_t val, int bytes);
+};
+
+#endif // OUTPUT_SINK_H
@@ -0,0 +1,77 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Resolves the number of worker threads requested by user. Value 0 stands for
+// "use all available cores".
+inline unsigned resolve_thread_count(unsigned requested)
+{
+    if (requested != 0)
+        return requested;
+
+    unsigned hw = std::thread::hardware_concurrency();
+    return (hw == 0) ? 1 : hw;
+}
+
+// Calls body(i, worker) for every i in [0, n) using up to threads workers. The calling
+// thread is one of the workers, so threads == 1 runs the whole loop in the calling thread.
+// Indices are handed out dynamically in increasing order. worker is in [0, threads) and
+// identifies the worker calling the body, which allows to keep per-worker data.
+//
+// If body throws, no new indices are handed out and the first exception is rethrown
+// in the calling thread after all workers have finished.
+template< typename Body>
+void parallel_for(size_t n, unsigned threads, Body body)
+{
+    std::atomic< size_t> next_idx(0);
+    std::atomic< bool> failed(false);
+    std::exception_ptr first_error;
+    std::mutex error_mtx;
+
+    auto worker = [&](unsigned worker_idx) {
+        while (!failed)
+        {
+            size_t i = next_idx++;
+            if (i >= n)
+                return;
+
+            try {
+                body(i, worker_idx);
+            }
+            catch (...) {
+                std::lock_guard< std::mutex> lock(error_mtx);
+                if (!first_error)
+                    first_error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    if (threads > n)
+        threads = (unsigned) n;
+
+    std::vector< std::thread> helpers;
+    for (unsigned t = 1; t < threads; ++t)
+        helpers.emplace_back(worker, t);
+
+    worker(0);
+
+    for (auto&& h : helpers)
+        h.join();
+
+    if (first_error)
+        std::rethrow_exception(first_error);
+}
+
+#endif // PARALLEL_H
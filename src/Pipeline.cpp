@@ -0,0 +1,233 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Pipeline.h"
+#include "BoundedQueue.h"
+#include "HranolException.h"
+
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+namespace
+{
+    // Image travelling through the pipeline
+    struct Item
+    {
+        size_t idx;
+        cv::Mat * img;
+        // When the image started loading, for the latency of the image
+        Clock::time_point loaded;
+    };
+
+    enum Stage { DECODE = 0, FILTER = 1, ENCODE = 2 };
+
+    long long ns_since(Clock::time_point start)
+    {
+        return chrono::duration_cast< chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    string percent(double util)
+    {
+        return to_string((int) (util * 100 + 0.5)) + "%";
+    }
+}
+
+FilterPipeline::FilterPipeline(size_t queue_depth, unsigned threads)
+    : queue_depth_(queue_depth), threads_((threads == 0) ? 1 : threads), wall_ns_(0)
+{
+    stages_[DECODE].name = "decode";
+    stages_[FILTER].name = "filter";
+    stages_[ENCODE].name = "encode";
+}
+
+void FilterPipeline::run(IImageStore * imstore, const vector< size_t> & indices, const FilterFn & filter,
+    const SavedFn & saved, Progress & progress)
+{
+    for (auto&& st : stages_)
+        st.busy_ns = 0;
+
+    auto n = indices.size();
+    BoundedQueue< Item> decoded(queue_depth_);
+    BoundedQueue< Item> filtered(queue_depth_);
+
+    atomic< size_t> next_idx(0);
+    atomic< unsigned> decoders_left(threads_);
+    atomic< unsigned> filters_left(threads_);
+
+    exception_ptr first_error;
+    // Loaded images that did not make it through the pipeline, released after the workers finish
+    vector< size_t> abandoned;
+    mutex error_mtx;
+    // Stores the exception being handled and stops all stages
+    auto fail = [&]() {
+        lock_guard< mutex> lock(error_mtx);
+        if (!first_error)
+            first_error = current_exception();
+        for (auto&& item : decoded.abort())
+            abandoned.push_back(item.idx);
+        for (auto&& item : filtered.abort())
+            abandoned.push_back(item.idx);
+    };
+    // Image that was loaded but won't be saved
+    auto abandon = [&](size_t idx) {
+        lock_guard< mutex> lock(error_mtx);
+        abandoned.push_back(idx);
+    };
+
+    auto decode = [&]() {
+        for (size_t k = next_idx++; k < n; k = next_idx++)
+        {
+            auto start = Clock::now();
+            Item item{ indices[k], nullptr, start };
+            try {
+                item.img = &imstore->load(item.idx);
+            }
+            catch (HranolException &e) {
+                e.append("\nLoading image failed: " + imstore->get_img_path(item.idx));
+                fail();
+                break;
+            }
+            catch (...) {
+                fail();
+                break;
+            }
+            stages_[DECODE].busy_ns += ns_since(start);
+
+            if (!decoded.push(item))
+            {
+                abandon(item.idx);
+                break;
+            }
+        }
+        // The last decoder lets filter stage know there won't be more images
+        if (--decoders_left == 0)
+            decoded.close();
+    };
+
+    auto filter_stage = [&]() {
+        Item item;
+        while (decoded.pop(item))
+        {
+            auto start = Clock::now();
+            try {
+                filter(*item.img);
+            }
+            catch (HranolException &e) {
+                e.append("\nApplying filter(s) failed for image: " + imstore->get_img_path(item.idx));
+                abandon(item.idx);
+                fail();
+                break;
+            }
+            catch (...) {
+                abandon(item.idx);
+                fail();
+                break;
+            }
+            stages_[FILTER].busy_ns += ns_since(start);
+
+            if (!filtered.push(item))
+            {
+                abandon(item.idx);
+                break;
+            }
+        }
+        if (--filters_left == 0)
+            filtered.close();
+    };
+
+    auto encode = [&]() {
+        Item item;
+        while (filtered.pop(item))
+        {
+            auto start = Clock::now();
+            try {
+                imstore->save(item.idx);
+            }
+            catch (...) {
+                abandon(item.idx);
+                fail();
+                break;
+            }
+            try {
+                imstore->release(item.idx);
+                saved(item.idx);
+                imstore->stats().add_latency(Clock::now() - item.loaded);
+            }
+            catch (...) {
+                fail();
+                break;
+            }
+            stages_[ENCODE].busy_ns += ns_since(start);
+            progress.tick();
+        }
+    };
+
+    auto run_start = Clock::now();
+    progress.set_status([this, run_start]() {
+        long long wall_ns = ns_since(run_start);
+        size_t s = bottleneck_(wall_ns);
+        return "bottleneck: " + string(stages_[s].name) + " " + percent(utilisation_(s, wall_ns));
+    });
+
+    vector< thread> workers;
+    for (unsigned t = 0; t < threads_; ++t)
+    {
+        workers.emplace_back(decode);
+        workers.emplace_back(filter_stage);
+        workers.emplace_back(encode);
+    }
+    for (auto&& w : workers)
+        w.join();
+
+    wall_ns_ = ns_since(run_start);
+    // The final line is followed by report()
+    progress.set_status(nullptr);
+
+    if (first_error)
+    {
+        // E.g. OnDemandImageStore would keep the abandoned images in memory
+        for (size_t idx : abandoned)
+            imstore->release(idx);
+        rethrow_exception(first_error);
+    }
+}
+
+string FilterPipeline::report() const
+{
+    if (wall_ns_ <= 0)
+        return "no images processed";
+
+    string ret;
+    for (size_t s = 0; s < stages_.size(); ++s)
+    {
+        if (!ret.empty())
+            ret += ", ";
+        ret += string(stages_[s].name) + " " + percent(utilisation_(s, wall_ns_));
+    }
+
+    return ret + " (bottleneck: " + stages_[bottleneck_(wall_ns_)].name + ")";
+}
+
+double FilterPipeline::utilisation_(size_t s, long long wall_ns) const
+{
+    if (wall_ns <= 0)
+        return 0;
+    return (double) stages_[s].busy_ns / ((double) wall_ns * threads_);
+}
+
+size_t FilterPipeline::bottleneck_(long long wall_ns) const
+{
+    size_t ret = 0;
+    for (size_t s = 1; s < stages_.size(); ++s)
+        if (utilisation_(s, wall_ns) > utilisation_(ret, wall_ns))
+            ret = s;
+    return ret;
+}
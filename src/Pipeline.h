@@ -0,0 +1,66 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "ImageStore.h"
+#include "Progress.h"
+
+#include "opencv2/core/mat.hpp"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+// FilterPipeline runs the filtering pass as three stages connected by bounded queues:
+//   decode (IImageStore::load) -> filter -> encode (IImageStore::save and release)
+// Every stage has its own worker threads, so reading and decoding of upcoming images,
+// filtering and encoding of already filtered images overlap. Queue depth limits the
+// number of images waiting between two stages, which keeps memory usage capped.
+class FilterPipeline
+{
+public:
+    using FilterFn = std::function< void(cv::Mat &)>;
+    using SavedFn = std::function< void(size_t)>;
+
+private:
+    struct StageStats
+    {
+        const char* name;
+        // Time spent by all stage workers doing actual work (not waiting for queues)
+        std::atomic< long long> busy_ns;
+    };
+
+    size_t queue_depth_;
+    unsigned threads_;
+    std::array< StageStats, 3> stages_;
+    long long wall_ns_;
+
+public:
+    FilterPipeline(size_t queue_depth, unsigned threads);
+
+    // Loads, filters and saves images of imstore with given indices. filter is called concurrently
+    // from the filter stage workers, saved is called by the encode stage workers with index
+    // of each saved image. While the images are filtered, the current bottleneck is shown in
+    // the progress line, e.g. "bottleneck: decode 93%".
+    void run(IImageStore * imstore, const std::vector< size_t> & indices, const FilterFn & filter,
+        const SavedFn & saved, Progress & progress);
+
+    // Describes how busy each stage was during the last run and which one was
+    // the bottleneck, e.g. "decode 93%, filter 21%, encode 40% (bottleneck: decode)"
+    std::string report() const;
+
+private:
+    // Share of wall_ns the workers of stage s spent working
+    double utilisation_(size_t s, long long wall_ns) const;
+    // Stage with the highest utilisation during wall_ns
+    size_t bottleneck_(long long wall_ns) const;
+};
+
+#endif // PIPELINE_H
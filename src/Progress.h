@@ -0,0 +1,126 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+
+// Progress prints "\r\t<label>: i / n, X images/s, ETA Y s" status line. tick() can be called
+// from multiple worker threads, it only increments a counter. The line is printed by a
+// background thread a few times per second, so workers never wait for the console.
+// Text of the status function (if set) is appended to the line.
+// Disabled progress prints nothing.
+class Progress
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::string label_;
+    size_t total_;
+    std::atomic< size_t> done_;
+    Clock::time_point start_;
+    // Length of the last printed line, shorter line has to overwrite it
+    size_t line_len_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_;
+    std::function< std::string()> status_;
+    std::thread printer_;
+
+public:
+    Progress(std::string label, size_t total, bool enabled = true)
+        : label_(std::move(label)), total_(total), done_(0), start_(Clock::now()), line_len_(0), stopped_(false)
+    {
+        if (enabled)
+            printer_ = std::thread([this]() {
+                std::unique_lock< std::mutex> lock(mtx_);
+                while (!cv_.wait_for(lock, std::chrono::milliseconds(250), [this]() { return stopped_; }))
+                    print_();
+            });
+    }
+
+    ~Progress() {
+        stop_();
+    }
+
+    void tick() {
+        ++done_;
+    }
+
+    // status is called by the printing thread, empty status clears it
+    void set_status(std::function< std::string()> status)
+    {
+        std::lock_guard< std::mutex> lock(mtx_);
+        status_ = std::move(status);
+    }
+
+    // Prints the final status line followed by endline
+    void finish()
+    {
+        if (!printer_.joinable())
+            return;
+
+        stop_();
+        print_();
+        std::cout << std::endl;
+    }
+
+private:
+    void stop_()
+    {
+        if (!printer_.joinable())
+            return;
+
+        {
+            std::lock_guard< std::mutex> lock(mtx_);
+            stopped_ = true;
+        }
+        cv_.notify_one();
+        printer_.join();
+    }
+
+    void print_()
+    {
+        size_t done = done_;
+        double secs = std::chrono::duration< double>(Clock::now() - start_).count();
+
+        std::ostringstream line;
+        line << "\r\t" << label_ << ": " << done << " / " << total_;
+        if (done > 0 && secs > 0)
+        {
+            double rate = done / secs;
+            line << ", " << std::fixed << std::setprecision(1) << rate << " images/s";
+            if (done < total_)
+                line << ", ETA " << std::setprecision(0) << (total_ - done) / rate << " s";
+        }
+        if (status_)
+        {
+            std::string status = status_();
+            if (!status.empty())
+                line << ", " << status;
+        }
+
+        std::string str = line.str();
+        size_t len = str.size();
+        if (len < line_len_)
+            str.append(line_len_ - len, ' ');
+        line_len_ = len;
+
+        std::cout << str << std::flush;
+    }
+};
+
+#endif // PROGRESS_H
@@ -0,0 +1,91 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef RAW_STACK_H
+#define RAW_STACK_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+
+// Raw stack is a file holding uncompressed frames of equal geometry after a fixed header:
+//
+//   offset  size  field
+//   0       8     magic "HRNLSTK1"
+//   8       4     frame width in pixels
+//   12      4     frame height in pixels
+//   16      4     OpenCV type of frames (CV_8UC1 or CV_16UC1)
+//   20      4     reserved, 0
+//   24      8     number of frames
+//   32      8     offset of the first frame from the beginning of the file
+//   40      8     frame stride, distance of starts of two consecutive frames in bytes
+//
+// All values are little-endian. Rows of a frame are stored without padding, frames may be
+// padded (e.g. aligned to memory pages) using the frame stride.
+struct RawStackHeader
+{
+    static const size_t SIZE = 48;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t type;
+    uint64_t frame_count;
+    uint64_t data_offset;
+    uint64_t frame_stride;
+
+    RawStackHeader()
+        : width(0), height(0), type(0), frame_count(0), data_offset(SIZE), frame_stride(0)
+    {}
+
+    // Reads header from the beginning of data, returns false if there is no valid header
+    bool parse(const unsigned char * data, size_t size)
+    {
+        if (size < SIZE || memcmp(data, magic_(), 8) != 0)
+            return false;
+
+        width = (uint32_t) read_le_(data + 8, 4);
+        height = (uint32_t) read_le_(data + 12, 4);
+        type = (uint32_t) read_le_(data + 16, 4);
+        frame_count = read_le_(data + 24, 8);
+        data_offset = read_le_(data + 32, 8);
+        frame_stride = read_le_(data + 40, 8);
+        return true;
+    }
+
+    // Writes SIZE bytes of the header to data
+    void write(unsigned char * data) const
+    {
+        memcpy(data, magic_(), 8);
+        write_le_(data + 8, width, 4);
+        write_le_(data + 12, height, 4);
+        write_le_(data + 16, type, 4);
+        write_le_(data + 20, 0, 4);
+        write_le_(data + 24, frame_count, 8);
+        write_le_(data + 32, data_offset, 8);
+        write_le_(data + 40, frame_stride, 8);
+    }
+
+private:
+    static const char * magic_() {
+        return "HRNLSTK1";
+    }
+
+    static uint64_t read_le_(const unsigned char * p, int bytes)
+    {
+        uint64_t ret = 0;
+        for (int i = bytes - 1; i >= 0; --i)
+            ret = (ret << 8) | p[i];
+        return ret;
+    }
+
+    static void write_le_(unsigned char * p, uint64_t val, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i, val >>= 8)
+            p[i] = (unsigned char) (val & 0xFF);
+    }
+};
+
+#endif // RAW_STACK_H
@@ -0,0 +1,204 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "RunManifest.h"
+#include "HranolException.h"
+
+#include <algorithm>
+#include <sstream>
+#include <system_error>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const char * MANIFEST_HEADER = "hranol manifest 1";
+
+    fs::path manifest_path(const fs::path & dest)
+    {
+        return dest / "fltrd_manifest.txt";
+    }
+
+    // Reads the configuration lines, which follow the header. Returns false if in is not a manifest.
+    bool read_config(istream & in, vector< string> & config)
+    {
+        string line;
+        if (!getline(in, line) || line != MANIFEST_HEADER)
+            return false;
+
+        // Only lines starting with 'c' are taken, so that the first input stays in the stream
+        while (in.peek() == 'c' && getline(in, line) && !in.eof())
+        {
+            istringstream ls(line);
+            string key;
+            ls >> key;
+            if (key != "config")
+                break;
+            config.push_back(line.substr(min(line.size(), key.size() + 1)));
+        }
+        return true;
+    }
+}
+
+RunManifest::RunManifest(const IImageStore * imstore, vector< string> config)
+    : dest_(imstore->get_dest()), config_(std::move(config)), prev_state_(false)
+{
+    inputs_.reserve(imstore->size());
+    for (size_t i = 0; i < imstore->size(); ++i)
+    {
+        fs::path src = imstore->get_source(i);
+
+        // Inputs that can't be examined never match, so they are always filtered again
+        error_code size_ec, mtime_ec;
+        Input in{ fs::path(imstore->get_img_path(i)).filename().string(), 0, 0, false };
+        auto size = fs::file_size(src, size_ec);
+        auto mtime = fs::last_write_time(src, mtime_ec);
+        if (!size_ec && !mtime_ec)
+        {
+            in.size = (unsigned long long) size;
+            in.mtime = (long long) mtime.time_since_epoch().count();
+            in.known = true;
+        }
+        inputs_.push_back(std::move(in));
+    }
+}
+
+bool RunManifest::load()
+{
+    ifstream in(manifest_path(dest_));
+    vector< string> config;
+    if (!read_config(in, config) || config != config_)
+        return false;
+
+    string line;
+    vector< Input> inputs;
+    vector< char> done;
+    bool state = false;
+
+    while (getline(in, line))
+    {
+        // The last line may be cut off if the previous run was killed while writing it
+        if (in.eof())
+            break;
+
+        istringstream ls(line);
+        string key;
+        ls >> key;
+
+        if (key == "config")
+            return false;
+        else if (key == "input")
+        {
+            // Name is the rest of the line, it may contain spaces
+            Input input{ "", 0, 0, false };
+            string size, mtime;
+            if (ls >> size >> mtime)
+            {
+                istringstream size_s(size), mtime_s(mtime);
+                input.known = (size_s >> input.size) && (mtime_s >> input.mtime);
+                ls.get();
+                getline(ls, input.name);
+                inputs.push_back(std::move(input));
+                done.push_back(0);
+            }
+        }
+        else if (key == "state")
+            state = true;
+        else if (key == "done")
+        {
+            size_t idx;
+            if (ls >> idx && idx < done.size())
+                done[idx] = 1;
+        }
+    }
+
+    prev_inputs_ = std::move(inputs);
+    prev_done_ = std::move(done);
+    prev_state_ = state;
+
+    prev_idx_.clear();
+    for (size_t i = 0; i < prev_inputs_.size(); ++i)
+        prev_idx_.emplace(prev_inputs_[i].name, i);
+
+    return true;
+}
+
+bool RunManifest::matches(const fs::path & dest, const vector< string> & config)
+{
+    ifstream in(manifest_path(dest));
+    vector< string> manifest_config;
+    return read_config(in, manifest_config) && manifest_config == config;
+}
+
+bool RunManifest::inputs_unchanged() const
+{
+    return inputs_ == prev_inputs_;
+}
+
+bool RunManifest::done(size_t i) const
+{
+    auto it = prev_idx_.find(inputs_[i].name);
+    if (it == prev_idx_.end())
+        return false;
+
+    return prev_done_[it->second] && prev_inputs_[it->second] == inputs_[i];
+}
+
+bool RunManifest::unchanged_at(size_t i) const
+{
+    return i < prev_inputs_.size() && prev_inputs_[i] == inputs_[i];
+}
+
+void RunManifest::start(const vector< char> & keep_done, bool keep_state)
+{
+    lock_guard< mutex> lock(out_mtx_);
+    out_.open(manifest_path(dest_), ofstream::out | ofstream::trunc);
+    if (!out_)
+        throw HranolRuntimeException("Opening manifest \"" + manifest_path(dest_).string() + "\" failed.");
+
+    out_ << MANIFEST_HEADER << '\n';
+    for (auto&& line : config_)
+        out_ << "config " << line << '\n';
+    for (auto&& input : inputs_)
+    {
+        if (input.known)
+            out_ << "input " << input.size << ' ' << input.mtime << ' ' << input.name << '\n';
+        else
+            out_ << "input - - " << input.name << '\n';
+    }
+    if (keep_state)
+        out_ << "state\n";
+    for (size_t i = 0; i < keep_done.size(); ++i)
+        if (keep_done[i])
+            out_ << "done " << i << '\n';
+    out_.flush();
+}
+
+void RunManifest::mark_state()
+{
+    append_("state");
+}
+
+void RunManifest::mark_done(size_t i)
+{
+    // Called for every image, the line is not built as a string, so that it does not allocate
+    lock_guard< mutex> lock(out_mtx_);
+    out_ << "done " << i << '\n';
+    out_.flush();
+}
+
+void RunManifest::mark_complete()
+{
+    append_("complete");
+}
+
+void RunManifest::append_(const string & line)
+{
+    lock_guard< mutex> lock(out_mtx_);
+    // Each line is flushed right away, so that it survives if the process is killed
+    out_ << line << '\n';
+    out_.flush();
+}
@@ -0,0 +1,101 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef RUN_MANIFEST_H
+#define RUN_MANIFEST_H
+
+#include "ImageStore.h"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// RunManifest records progress of a run in "fltrd_manifest.txt" in the output folder, so that
+// an interrupted run can be resumed. The manifest is a text file:
+//
+//   hranol manifest 1
+//   config <line>          (filter configuration, one line per filter)
+//   input <size> <mtime> <name>
+//   ...
+//   state                  (precomputed data were saved to "fltrd_state.bin")
+//   done <index>           (index-th input was filtered and saved)
+//   ...
+//   complete
+//
+// Lines after the inputs are appended while the run goes on. Inputs are identified by their name
+// (file name, for stacks "<stack> [frame i]"), size and modification time of the source file.
+// Inputs whose source could not be examined have size and time "-" and never match.
+class RunManifest
+{
+    struct Input
+    {
+        std::string name;
+        unsigned long long size;
+        long long mtime;
+        // False if size or modification time of the source is not known
+        bool known;
+
+        bool operator==(const Input & other) const {
+            return known && other.known && name == other.name && size == other.size && mtime == other.mtime;
+        }
+    };
+
+    std::filesystem::path dest_;
+    std::vector< std::string> config_;
+    std::vector< Input> inputs_;
+
+    // Manifest of the previous run, empty if it was not loaded
+    std::vector< Input> prev_inputs_;
+    std::vector< char> prev_done_;
+    std::map< std::string, size_t> prev_idx_;
+    bool prev_state_;
+
+    std::ofstream out_;
+    std::mutex out_mtx_;
+
+public:
+    // Describes current inputs of imstore, config holds lines describing the filters
+    RunManifest(const IImageStore * imstore, std::vector< std::string> config);
+
+    // Loads manifest of the previous run from the output folder. Returns false if there is none
+    // or it was written with a different configuration.
+    bool load();
+
+    // Returns true if dest holds a manifest written with configuration config
+    static bool matches(const std::filesystem::path & dest, const std::vector< std::string> & config);
+
+    // Returns true if the previous run had exactly the same inputs
+    bool inputs_unchanged() const;
+    // Returns true if i-th input was filtered and saved by the previous run and did not change
+    bool done(size_t i) const;
+    // Returns true if i-th input is the same as i-th input of the previous run
+    bool unchanged_at(size_t i) const;
+    // Returns true if the previous run saved precomputed data
+    bool has_state() const {
+        return prev_state_;
+    }
+
+    // Path of the file holding precomputed data
+    std::filesystem::path state_path() const {
+        return dest_ / "fltrd_state.bin";
+    }
+
+    // Writes a new manifest with current inputs. Inputs with non-zero keep_done[i] are recorded
+    // as done, keep_state keeps the record of saved precomputed data.
+    void start(const std::vector< char> & keep_done, bool keep_state);
+    // Following methods append to the manifest, mark_done can be called from multiple threads
+    void mark_state();
+    void mark_done(size_t i);
+    void mark_complete();
+
+private:
+    void append_(const std::string & line);
+};
+
+#endif // RUN_MANIFEST_H
@@ -0,0 +1,198 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "RunScheduler.h"
+#include "BoundedQueue.h"
+#include "OnlineRun.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+namespace
+{
+    // Run listed by the crawler. If listing failed, error holds the reason.
+    struct PendingRun
+    {
+        unique_ptr< IImageStore> store;
+        string error;
+    };
+}
+
+void RunScheduler::process(FolderCrawler & crawler)
+{
+    // Capacity 1 lets the crawler list one folder ahead of the runs being processed
+    BoundedQueue< PendingRun> pending(1);
+
+    thread crawl_thread([&]() {
+        while (crawler.has_next_run())
+        {
+            PendingRun run;
+            try {
+                run.store = crawler.get_next_run();
+            }
+            catch (const exception &e) {
+                run.error = e.what();
+            }
+
+            if (!pending.push(std::move(run)))
+                break;
+        }
+        pending.close();
+    });
+
+    // Threads are split evenly among concurrently processed runs
+    unsigned run_threads = max(1u, threads_ / concurrent_runs_);
+
+    auto worker = [&]() {
+        PendingRun run;
+        while (pending.pop(run))
+        {
+            if (run.store)
+                process_run_(std::move(run.store), run_threads);
+            else
+                print_error_("", run.error);
+        }
+    };
+
+    vector< thread> workers;
+    for (unsigned r = 1; r < concurrent_runs_; ++r)
+        workers.emplace_back(worker);
+
+    worker();
+
+    for (auto&& w : workers)
+        w.join();
+    crawl_thread.join();
+
+    if (processor_.get_print_stats())
+        cout << "Discovery: " << crawler.report() << endl;
+}
+
+void RunScheduler::watch(FolderWatcher & watcher, unsigned idle_timeout)
+{
+    cout << "Watching for new images";
+    if (idle_timeout != 0)
+        cout << " (stops after " << idle_timeout << " s without a new image)";
+    cout << endl;
+
+    // Runs by origin folder
+    map< fs::path, unique_ptr< OnlineRun>> runs;
+    auto last_image = Clock::now();
+
+    for (;;)
+    {
+        int timeout_ms = -1;
+        if (idle_timeout != 0)
+        {
+            auto idle = chrono::duration_cast< chrono::milliseconds>(Clock::now() - last_image).count();
+            timeout_ms = (int) max< long long>(0, idle_timeout * 1000LL - idle);
+        }
+
+        auto stores = watcher.wait(timeout_ms);
+        if (stores.empty())
+        {
+            if (idle_timeout != 0 && Clock::now() - last_image >= chrono::seconds(idle_timeout))
+                break;
+            continue;
+        }
+
+        for (auto&& store : stores)
+        {
+            fs::path origin = store->get_origin();
+            try {
+                auto & run = runs[origin];
+                if (!run)
+                    run = make_unique< OnlineRun>(processor_, threads_);
+                run->filter(store.get());
+
+                lock_guard< mutex> lock(output_mtx_);
+                cout << "\"" << origin.string() << "\": " << run->count() << " images filtered" << endl;
+            }
+            catch (const exception &e) {
+                // Folder gets a new run with the next image
+                runs.erase(origin);
+                print_error_(origin.string(), e.what());
+            }
+        }
+        last_image = Clock::now();
+    }
+}
+
+void RunScheduler::process_run_(unique_ptr< IImageStore> store, unsigned run_threads)
+{
+    size_t memory = 0;
+    try {
+        if (memory_budget_ != 0)
+        {
+            memory = store->estimate_memory(processor_.max_loaded_images(run_threads));
+        }
+        acquire_memory_(memory);
+    }
+    catch (const exception &e) {
+        print_error_(store->get_origin().string(), e.what());
+        return;
+    }
+
+    try {
+        auto processor = processor_.clone();
+        processor->set_threads(run_threads);
+        processor->set_quiet(concurrent_runs_ > 1);
+        processor->apply_filters(store.get());
+
+        if (concurrent_runs_ > 1)
+        {
+            lock_guard< mutex> lock(output_mtx_);
+            cout << "\"" << store->get_origin().string() << "\": " << store->size() << " images filtered" << endl;
+            if (processor->get_print_stats())
+                cout << store->stats().summary();
+        }
+    }
+    catch (const exception &e) {
+        print_error_(store->get_origin().string(), e.what());
+    }
+
+    // Free the images before other runs are allowed to use the memory
+    store.reset();
+    release_memory_(memory);
+}
+
+void RunScheduler::acquire_memory_(size_t bytes)
+{
+    unique_lock< mutex> lock(memory_mtx_);
+    // Run that does not fit into the budget on its own is processed alone
+    memory_freed_.wait(lock, [&]() {
+        return memory_used_ == 0 || memory_used_ + bytes <= memory_budget_;
+    });
+    memory_used_ += bytes;
+}
+
+void RunScheduler::release_memory_(size_t bytes)
+{
+    {
+        lock_guard< mutex> lock(memory_mtx_);
+        memory_used_ -= bytes;
+    }
+    memory_freed_.notify_all();
+}
+
+void RunScheduler::print_error_(const string & run, const string & msg)
+{
+    lock_guard< mutex> lock(output_mtx_);
+    if (concurrent_runs_ > 1 && !run.empty())
+        cout << "\nError in \"" << run << "\" (skipping run):\n" << msg << endl;
+    else
+        cout << "\nError (skipping run):\n" << msg << endl;
+}
@@ -0,0 +1,65 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef RUN_SCHEDULER_H
+#define RUN_SCHEDULER_H
+
+#include "FolderCrawler.h"
+#include "FolderWatcher.h"
+#include "ImageProcessor.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+
+// RunScheduler processes runs (folders) found by FolderCrawler. Several runs can be
+// processed at once, each by its own clone of the ImageProcessor, so that precomputed data
+// of one run do not interfere with another one.
+//
+// All runs share one budget of worker threads and one memory budget. A run is started only
+// if its estimated memory fits into what is left of the budget (or if no other run is being
+// processed). While runs are being filtered, the crawler lists the next folder.
+class RunScheduler
+{
+    const ImageProcessor & processor_;
+    unsigned concurrent_runs_;
+    unsigned threads_;
+    // 0 stands for unlimited memory
+    size_t memory_budget_;
+
+    size_t memory_used_;
+    std::mutex memory_mtx_;
+    std::condition_variable memory_freed_;
+
+    // Serializes output of concurrently processed runs
+    std::mutex output_mtx_;
+
+public:
+    RunScheduler(const ImageProcessor & processor, unsigned concurrent_runs,
+        unsigned threads, size_t memory_budget)
+        : processor_(processor), concurrent_runs_((concurrent_runs == 0) ? 1 : concurrent_runs),
+        threads_((threads == 0) ? 1 : threads), memory_budget_(memory_budget), memory_used_(0)
+    {
+        // Every run gets at least one of the threads, more runs would exceed them
+        if (concurrent_runs_ > threads_)
+            concurrent_runs_ = threads_;
+    }
+
+    void process(FolderCrawler & crawler);
+
+    // Watch mode: filters new images found by watcher as soon as they arrive, every folder is
+    // an OnlineRun. Returns once no image arrived for idle_timeout seconds, with 0 it runs
+    // until the process is interrupted.
+    void watch(FolderWatcher & watcher, unsigned idle_timeout);
+
+private:
+    void process_run_(std::unique_ptr< IImageStore> store, unsigned run_threads);
+    void acquire_memory_(size_t bytes);
+    void release_memory_(size_t bytes);
+    void print_error_(const std::string & run, const std::string & msg);
+};
+
+#endif // RUN_SCHEDULER_H
@@ -0,0 +1,221 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "RunStats.h"
+#include "HranolException.h"
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    string json_string(const string & s)
+    {
+        string ret = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                ret += '\\';
+
+            if ((unsigned char) c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned) c);
+                ret += buf;
+            }
+            else
+                ret += c;
+        }
+        return ret + "\"";
+    }
+
+    // Bytes in human readable form, e.g. "1.25 GB"
+    string bytes_str(unsigned long long bytes)
+    {
+        const char * units[] = { "B", "KB", "MB", "GB", "TB" };
+        double val = (double) bytes;
+        int u = 0;
+        while (val >= 1024 && u < 4)
+        {
+            val /= 1024;
+            ++u;
+        }
+
+        ostringstream ret;
+        ret << fixed << setprecision(u == 0 ? 0 : 2) << val << " " << units[u];
+        return ret.str();
+    }
+}
+
+size_t (*RunStats::alloc_counter_)() = nullptr;
+
+RunStats::RunStats()
+    : bytes_read_(0), bytes_written_(0), frames_allocated_(0), frames_reused_(0), allocs_start_(0),
+    allocs_stop_(0), allocs_first_frame_(0), allocs_last_frame_(0), start_(Clock::now()), wall_ns_(0)
+{
+    // Order of CoreStage
+    for (auto name : { "crawl", "read", "decode", "encode", "write" })
+        stages_.emplace_back(name);
+}
+
+size_t RunStats::add_stage(string name)
+{
+    stages_.emplace_back(std::move(name));
+    return stages_.size() - 1;
+}
+
+void RunStats::add_latency(Clock::duration latency)
+{
+    float ms = chrono::duration< float, milli>(latency).count();
+    size_t allocs = allocs_();
+    lock_guard< mutex> lock(latencies_mtx_);
+    if (latencies_ms_.empty())
+        allocs_first_frame_ = allocs;
+    allocs_last_frame_ = allocs;
+    latencies_ms_.push_back(ms);
+}
+
+void RunStats::reserve_frames(size_t frames)
+{
+    lock_guard< mutex> lock(latencies_mtx_);
+    latencies_ms_.reserve(latencies_ms_.size() + frames);
+}
+
+void RunStats::start()
+{
+    start_ = Clock::now();
+    allocs_start_ = allocs_();
+}
+
+void RunStats::stop()
+{
+    wall_ns_ = chrono::duration_cast< chrono::nanoseconds>(Clock::now() - start_).count();
+    allocs_stop_ = allocs_();
+}
+
+double RunStats::steady_allocs_per_frame_(size_t frames) const
+{
+    // The first frame warms up buffers and pools
+    if (frames < 2)
+        return 0;
+    return (double) (allocs_last_frame_ - allocs_first_frame_) / (frames - 1);
+}
+
+void RunStats::write_json(const fs::path & path, const fs::path & origin, const fs::path & dest,
+    size_t images) const
+{
+    vector< float> latencies;
+    {
+        lock_guard< mutex> lock(latencies_mtx_);
+        latencies = latencies_ms_;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    ofstream out(path, ofstream::out | ofstream::trunc);
+    out << fixed << setprecision(6);
+    out << "{\n";
+    out << "  \"origin\": " << json_string(origin.string()) << ",\n";
+    out << "  \"dest\": " << json_string(dest.string()) << ",\n";
+    out << "  \"images\": " << images << ",\n";
+    out << "  \"wall_seconds\": " << wall_ns_ / 1e9 << ",\n";
+    out << "  \"stages\": [\n";
+    for (size_t s = 0; s < stages_.size(); ++s)
+    {
+        out << "    { \"name\": " << json_string(stages_[s].name) << ", \"seconds\": " << stages_[s].ns / 1e9
+            << ", \"count\": " << stages_[s].count << " }" << ((s + 1 < stages_.size()) ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+    out << "  \"bytes_read\": " << bytes_read_ << ",\n";
+    out << "  \"bytes_written\": " << bytes_written_ << ",\n";
+    out << "  \"peak_rss_bytes\": " << peak_rss() << ",\n";
+    out << "  \"frame_buffers\": { \"allocated\": " << frames_allocated_ << ", \"reused\": " << frames_reused_ << " },\n";
+    if (alloc_counter_)
+        out << "  \"heap_allocations\": { \"total\": " << allocs_stop_ - allocs_start_
+            << ", \"per_frame_steady\": " << steady_allocs_per_frame_(latencies.size()) << " },\n";
+    out << "  \"frame_latency_ms\": { \"count\": " << latencies.size()
+        << ", \"p50\": " << percentile_(latencies, 0.5)
+        << ", \"p99\": " << percentile_(latencies, 0.99)
+        << ", \"max\": " << percentile_(latencies, 1.0) << " }\n";
+    out << "}\n";
+
+    out.close();
+    if (!out)
+        throw HranolRuntimeException("Writing statistics \"" + path.string() + "\" failed.");
+}
+
+string RunStats::summary() const
+{
+    vector< float> latencies;
+    {
+        lock_guard< mutex> lock(latencies_mtx_);
+        latencies = latencies_ms_;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    ostringstream ret;
+    ret << fixed << setprecision(2);
+    ret << "\tWall time " << wall_ns_ / 1e9 << " s, stages (summed over threads):\n";
+    for (auto&& st : stages_)
+    {
+        // Stages the run did not go through are left out
+        if (st.count == 0)
+            continue;
+        ret << "\t  " << left << setw(50) << st.name << right << setw(10) << st.ns / 1e9 << " s\n";
+    }
+    ret << "\tRead " << bytes_str(bytes_read_) << ", written " << bytes_str(bytes_written_)
+        << ", peak RSS " << bytes_str(peak_rss()) << "\n";
+    ret << "\tFrame buffers allocated " << frames_allocated_ << ", reused " << frames_reused_ << "\n";
+    if (alloc_counter_)
+        ret << "\tHeap allocations " << allocs_stop_ - allocs_start_ << ", per frame in steady state "
+            << steady_allocs_per_frame_(latencies.size()) << "\n";
+    ret << "\tFrame latency p50 " << percentile_(latencies, 0.5) << " ms, p99 "
+        << percentile_(latencies, 0.99) << " ms\n";
+    return ret.str();
+}
+
+double RunStats::percentile_(const vector< float> & sorted, double p) const
+{
+    if (sorted.empty())
+        return 0;
+
+    // Nearest rank
+    size_t rank = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return sorted[min(rank, sorted.size() - 1)];
+}
+
+unsigned long long RunStats::peak_rss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return (unsigned long long) counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    // Bytes on macOS
+    return (unsigned long long) usage.ru_maxrss;
+#else
+    // Kilobytes on Linux
+    return (unsigned long long) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
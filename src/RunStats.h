@@ -0,0 +1,141 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// RunStats collects statistics of a single run: time spent in every stage (summed over
+// all threads), bytes read and written, frame buffers allocated, heap allocations, latency of
+// every filtered frame and wall time.
+// Stages are registered before the processing starts, counters can then be updated from
+// multiple threads at once.
+class RunStats
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Stages of every run, filters register their own stages with add_stage. Where
+    // OpenCV reads and decodes (or encodes and writes) a file in a single call, the time
+    // goes to DECODE (or ENCODE).
+    enum CoreStage { CRAWL, READ, DECODE, ENCODE, WRITE, CORE_STAGES };
+
+private:
+    struct Stage
+    {
+        std::string name;
+        std::atomic< long long> ns;
+        std::atomic< size_t> count;
+
+        explicit Stage(std::string stage_name) : name(std::move(stage_name)), ns(0), count(0) {}
+    };
+
+    // std::deque does not move its elements, which atomics require
+    std::deque< Stage> stages_;
+    std::atomic< unsigned long long> bytes_read_;
+    std::atomic< unsigned long long> bytes_written_;
+    std::atomic< size_t> frames_allocated_;
+    std::atomic< size_t> frames_reused_;
+
+    std::vector< float> latencies_ms_;
+    mutable std::mutex latencies_mtx_;
+
+    // Heap allocations of the process counted when the run started and stopped, and when its
+    // first and last frame were finished. Frames in between show the steady state.
+    size_t allocs_start_;
+    size_t allocs_stop_;
+    size_t allocs_first_frame_;
+    size_t allocs_last_frame_;
+
+    // Counter of heap allocations, null if the program does not count them
+    static size_t (*alloc_counter_)();
+
+    Clock::time_point start_;
+    long long wall_ns_;
+
+public:
+    RunStats();
+
+    // Registers a stage and returns its index, must not be called while the run is processed
+    size_t add_stage(std::string name);
+
+    void add_time(size_t stage, Clock::duration time)
+    {
+        stages_[stage].ns += std::chrono::duration_cast< std::chrono::nanoseconds>(time).count();
+        ++stages_[stage].count;
+    }
+
+    // Adds time elapsed since start
+    void add_time(size_t stage, Clock::time_point start) {
+        add_time(stage, Clock::now() - start);
+    }
+
+    void add_read(unsigned long long bytes) {
+        bytes_read_ += bytes;
+    }
+
+    void add_written(unsigned long long bytes) {
+        bytes_written_ += bytes;
+    }
+
+    // Image was decoded or copied into a newly allocated buffer (allocated) or into a buffer
+    // that already existed (e.g. recycled by FramePool)
+    void add_frame_buffer(bool allocated)
+    {
+        if (allocated)
+            ++frames_allocated_;
+        else
+            ++frames_reused_;
+    }
+
+    // Time from loading of a frame to its save
+    void add_latency(Clock::duration latency);
+
+    // Hint: number of frames the run will filter, so that recording their latencies does not
+    // allocate
+    void reserve_frames(size_t frames);
+
+    // Wall time of the run is measured between start and stop
+    void start();
+    void stop();
+
+    // Heap allocations are reported only if the program provides a counter (see AllocCounter.h).
+    // The counter covers the whole process, runs filtered at the same time count each other's
+    // allocations.
+    static void set_alloc_counter(size_t (*counter)()) {
+        alloc_counter_ = counter;
+    }
+
+    // Writes the statistics as JSON
+    void write_json(const std::filesystem::path & path, const std::filesystem::path & origin,
+        const std::filesystem::path & dest, size_t images) const;
+
+    // Lines for the console, each starts with a tab
+    std::string summary() const;
+
+    // Peak resident memory of the whole process in bytes, 0 if unknown
+    static unsigned long long peak_rss();
+
+private:
+    static size_t allocs_() {
+        return alloc_counter_ ? alloc_counter_() : 0;
+    }
+
+    // Heap allocations per frame between the first and the last finished frame
+    double steady_allocs_per_frame_(size_t frames) const;
+
+    // Latency percentile in milliseconds (p in [0, 1]), 0 if there are no latencies
+    double percentile_(const std::vector< float> & sorted, double p) const;
+};
+
+#endif // RUN_STATS_H
@@ -0,0 +1,70 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Slab.h"
+#include "HranolException.h"
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+#endif
+
+#include <string>
+
+using namespace std;
+
+#ifdef _WIN32
+
+Slab::Slab(size_t size, bool /* huge_pages */)
+    : data_(nullptr), size_(size)
+{
+    if (size_ == 0)
+        return;
+
+    // Large pages need a privilege on Windows, regular pages are used
+    data_ = (unsigned char *) VirtualAlloc(nullptr, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (data_ == nullptr)
+        throw HranolRuntimeException("Allocating " + to_string(size_) + " bytes failed: error code " + to_string(GetLastError()));
+}
+
+Slab::~Slab()
+{
+    if (data_ != nullptr)
+        VirtualFree(data_, 0, MEM_RELEASE);
+}
+
+#else
+
+Slab::Slab(size_t size, bool huge_pages)
+    : data_(nullptr), size_(size)
+{
+    if (size_ == 0)
+        return;
+
+    // The whole slab is accounted as committed memory (no MAP_NORESERVE), so a slab that can't
+    // be backed fails here with an exception instead of a crash when its pages are touched
+    void * addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        throw HranolRuntimeException("Allocating " + to_string(size_) + " bytes failed.");
+    data_ = (unsigned char *) addr;
+
+#ifdef MADV_HUGEPAGE
+    // Only an advice, the slab works with regular pages as well
+    if (huge_pages)
+        madvise(data_, size_, MADV_HUGEPAGE);
+#else
+    (void) huge_pages;
+#endif
+}
+
+Slab::~Slab()
+{
+    if (data_ != nullptr)
+        munmap(data_, size_);
+}
+
+#endif // _WIN32
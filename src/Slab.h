@@ -0,0 +1,37 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+
+
+// Slab is a single page-aligned block of anonymous memory, e.g. for all decoded images of a run.
+// The system commits the pages as they are touched for the first time. With huge_pages the block
+// is backed by transparent huge pages where the system supports them (Linux), so sweeping over
+// a big slab causes less TLB misses. Works on POSIX systems and Windows.
+class Slab
+{
+    unsigned char * data_;
+    size_t size_;
+
+public:
+    Slab(size_t size, bool huge_pages = false);
+    ~Slab();
+
+    Slab(const Slab &) = delete;
+    Slab & operator=(const Slab &) = delete;
+
+    unsigned char * data() {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+};
+
+#endif // SLAB_H
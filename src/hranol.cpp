@@ -4,29 +4,110 @@
 // 
 
 #include "../thirdparty/args/args.hxx"
-#include "Filter.h"
+#include "AllocCounter.h"
+#include "FilterChain.h"
 #include "FolderCrawler.h"
 #include "ImageProcessor.h"
+#include "FolderWatcher.h"
 #include "ImageStore.h"
+#include "Parallel.h"
+#include "RunScheduler.h"
 
+#include "opencv2/core/utility.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <stdexcept>
+#include <limits>
 #include <memory>
 
 
+// Parses size in bytes with optional suffix K, M or G (powers of 1024), e.g. "512M"
+size_t parse_size(const std::string & s)
+{
+    // std::stoull would accept leading whitespace and a minus sign (negating the value)
+    if (s.empty() || !std::isdigit((unsigned char) s[0]))
+        throw HranolRuntimeException("Invalid size: \"" + s + "\"");
+
+    size_t pos = 0;
+    unsigned long long val = 0;
+    try {
+        val = std::stoull(s, &pos);
+    }
+    catch (const std::exception &) {
+        throw HranolRuntimeException("Invalid size: \"" + s + "\"");
+    }
+
+    int shift = 0;
+    std::string suffix = s.substr(pos);
+    if (suffix == "K" || suffix == "k")
+        shift = 10;
+    else if (suffix == "M" || suffix == "m")
+        shift = 20;
+    else if (suffix == "G" || suffix == "g")
+        shift = 30;
+    else if (!suffix.empty())
+        throw HranolRuntimeException("Invalid size suffix: \"" + s + "\"");
+
+    if (val > (std::numeric_limits< size_t>::max() >> shift))
+        throw HranolRuntimeException("Size is too big: \"" + s + "\"");
+
+    return (size_t) val << shift;
+}
+
+// Parses rectangle "x,y,w,h" in pixels, e.g. "120,80,640,480"
+cv::Rect parse_rect(const std::string & s)
+{
+    int x, y, w, h;
+    char tail;
+    if (std::sscanf(s.c_str(), "%d,%d,%d,%d%c", &x, &y, &w, &h, &tail) != 4 || x < 0 || y < 0 || w <= 0 || h <= 0)
+        throw HranolRuntimeException("Invalid region of interest: \"" + s + "\"");
+
+    return cv::Rect(x, y, w, h);
+}
+
 class Hranol
 {
     std::vector< std::string> folders_;
     bool recursive_;
     bool ram_friendly_;
+    // Decoded images are spilled to a scratch file in ram friendly mode
+    bool spill_;
+    // Encoded images are kept in memory in ram friendly mode
+    bool keep_encoded_;
+    // Decoded images kept in memory are backed by transparent huge pages
+    bool huge_pages_;
     std::string fname_regex_;
     std::string output_folder_;
     // Prefix of filtered folders
     std::string folder_prefix_;
     // Indicates whether folders starting with folder_prefix_ should be included
     bool incl_folder_prefix_; 
+    // Number of worker threads
+    unsigned threads_;
+    // Depth of queues between pipeline stages, 0 if pipeline is not used
+    size_t queue_depth_;
+    // Number of folders processed concurrently
+    unsigned concurrent_runs_;
+    // Memory budget in bytes shared by concurrently processed folders, 0 if unlimited
+    size_t memory_budget_;
+    // Significant bits of input pixels, images with more than 8 bits are processed in 16 bits
+    int bit_depth_;
+    // Each matched file is a stack of frames (multi-page TIFF or raw stack)
+    bool stacks_;
+    OutputFormat output_format_;
+    Compression compression_;
+    // Interrupted runs are continued
+    bool resume_;
+    // New images are filtered as they arrive
+    bool watch_;
+    // Watch stops after this many seconds without a new image, 0 if it never stops
+    unsigned watch_timeout_;
 
     ImageProcessor img_processor_;
 
@@ -35,13 +116,30 @@ public:
     Hranol() : 
         recursive_(false),
         ram_friendly_(false),
+        spill_(false),
+        keep_encoded_(false),
+        huge_pages_(false),
         fname_regex_(".*\\.(jpe?g|gif|tif|tiff|png|bmp)"),
         output_folder_(""),
         folder_prefix_("fltrd"),
-        incl_folder_prefix_(false) { }
+        incl_folder_prefix_(false),
+        threads_(1),
+        queue_depth_(0),
+        concurrent_runs_(1),
+        memory_budget_(0),
+        bit_depth_(8),
+        stacks_(false),
+        output_format_(OutputFormat::FILES),
+        compression_(Compression::DEFAULT),
+        resume_(false),
+        watch_(false),
+        watch_timeout_(0) { }
 
     void parse_from_cli(int argc, char **argv);
     void process();
+
+private:
+    StoreMode store_mode_() const;
 };
 
 void Hranol::parse_from_cli(int argc, char **argv) 
@@ -57,12 +155,40 @@ void Hranol::parse_from_cli(int argc, char **argv)
     args::ValueFlag<std::string> mask_file(parser, "file",
         "Apply mask to every image. The mask size must match the sizes of all images.",
         { 'm', "mask" });
+    args::Flag crop(parser, "crop",
+        "Crop images to the bounding box of the mask. Only the box is filtered and saved, its offset "
+        "in the original images is written to fltrd_info.txt.",
+        { "crop" });
+    args::ValueFlag<std::string> roi(parser, "x,y,w,h",
+        "Crop images to the region of width w and height h at offset (x, y). Only the region is "
+        "filtered and saved, the mask (if any) is cropped to it as well.",
+        { "roi" });
     args::ValueFlag<double> subtraction_factor(parser, "subtraction factor",
         "Static background subtraction factor. Computes an average of all images (from single folder) and "
         "subtracts this average from each image with given factor. You may use positive floating point "
         "values for the factor.",
         { 's', "static-noise" });
-    args::Group rescale(parser, "Rescaling range [b, e] for contrast filter. Pixel values in range [b, e] will be mapped to [0, 255]:");
+    args::ValueFlag<size_t> window(parser, "radius",
+        "Used with -s. Instead of the average of all images, subtracts the average of the sliding window "
+        "of given number of images before and after each image. Follows slow changes of the background "
+        "and needs only a single pass over images (which are processed in order of their names).",
+        { 'w', "window" });
+    args::Flag median(parser, "median",
+        "Used with -s. Subtracts the median of all images instead of the average. Unlike the average, "
+        "the median is not affected by objects passing through the scene. Takes 2 passes over images "
+        "(4 for 16-bit images) to precompute.",
+        { "median" });
+    args::ValueFlag<std::string> save_background(parser, "file",
+        "Used with -s. Saves the background (sum and number of precomputed images) to given file, so that "
+        "it can be used later with --background-from. If a directory is given, the file is named after the "
+        "output folder, use it when several folders are processed.",
+        { "save-background" });
+    args::ValueFlag<std::string> background_from(parser, "file",
+        "Used with -s. Subtracts background loaded from given file (see --save-background) instead of the "
+        "average of the processed images, so no precomputation is needed. Any subtraction factor can be used.",
+        { "background-from" });
+    args::Group rescale(parser, "Rescaling range [b, e] for contrast filter. Pixel values in range [b, e] will be mapped to [0, 255] "
+        "(to [0, 2^N - 1] with --bit-depth N):");
     args::ValueFlag<int> rescale_beg(rescale, "range begin",
         "",
         { 'b', "rescale-begin" });
@@ -92,6 +218,86 @@ void Hranol::parse_from_cli(int argc, char **argv)
         "By default all images from a single folder are stored in memory when the folder is being processed. If that is not possible "
         "due to small RAM space, use this flag.",
         { "ram-friendly" });
+    args::Flag spill(parser, "spill",
+        "Used with --ram-friendly. Decoded images are written to a scratch file in the system temporary "
+        "directory (TMPDIR) during precomputation, so filtering reads them back instead of decoding "
+        "them again. The scratch file takes as much disk space as the decoded images of a folder.",
+        { "spill" });
+    args::Flag keep_encoded(parser, "keep encoded",
+        "Used with --ram-friendly. Files are read to memory only once during precomputation and filtering "
+        "decodes the images from there instead of reading the files again. Takes as much memory as the "
+        "files of a folder (e.g. PNG or TIFF images are several times smaller than decoded ones).",
+        { "keep-encoded" });
+    args::Flag huge_pages(parser, "huge pages",
+        "Back the memory holding all decoded images of a folder (without --ram-friendly) with transparent "
+        "huge pages (Linux only). Speeds up filtering of big folders when the system has huge pages "
+        "set to \"madvise\".",
+        { "huge-pages" });
+    args::ValueFlag<unsigned> threads(parser, "threads",
+        "Number of worker threads used to filter images. Images of a folder are filtered in parallel "
+        "once the precomputation is done. Use 0 for the number of available cores. Default value is 1.",
+        { 'j', "threads" });
+    args::ValueFlag<size_t> queue_depth(parser, "queue depth",
+        "Runs filtering as a pipeline of decode, filter and encode stages connected by queues holding "
+        "at most given number of images, so that disk reads, decoding, filtering and encoding overlap. "
+        "Each stage uses the number of threads given by option -j. After a folder is filtered, "
+        "the busiest stage (bottleneck) is reported.",
+        { 'q', "queue-depth" });
+    args::ValueFlag<unsigned> concurrent_runs(parser, "runs",
+        "Number of folders processed concurrently. Useful with many small folders (e.g. with option -r). "
+        "Threads given by option -j are split among the folders, so at most that many folders are "
+        "processed at once. Default value is 1.",
+        { "runs" });
+    args::ValueFlag<std::string> memory_budget(parser, "bytes",
+        "Memory available for decoded images of concurrently processed folders, e.g. 512M or 8G. "
+        "A folder is not started until its images fit into the budget. Folders too big for their share "
+        "of the budget keep only as many decoded images as fit into it (unless --ram-friendly is used), "
+        "the rest is decoded again when needed.",
+        { "memory-budget" });
+    args::Flag no_fuse(parser, "no fuse",
+        "Apply filters one by one. By default background subtraction, contrast filter and mask are "
+        "applied together in a single pass over each image, which gives identical results faster.",
+        { "no-fuse" });
+    args::Flag stats(parser, "stats",
+        "Print time spent in each stage (listing, decoding, every filter, encoding), bytes read and written "
+        "and peak memory after every folder. The statistics are always saved to \"fltrd_stats.json\" "
+        "in the output folder.",
+        { "stats" });
+    args::ValueFlag<int> bit_depth(parser, "bits",
+        "Number of significant bits of input pixels, 8 to 16. By default images are converted to 8 bits. "
+        "With more bits, 16-bit images (e.g. TIFFs from 10-bit or 12-bit cameras) are filtered and saved "
+        "in 16 bits, so the output format must support them (PNG or TIFF).",
+        { "bit-depth" });
+    args::Flag stacks(parser, "stacks",
+        "Each matched file is a stack of frames processed as a separate run: multi-page TIFF (.tif, .tiff) "
+        "or raw stack (other files, see README). Frames are saved as \"<stack name>_<frame>.tif\" to a subfolder "
+        "named after the stack. Default filename regex is then \".*\\.(tif|tiff|bin)\".",
+        { "stacks" });
+    args::ValueFlag<std::string> output_format(parser, "format",
+        "How filtered images of a folder are written: \"files\" (default) saves every image to its own file "
+        "named after the original image, \"raw\" writes all images to a single raw stack \"frames.bin\" (see README) "
+        "and \"tiff\" to a single multi-page TIFF \"frames.tif\". Stacks avoid encoding and creating thousands "
+        "of small files, all images in a raw stack must have the same size.",
+        { "output-format" });
+    args::ValueFlag<std::string> compression(parser, "compression",
+        "Output compression: \"none\" or \"fast\". For files it sets PNG compression level to 0 or 1, "
+        "TIFF stack is compressed with PackBits when \"fast\" is used. Raw stacks are never compressed. "
+        "By default files use the encoder defaults and stacks are not compressed.",
+        { "compression" });
+    args::Flag resume(parser, "resume",
+        "Continue interrupted runs. Every output folder holds a manifest of filtered images, with this flag "
+        "the existing output folder is reused and only images that are missing or changed since are filtered. "
+        "Precomputed data are reused if no image changed. Stacked output (--output-format) is always written again.",
+        { "resume" });
+    args::Flag watch(parser, "watch",
+        "Watch the folders and filter new images as soon as they are written (Linux only). Images already "
+        "in the folders are filtered first. There is no precomputation pass: option -s subtracts the running "
+        "average of all images so far and with -w the average of the last 2 * radius + 1 images. Runs until "
+        "interrupted, see --watch-timeout.",
+        { "watch" });
+    args::ValueFlag<unsigned> watch_timeout(parser, "seconds",
+        "Used with --watch. Stop watching after no new image arrived for given number of seconds.",
+        { "watch-timeout" });
     args::PositionalList<std::string> folders(parser, "folders", "List of folders to process.");
     args::HelpFlag help(parser, "help", "Display this help menu", { 'h', "help" });
 
@@ -110,7 +316,30 @@ void Hranol::parse_from_cli(int argc, char **argv)
 
     if (ram_friendly)
         ram_friendly_ = true;
+
+    if (spill)
+        spill_ = true;
+
+    if (keep_encoded)
+        keep_encoded_ = true;
+
+    if (huge_pages)
+        huge_pages_ = true;
+
+    if (spill_ && keep_encoded_)
+        throw HranolRuntimeException("Options --spill and --keep-encoded can not be combined.");
+    // Without --ram-friendly all decoded images are kept, the options would have no effect
+    if (keep_encoded_ && !ram_friendly_)
+        throw HranolRuntimeException("Option --keep-encoded can only be used with --ram-friendly.");
+    if (spill_ && !ram_friendly_)
+        throw HranolRuntimeException("Option --spill can only be used with --ram-friendly.");
     
+    if (stacks)
+    {
+        stacks_ = true;
+        fname_regex_ = ".*\\.(tif|tiff|bin)";
+    }
+
     if (fname_regex)
         fname_regex_ = args::get(fname_regex);
 
@@ -123,26 +352,196 @@ void Hranol::parse_from_cli(int argc, char **argv)
     if (incl_folder_prefix)
         incl_folder_prefix_ = true;
 
+    if (resume)
+    {
+        resume_ = true;
+        img_processor_.set_resume(true);
+    }
+
+    if (watch)
+        watch_ = true;
+
+    if (watch_timeout)
+    {
+        if (!watch_)
+            throw HranolRuntimeException("Watch timeout can only be used with --watch.");
+        watch_timeout_ = args::get(watch_timeout);
+    }
+
+    if (no_fuse)
+        img_processor_.set_fusion_enabled(false);
+
+    if (stats)
+        img_processor_.set_print_stats(true);
+
+    if (threads)
+        threads_ = resolve_thread_count(args::get(threads));
+    img_processor_.set_threads(threads_);
+
+    if (queue_depth)
+        queue_depth_ = args::get(queue_depth);
+    img_processor_.set_queue_depth(queue_depth_);
+
+    // Every run needs at least one thread of the -j budget
+    if (concurrent_runs)
+        concurrent_runs_ = std::min(threads_, std::max(1u, args::get(concurrent_runs)));
+
+    if (memory_budget)
+        memory_budget_ = parse_size(args::get(memory_budget));
+    // Images kept within the budget are allocated one by one, not in a single block
+    if (huge_pages_ && memory_budget_ != 0 && !ram_friendly_)
+        throw HranolRuntimeException("Option --huge-pages can not be combined with --memory-budget.");
+
+    if (bit_depth)
+    {
+        bit_depth_ = args::get(bit_depth);
+        if (bit_depth_ < 8 || bit_depth_ > 16)
+            throw HranolRuntimeException("Bit depth must be in range [8, 16]: " + std::to_string(bit_depth_));
+    }
+
+    if (output_format)
+    {
+        std::string format = args::get(output_format);
+        if (format == "files")
+            output_format_ = OutputFormat::FILES;
+        else if (format == "raw")
+            output_format_ = OutputFormat::RAW_STACK;
+        else if (format == "tiff")
+            output_format_ = OutputFormat::TIFF_STACK;
+        else
+            throw HranolRuntimeException("Unknown output format: \"" + format + "\"");
+    }
+
+    if (compression)
+    {
+        std::string comp = args::get(compression);
+        if (comp == "none")
+            compression_ = Compression::NONE;
+        else if (comp == "fast")
+            compression_ = Compression::FAST;
+        else
+            throw HranolRuntimeException("Unknown compression: \"" + comp + "\"");
+    }
+
+    if (output_format_ == OutputFormat::RAW_STACK && compression_ == Compression::FAST)
+        throw HranolRuntimeException("Raw stack output can not be compressed.");
+
+    if (watch_ && (stacks_ || output_format_ != OutputFormat::FILES || resume_ || incl_folder_prefix_))
+        throw HranolRuntimeException("Watch mode can't be combined with --stacks, --output-format, --resume or -i.");
+
+    FilterChainConfig chain;
+    chain.bit_depth = bit_depth_;
+
     if (mask_file)
-        img_processor_.add_filter(std::move(MaskFilter::create(args::get(mask_file))));
+        chain.mask_file = args::get(mask_file);
+
+    if (crop && !mask_file)
+        throw HranolRuntimeException("Option --crop can only be used with a mask (option -m).");
+    if (crop && roi)
+        throw HranolRuntimeException("Options --crop and --roi can not be combined.");
+    if (crop)
+        chain.crop_to_mask = true;
+    if (roi)
+        chain.roi = parse_rect(args::get(roi));
     
+    if (window && !subtraction_factor)
+        throw HranolRuntimeException("Sliding window can only be used with background subtraction (option -s).");
+    if (median && !subtraction_factor)
+        throw HranolRuntimeException("Median can only be used with background subtraction (option -s).");
+    if (median && window)
+        throw HranolRuntimeException("Median and sliding window background subtraction can not be combined.");
+    if (median && watch_)
+        throw HranolRuntimeException("Median can not be computed in watch mode.");
+    if (window && args::get(window) == 0)
+        throw HranolRuntimeException("Background subtraction window radius must be positive.");
+
+    if ((save_background || background_from) && (!subtraction_factor || window || median))
+        throw HranolRuntimeException("Background file can only be used with static background subtraction (option -s without -w or --median).");
+    if (save_background && background_from)
+        throw HranolRuntimeException("Loaded background can not be saved again.");
+    if (save_background && watch_)
+        throw HranolRuntimeException("Background can not be saved in watch mode.");
+
+    // Concurrent runs would write the same file, each needs its own file in a directory
+    if (save_background && concurrent_runs_ > 1 && !std::filesystem::is_directory(args::get(save_background)))
+        throw HranolRuntimeException("Background of concurrent runs (--runs) can only be saved to a directory.");
+    if (save_background)
+        img_processor_.set_save_background(args::get(save_background));
+
     if (subtraction_factor)
-        img_processor_.add_filter(std::move(BckgSubFilter::create(args::get(subtraction_factor))));
+    {
+        chain.subtract = true;
+        chain.subtraction_factor = args::get(subtraction_factor);
+        if (background_from)
+            chain.background_file = args::get(background_from);
+        if (window)
+            chain.window_radius = args::get(window);
+        if (median)
+            chain.median = true;
+        // Watch mode has no precomputation pass
+        chain.running = watch_ && !window && !background_from;
+    }
 
     if (rescale_beg || rescale_end)
     {
         if (rescale_beg && rescale_end)
-            img_processor_.add_filter(std::move(ContrastFilter::create(
-                args::get(rescale_beg),
-                args::get(rescale_end)
-            )));
+        {
+            chain.rescale = true;
+            chain.rescale_begin = args::get(rescale_beg);
+            chain.rescale_end = args::get(rescale_end);
+        }
         else
             throw HranolRuntimeException("Both range begin and end must be specified for rescale filter.");
     }
+
+    chain.add_filters(img_processor_);
+}
+
+StoreMode Hranol::store_mode_() const
+{
+    // Windowed filter streams images in a single pass, keeping them all in memory is pointless
+    if (img_processor_.is_windowed())
+        return StoreMode::ON_DEMAND;
+
+    // With memory budget, folders that do not fit keep as many decoded images as the budget allows
+    if (!ram_friendly_)
+        return (memory_budget_ != 0) ? StoreMode::BUDGET : StoreMode::RAM;
+
+    // Spilling and keeping encoded images pay off only if images are loaded twice
+    if (spill_ && img_processor_.needs_precomputation())
+        return StoreMode::SPILL;
+
+    if (keep_encoded_ && img_processor_.needs_precomputation())
+        return StoreMode::ENCODED;
+
+    return StoreMode::ON_DEMAND;
 }
 
 void Hranol::process()
 {
+    // Worker threads already keep the cores busy, OpenCV's own parallelization
+    // inside of single filter would only oversubscribe them
+    if (threads_ > 1)
+        cv::setNumThreads(1);
+
+    if (watch_)
+    {
+        FolderWatcher watcher(
+            folders_,
+            output_folder_,
+            folder_prefix_,
+            fname_regex_,
+            recursive_,
+            bit_depth_ > 8,
+            compression_
+        );
+        watcher.set_roi(img_processor_.get_roi());
+
+        RunScheduler scheduler(img_processor_, 1, threads_, 0);
+        scheduler.watch(watcher, watch_timeout_);
+        return;
+    }
+
     FolderCrawler crawler(
         folders_,
         output_folder_,
@@ -150,23 +549,29 @@ void Hranol::process()
         fname_regex_,
         incl_folder_prefix_,
         recursive_,
-        ram_friendly_
+        store_mode_(),
+        bit_depth_ > 8,
+        stacks_,
+        output_format_,
+        compression_,
+        resume_,
+        threads_
     );
+    // Concurrently processed folders share the budget
+    crawler.set_memory_budget(memory_budget_ / concurrent_runs_);
+    crawler.set_huge_pages(huge_pages_);
+    crawler.set_roi(img_processor_.get_roi());
+    if (resume_)
+        crawler.set_resume_config(img_processor_.manifest_config(bit_depth_ > 8));
 
-    while (crawler.has_next_run())
-    {
-        try {
-            auto store = crawler.get_next_run();
-            img_processor_.apply_filters(store.get());
-        }
-        catch (const std::exception &e) {
-            std::cout << "\nError (skipping run):\n" << e.what() << std::endl;
-        }
-    } 
+    RunScheduler scheduler(img_processor_, concurrent_runs_, threads_, memory_budget_);
+    scheduler.process(crawler);
 }
 
 int main(int argc, char **argv)
 {
+    // Heap allocations are reported with --stats
+    RunStats::set_alloc_counter(heap_allocations);
 
     Hranol hranol;
     try {
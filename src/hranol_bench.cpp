@@ -0,0 +1,414 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+// hranol_bench -- benchmarks of filters, image stores and codecs. Runs on synthetic frames of
+// several resolutions and on the example datasets. Every result is printed to the standard
+// output as a single line of JSON, so that results of different commits can be compared.
+
+#include "../thirdparty/args/args.hxx"
+#include "AllocCounter.h"
+#include "Filter.h"
+#include "FolderCrawler.h"
+#include "FusedKernel.h"
+#include "ImageStore.h"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+namespace
+{
+    // Geometry of synthetic frames
+    struct Geometry
+    {
+        int cols, rows, depth;
+
+        string desc() const {
+            return "synthetic " + to_string(cols) + "x" + to_string(rows) + ((depth == CV_8U) ? " 8-bit" : " 16-bit");
+        }
+
+        int max_value() const {
+            return (depth == CV_8U) ? 255 : 4095;
+        }
+    };
+
+    // Measured time, frames and bytes of a single benchmark
+    class Measurement
+    {
+        Clock::duration time_;
+        size_t frames_;
+        size_t bytes_;
+        size_t allocs_;
+
+    public:
+        Measurement() : time_(0), frames_(0), bytes_(0), allocs_(0) {}
+
+        // Times body processing a single frame, body returns the size of the frame in bytes
+        template< typename Body>
+        void frame(Body body)
+        {
+            size_t allocs = heap_allocations();
+            auto start = Clock::now();
+            size_t bytes = body();
+            time_ += Clock::now() - start;
+            allocs_ += heap_allocations() - allocs;
+            ++frames_;
+            bytes_ += bytes;
+        }
+
+        // Prints the result as a single line of JSON, extra holds additional fields
+        void print(const string & bench, const string & input, const string & extra = "") const
+        {
+            double seconds = chrono::duration< double>(time_).count();
+            ostringstream out;
+            out << fixed << setprecision(3)
+                << "{\"bench\": \"" << bench << "\", \"input\": \"" << input << "\", \"frames\": " << frames_
+                << ", \"seconds\": " << seconds
+                << ", \"frames_per_s\": " << ((seconds > 0) ? frames_ / seconds : 0.0)
+                << ", \"mb_per_s\": " << ((seconds > 0) ? bytes_ / seconds / (1 << 20) : 0.0)
+                << ", \"allocs_per_frame\": " << ((frames_ > 0) ? (double) allocs_ / frames_ : 0.0)
+                << extra << "}";
+            cout << out.str() << endl;
+        }
+    };
+
+    // Frame with smooth background, noise and a few bright particles. Frames with different
+    // seeds differ in noise and particle positions.
+    cv::Mat synthetic_frame(const Geometry & g, unsigned seed)
+    {
+        cv::Mat ret(g.rows, g.cols, CV_MAKETYPE(g.depth, 1));
+        unsigned state = seed * 2654435761u + 1;
+        auto rnd = [&state]() {
+            state = state * 1664525u + 1013904223u;
+            return state >> 24;
+        };
+
+        int scale = g.max_value() / 255;
+        for (int r = 0; r < g.rows; ++r)
+            for (int c = 0; c < g.cols; ++c)
+            {
+                int v = (40 + 60 * c / g.cols + 40 * r / g.rows + (int) (rnd() & 15)) * scale;
+                if (g.depth == CV_8U)
+                    ret.ptr(r)[c] = (uchar) v;
+                else
+                    ret.ptr< ushort>(r)[c] = (ushort) v;
+            }
+
+        for (int p = 0; p < 20; ++p)
+        {
+            int pr = (int) (rnd() * (unsigned) g.rows / 256), pc = (int) (rnd() * (unsigned) g.cols / 256);
+            for (int r = max(0, pr - 3); r < min(g.rows, pr + 4); ++r)
+                for (int c = max(0, pc - 3); c < min(g.cols, pc + 4); ++c)
+                {
+                    if (g.depth == CV_8U)
+                        ret.ptr(r)[c] = 250;
+                    else
+                        ret.ptr< ushort>(r)[c] = (ushort) (250 * scale);
+                }
+        }
+        return ret;
+    }
+
+    // Mask keeping an ellipse in the middle of the frame, like the mask of examples/monitor
+    cv::Mat synthetic_mask(const Geometry & g)
+    {
+        cv::Mat ret(g.rows, g.cols, CV_8UC1);
+        double a = g.cols / 2.0, b = g.rows / 2.0;
+        for (int r = 0; r < g.rows; ++r)
+            for (int c = 0; c < g.cols; ++c)
+            {
+                double x = (c - a) / a, y = (r - b) / b;
+                ret.ptr(r)[c] = (x * x + y * y <= 0.8) ? 255 : 0;
+            }
+        return ret;
+    }
+
+    size_t frame_bytes(const cv::Mat & img)
+    {
+        return img.total() * img.elemSize();
+    }
+
+    class Bench
+    {
+        size_t frames_;
+        // Only benchmarks whose name contains filter_ are run
+        string filter_;
+        fs::path tmp_;
+
+        // Source frames, filters are applied to copies, so that every frame is filtered the same
+        vector< cv::Mat> sources_;
+
+    public:
+        Bench(size_t frames, string filter, fs::path tmp)
+            : frames_(frames), filter_(std::move(filter)), tmp_(std::move(tmp))
+        {}
+
+        void synthetic(const Geometry & g)
+        {
+            sources_.clear();
+            for (unsigned s = 0; s < 8; ++s)
+                sources_.push_back(synthetic_frame(g, s));
+
+            fs::path mask_path = tmp_ / "mask.png";
+            cv::imwrite(mask_path.string(), synthetic_mask(g));
+
+            MaskFilter mask(mask_path.string());
+            ContrastFilter contrast(10 * g.max_value() / 255, 200 * g.max_value() / 255, g.max_value());
+
+            if (enabled_("filter.mask"))
+                apply_("filter.mask", g.desc(), [&](cv::Mat & img) { mask.apply_to(img); });
+            if (enabled_("filter.contrast"))
+                apply_("filter.contrast", g.desc(), [&](cv::Mat & img) { contrast.apply_to(img); });
+
+            auto bckg = BckgSubFilter::create(1.0);
+            if (enabled_("filter.bckg_sub"))
+            {
+                Measurement m;
+                bckg->reserve(frames_);
+                for (size_t i = 0; i < frames_; ++i)
+                {
+                    const cv::Mat & src = sources_[i % sources_.size()];
+                    m.frame([&]() {
+                        bckg->precomp_from(src);
+                        if (i + 1 == frames_)
+                            bckg->finish_precomp();
+                        return frame_bytes(src);
+                    });
+                }
+                m.print("filter.bckg_sub.precomp", g.desc());
+                apply_("filter.bckg_sub.apply", g.desc(), [&](cv::Mat & img) { bckg->apply_to(img); });
+            }
+
+            // The standard chain in a single pass, fused kernel handles 8-bit images only
+            if (enabled_("filter.fused") && g.depth == CV_8U)
+            {
+                PrecompFiltersVec precomp;
+                precomp.push_back(BckgSubFilter::create(1.0));
+                for (auto&& src : sources_)
+                    precomp.back()->precomp_from(src);
+                precomp.back()->finish_precomp();
+
+                PureFiltersVec pure;
+                pure.push_back(contrast.clone());
+                pure.push_back(mask.clone());
+
+                auto fused = FusedKernel::create(precomp, pure);
+                if (fused)
+                    apply_("filter.fused", g.desc(), [&](cv::Mat & img) { fused->apply_to(img); });
+            }
+
+            if (enabled_("codec"))
+                for (auto ext : { ".png", ".tif", ".bmp", ".jpg" })
+                    codec_(ext, g);
+
+            if (enabled_("store"))
+            {
+                // Frames are saved as BMP, so that the stores are compared rather than decoders
+                fs::path folder = tmp_ / ("store_" + to_string(g.cols) + "x" + to_string(g.rows));
+                fs::create_directories(folder);
+                vector< fs::path> paths;
+                for (size_t i = 0; i < frames_; ++i)
+                {
+                    paths.push_back(folder / ("frame" + to_string(i) + ((g.depth == CV_8U) ? ".bmp" : ".png")));
+                    cv::imwrite(paths.back().string(), sources_[i % sources_.size()]);
+                }
+                stores_(folder, paths, g.desc(), g.depth != CV_8U);
+                fs::remove_all(folder);
+            }
+        }
+
+        // Benchmarks stores on images of every folder in examples
+        void examples(const fs::path & examples)
+        {
+            if (!enabled_("store"))
+                return;
+
+            FnameMatcher matcher(".*\\.(jpe?g|gif|tif|tiff|png|bmp)");
+            vector< fs::path> folders;
+            for (auto&& f : fs::directory_iterator(examples))
+                if (f.is_directory())
+                    folders.push_back(f.path());
+            sort(folders.begin(), folders.end());
+
+            for (auto&& folder : folders)
+            {
+                vector< fs::path> paths;
+                for (auto&& f : fs::directory_iterator(folder))
+                {
+                    // Masks are not frames
+                    string fname = f.path().filename().string();
+                    if (f.is_regular_file() && matcher.match(fname) && fname.find("mask") == string::npos)
+                        paths.push_back(f.path());
+                }
+                sort(paths.begin(), paths.end());
+                if (!paths.empty())
+                    stores_(folder, paths, "examples/" + folder.filename().string(), false);
+            }
+        }
+
+    private:
+        bool enabled_(const string & bench) const {
+            return filter_.empty() || bench.find(filter_) != string::npos || filter_.find(bench) != string::npos;
+        }
+
+        template< typename Apply>
+        void apply_(const string & bench, const string & input, Apply apply)
+        {
+            if (!enabled_(bench))
+                return;
+
+            Measurement m;
+            cv::Mat img = sources_[0].clone();
+            for (size_t i = 0; i < frames_; ++i)
+            {
+                // Copying into the existing buffer allocates nothing and is not timed
+                sources_[i % sources_.size()].copyTo(img);
+                m.frame([&]() {
+                    apply(img);
+                    return frame_bytes(img);
+                });
+            }
+            m.print(bench, input);
+        }
+
+        void codec_(const string & ext, const Geometry & g)
+        {
+            // JPEG and BMP can't hold 16-bit images
+            if (g.depth != CV_8U && (ext == ".jpg" || ext == ".bmp"))
+                return;
+
+            vector< fs::path> paths;
+            for (size_t i = 0; i < sources_.size(); ++i)
+                paths.push_back(tmp_ / ("codec" + to_string(i) + ext));
+
+            string codec = ext.substr(1);
+            Measurement write;
+            for (size_t i = 0; i < frames_; ++i)
+            {
+                const cv::Mat & src = sources_[i % sources_.size()];
+                write.frame([&]() {
+                    cv::imwrite(paths[i % paths.size()].string(), src);
+                    return frame_bytes(src);
+                });
+            }
+
+            size_t encoded = 0;
+            for (auto&& p : paths)
+                encoded += (size_t) fs::file_size(p);
+            ostringstream ratio;
+            ratio << fixed << setprecision(3) << ", \"compression_ratio\": "
+                << (double) frame_bytes(sources_[0]) * paths.size() / max< size_t>(1, encoded);
+            write.print("codec." + codec + ".write", g.desc(), ratio.str());
+
+            Measurement read;
+            int flags = (g.depth == CV_8U) ? cv::ImreadModes::IMREAD_GRAYSCALE : cv::ImreadModes::IMREAD_ANYDEPTH;
+            for (size_t i = 0; i < frames_; ++i)
+            {
+                read.frame([&]() {
+                    return frame_bytes(cv::imread(paths[i % paths.size()].string(), flags));
+                });
+            }
+            read.print("codec." + codec + ".read", g.desc(), ratio.str());
+
+            for (auto&& p : paths)
+                fs::remove(p);
+        }
+
+        // Loads every image twice, as the precomputation and the filtering pass do
+        void stores_(const fs::path & folder, const vector< fs::path> & paths, const string & input, bool any_depth)
+        {
+            auto bench_store = [&](const string & bench, IImageStore & store) {
+                if (!enabled_(bench))
+                    return;
+
+                store.set_any_depth(any_depth);
+                Measurement m;
+                for (int pass = 0; pass < 2; ++pass)
+                    for (size_t i = 0; i < store.size(); ++i)
+                        m.frame([&]() {
+                            size_t bytes = frame_bytes(store.load(i));
+                            store.release(i);
+                            return bytes;
+                        });
+                m.print(bench, input);
+            };
+
+            RAMImageStore ram(folder, tmp_, paths);
+            bench_store("store.ram", ram);
+            OnDemandImageStore on_demand(folder, tmp_, paths);
+            bench_store("store.on_demand", on_demand);
+        }
+    };
+}
+
+int main(int argc, char **argv)
+{
+    args::ArgumentParser parser(
+        "hranol_bench -- benchmarks of hranol filters, image stores and codecs. Prints one line of JSON "
+        "per benchmark with frames per second, megabytes per second and heap allocations per frame.");
+    parser.Prog(argv[0]);
+    args::ValueFlag<size_t> frames(parser, "frames",
+        "Number of frames processed by every benchmark. Default value is 100.",
+        { 'n', "frames" });
+    args::ValueFlag<std::string> filter(parser, "name",
+        "Run only benchmarks whose name contains given string, e.g. \"filter.mask\" or \"codec\".",
+        { "filter" });
+    args::ValueFlag<std::string> examples(parser, "folder",
+        "Folder with example datasets, every subfolder is one dataset. Default value is \"examples\", "
+        "it is skipped if it does not exist.",
+        { "examples" });
+    args::HelpFlag help(parser, "help", "Display this help menu", { 'h', "help" });
+
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (const args::Help &) {
+        std::cout << parser;
+        return 0;
+    }
+    catch (const args::Error & e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    fs::path tmp = fs::temp_directory_path() /
+        ("hranol_bench_" + to_string(Clock::now().time_since_epoch().count()));
+
+    try {
+        fs::create_directories(tmp);
+        Bench bench(frames ? max< size_t>(1, args::get(frames)) : 100, filter ? args::get(filter) : "", tmp);
+
+        for (auto&& g : { Geometry{ 640, 480, CV_8U }, Geometry{ 1280, 1024, CV_8U },
+            Geometry{ 2560, 2048, CV_8U }, Geometry{ 1280, 1024, CV_16U } })
+            bench.synthetic(g);
+
+        fs::path examples_folder = examples ? args::get(examples) : "examples";
+        if (fs::is_directory(examples_folder))
+            bench.examples(examples_folder);
+    }
+    catch (std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        std::error_code ec;
+        fs::remove_all(tmp, ec);
+        return 1;
+    }
+
+    std::error_code ec;
+    fs::remove_all(tmp, ec);
+    return 0;
+}
@@ -0,0 +1,70 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "opencv2/core/core.hpp"
+
+#include <exception>
+#include <iostream>
+
+// Minimal checks for the tests, no test framework is needed. A failed check prints its location
+// and the test goes on, run_tests returns the exit code of the test.
+
+inline int & check_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++check_failures(); \
+        } \
+    } while (0)
+
+#define CHECK_THROWS(expr) \
+    do { \
+        bool thrown = false; \
+        try { expr; } \
+        catch (const std::exception &) { thrown = true; } \
+        if (!thrown) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": no exception thrown by: " #expr << std::endl; \
+            ++check_failures(); \
+        } \
+    } while (0)
+
+// Returns true if a and b have the same size, type and pixels
+inline bool same_img(const cv::Mat & a, const cv::Mat & b)
+{
+    if (a.size() != b.size() || a.type() != b.type())
+        return false;
+    return a.empty() || cv::norm(a, b, cv::NORM_INF) == 0;
+}
+
+// Runs the tests, an exception fails the test it was thrown from
+template< typename... Tests>
+int run_tests(Tests... tests)
+{
+    auto run = [](void (*test)()) {
+        try {
+            test();
+        }
+        catch (const std::exception & e) {
+            std::cerr << "Unexpected exception: " << e.what() << std::endl;
+            ++check_failures();
+        }
+    };
+    (run(tests), ...);
+
+    if (check_failures() != 0)
+        std::cerr << check_failures() << " check(s) failed" << std::endl;
+    return check_failures() == 0 ? 0 : 1;
+}
+
+#endif // CHECK_H
@@ -0,0 +1,78 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "Accumulator.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace
+{
+    // Offsets in the data written by Accumulator::save
+    const size_t COUNT = 0, DEPTH = 8, TYPE = 12, ROWS = 16;
+
+    // Saved accumulator of two 8-bit images of 3 x 2 pixels
+    string saved()
+    {
+        Accumulator acc;
+        acc.add(cv::Mat(2, 3, CV_8UC1, cv::Scalar(10)));
+        acc.add(cv::Mat(2, 3, CV_8UC1, cv::Scalar(30)));
+        ostringstream out;
+        acc.save(out);
+        return out.str();
+    }
+
+    template< typename T>
+    string patched(string data, size_t offset, T val)
+    {
+        memcpy(&data[offset], &val, sizeof(T));
+        return data;
+    }
+
+    bool loads(const string & data)
+    {
+        Accumulator acc;
+        istringstream in(data);
+        return acc.load(in);
+    }
+}
+
+void test_round_trip()
+{
+    Accumulator acc;
+    istringstream in(saved());
+    CHECK(acc.load(in));
+    CHECK(acc.count() == 2 && acc.depth() == CV_8U);
+    CHECK(same_img(acc.factored_mean(1.0, CV_8U), cv::Mat(2, 3, CV_8UC1, cv::Scalar(20))));
+
+    ostringstream empty;
+    Accumulator().save(empty);
+    CHECK(loads(empty.str()));
+}
+
+// Corrupt data are rejected before anything is allocated for them
+void test_rejects_corrupt_data()
+{
+    string data = saved();
+    CHECK(!loads(data.substr(0, data.size() - 1)));
+    CHECK(!loads(patched< int32_t>(data, DEPTH, CV_32F)));
+    CHECK(!loads(patched< int32_t>(data, TYPE, 12345678)));
+    CHECK(!loads(patched< int32_t>(data, TYPE, CV_8UC1)));
+    CHECK(!loads(patched< int32_t>(data, ROWS, INT32_MAX)));
+    // A 16-bit sum can't hold a million 8-bit images
+    CHECK(!loads(patched< uint64_t>(data, COUNT, 1000000)));
+}
+
+int main()
+{
+    return run_tests(test_round_trip, test_rejects_corrupt_data);
+}
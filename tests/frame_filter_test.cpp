@@ -0,0 +1,179 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "Filter.h"
+#include "FrameFilter.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    // Collects copies of filtered frames by their index
+    struct Collector
+    {
+        map< size_t, cv::Mat> frames;
+
+        FrameFilter::Callback callback() {
+            return [this](size_t i, const cv::Mat & frame) { frames[i] = frame.clone(); };
+        }
+    };
+
+    cv::Mat frame(int value)
+    {
+        return cv::Mat(4, 6, CV_8UC1, cv::Scalar(value));
+    }
+
+    cv::Mat contrast(cv::Mat img, int beg, int end)
+    {
+        ContrastFilter(beg, end).apply_to(img);
+        return img;
+    }
+}
+
+// A single filter is not fused, every filter is applied on its own without recorded stats
+void test_push_unfused()
+{
+    FilterChainConfig config;
+    config.rescale = true;
+    config.rescale_begin = 10;
+    config.rescale_end = 100;
+
+    Collector out;
+    FrameFilter filter(config, out.callback());
+    filter.push(frame(50));
+    filter.push(vector< cv::Mat>{ frame(5), frame(200) });
+
+    CHECK(filter.pushed() == 3);
+    CHECK(out.frames.size() == 3);
+    CHECK(same_img(out.frames[0], contrast(frame(50), 10, 100)));
+    CHECK(same_img(out.frames[1], contrast(frame(5), 10, 100)));
+    CHECK(same_img(out.frames[2], contrast(frame(200), 10, 100)));
+}
+
+// Running background with the contrast filter after it, the contrast filter is unfused
+void test_push_running_unfused()
+{
+    FilterChainConfig config;
+    config.subtract = true;
+    config.running = true;
+    config.rescale = true;
+    config.rescale_begin = 0;
+    config.rescale_end = 100;
+
+    Collector out;
+    FrameFilter filter(config, out.callback(), 2);
+    filter.push(frame(40));
+    filter.push(frame(60));
+
+    // Mean of the frames so far is subtracted: 40 - 40 and 60 - 50
+    CHECK(out.frames.size() == 2);
+    CHECK(same_img(out.frames[0], contrast(frame(0), 0, 100)));
+    CHECK(same_img(out.frames[1], contrast(frame(10), 0, 100)));
+}
+
+// Indices continue over pushes, frames given by pointer are filtered in the caller's buffer
+void test_push_in_place()
+{
+    FilterChainConfig config;
+    config.rescale = true;
+    config.rescale_begin = 0;
+    config.rescale_end = 127;
+
+    vector< size_t> indices;
+    FrameFilter filter(config, [&indices](size_t i, const cv::Mat &) { indices.push_back(i); });
+
+    filter.push(frame(1));
+    vector< unsigned char> buf(4 * 6, 64);
+    filter.push(buf.data(), 4, 6, CV_8UC1, 6);
+    filter.push(frame(2));
+
+    CHECK((indices == vector< size_t>{ 0, 1, 2 }));
+    cv::Mat filtered(4, 6, CV_8UC1, buf.data());
+    CHECK(same_img(filtered, contrast(frame(64), 0, 127)));
+}
+
+// Background of all frames can't be computed from frames as they arrive
+void test_push_rejects_precomputation()
+{
+    FilterChainConfig config;
+    config.subtract = true;
+
+    FrameFilter filter(config, [](size_t, const cv::Mat &) {});
+    CHECK_THROWS(filter.push(frame(1)));
+    CHECK(filter.pushed() == 0);
+}
+
+// A complete sequence gets the background of all its frames
+void test_filter_sequence()
+{
+    FilterChainConfig config;
+    config.subtract = true;
+
+    Collector out;
+    FrameFilter filter(config, out.callback(), 2);
+    filter.filter(vector< cv::Mat>{ frame(10), frame(20), frame(30) });
+
+    CHECK(out.frames.size() == 3);
+    CHECK(same_img(out.frames[0], frame(0)));
+    CHECK(same_img(out.frames[1], frame(0)));
+    CHECK(same_img(out.frames[2], frame(10)));
+}
+
+// Sliding window of radius 1: mean of the frame and its neighbours, truncated at both ends.
+// The spike must leave the window again, frames 4 to 6 see only the flat background.
+void test_filter_window()
+{
+    FilterChainConfig config;
+    config.subtract = true;
+    config.subtraction_factor = 0.5;
+    config.window_radius = 1;
+
+    for (unsigned threads : { 1u, 3u })
+    {
+        Collector out;
+        FrameFilter filter(config, out.callback(), threads);
+        filter.filter(vector< cv::Mat>{ frame(40), frame(40), frame(100), frame(40), frame(40), frame(40), frame(40) });
+
+        // Window means 40, 60, 60, 60, 40, 40, 40, halved
+        vector< int> expected = { 20, 10, 70, 10, 20, 20, 20 };
+        CHECK(out.frames.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+            CHECK(same_img(out.frames[i], frame(expected[i])));
+    }
+}
+
+// Filters after the window get the frames with the window mean subtracted
+void test_filter_window_then_contrast()
+{
+    FilterChainConfig config;
+    config.subtract = true;
+    config.window_radius = 2;
+    config.rescale = true;
+    config.rescale_begin = 0;
+    config.rescale_end = 100;
+
+    Collector out;
+    FrameFilter filter(config, out.callback(), 2);
+    filter.filter(vector< cv::Mat>{ frame(10), frame(20), frame(90), frame(20), frame(10) });
+
+    // Window means 40, 35, 30, 35, 40
+    vector< int> expected = { 0, 0, 60, 0, 0 };
+    CHECK(out.frames.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+        CHECK(same_img(out.frames[i], contrast(frame(expected[i]), 0, 100)));
+}
+
+int main()
+{
+    return run_tests(test_push_unfused, test_push_running_unfused, test_push_in_place,
+        test_push_rejects_precomputation, test_filter_sequence, test_filter_window,
+        test_filter_window_then_contrast);
+}
@@ -0,0 +1,134 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "ContainerImageStore.h"
+#include "RawStack.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const fs::path DIR = fs::temp_directory_path() / "hranol_raw_stack_test";
+
+    // Header of count frames of 4 x 3 8-bit pixels stored right after the header
+    RawStackHeader header(uint64_t count)
+    {
+        RawStackHeader h;
+        h.width = 4;
+        h.height = 3;
+        h.type = CV_8UC1;
+        h.frame_count = count;
+        h.frame_stride = 12;
+        return h;
+    }
+
+    // Writes stack with given header followed by data_bytes bytes, byte j has value j
+    fs::path write_stack(const RawStackHeader & h, size_t data_bytes)
+    {
+        vector< unsigned char> data(RawStackHeader::SIZE + data_bytes);
+        h.write(data.data());
+        for (size_t j = 0; j < data_bytes; ++j)
+            data[RawStackHeader::SIZE + j] = (unsigned char) j;
+
+        fs::path path = DIR / "frames.bin";
+        ofstream out(path, ofstream::binary | ofstream::trunc);
+        out.write((const char *) data.data(), (streamsize) data.size());
+        return path;
+    }
+
+    void open_stack(const fs::path & path)
+    {
+        RawStackImageStore store(DIR / "out", path);
+    }
+}
+
+// Frames lie frame_stride bytes apart after the data offset
+void test_valid_stack()
+{
+    RawStackHeader h = header(2);
+    h.frame_stride = 16;
+    RawStackImageStore store(DIR / "out", write_stack(h, 16 + 12));
+
+    CHECK(store.size() == 2);
+    const cv::Mat & frame = store.load(1);
+    CHECK(frame.rows == 3 && frame.cols == 4 && frame.type() == CV_8UC1);
+    CHECK(frame.ptr(0)[0] == 16 && frame.ptr(2)[3] == 27);
+    store.release(1);
+}
+
+void test_rejects_invalid_header()
+{
+    // Not even a header
+    {
+        ofstream out(DIR / "short.bin", ofstream::binary | ofstream::trunc);
+        out << "HRNLSTK1";
+    }
+    CHECK_THROWS(open_stack(DIR / "short.bin"));
+
+    // Wrong magic
+    {
+        ofstream out(DIR / "magic.bin", ofstream::binary | ofstream::trunc);
+        out << string(RawStackHeader::SIZE + 12, 'x');
+    }
+    CHECK_THROWS(open_stack(DIR / "magic.bin"));
+
+    RawStackHeader h = header(1);
+    h.type = CV_32FC1;
+    CHECK_THROWS(open_stack(write_stack(h, 48)));
+
+    h = header(1);
+    h.width = 0;
+    CHECK_THROWS(open_stack(write_stack(h, 12)));
+
+    h = header(1);
+    h.width = (uint32_t) INT_MAX + 1;
+    h.frame_stride = UINT64_MAX;
+    CHECK_THROWS(open_stack(write_stack(h, 12)));
+
+    h = header(1);
+    h.frame_stride = 11;
+    CHECK_THROWS(open_stack(write_stack(h, 12)));
+}
+
+void test_rejects_truncated_stack()
+{
+    // Last frame is missing a byte
+    CHECK_THROWS(open_stack(write_stack(header(2), 23)));
+
+    // Data start after the end of the file
+    RawStackHeader h = header(1);
+    h.data_offset = 1000;
+    CHECK_THROWS(open_stack(write_stack(h, 12)));
+
+    // Offset of the last frame wraps around 64 bits and would point into the file
+    h = header(((uint64_t) 1 << 62) + 1);
+    h.frame_stride = (uint64_t) 1 << 2;
+    h.width = 2;
+    h.height = 2;
+    CHECK_THROWS(open_stack(write_stack(h, 12)));
+
+    // Same with a huge stride, the third frame would wrap to the start of the file
+    h = header(3);
+    h.frame_stride = (uint64_t) 1 << 63;
+    CHECK_THROWS(open_stack(write_stack(h, 24)));
+}
+
+int main()
+{
+    fs::create_directories(DIR);
+    int ret = run_tests(test_valid_stack, test_rejects_invalid_header, test_rejects_truncated_stack);
+    fs::remove_all(DIR);
+    return ret;
+}
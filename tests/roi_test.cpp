@@ -0,0 +1,132 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "Filter.h"
+#include "FrameFilter.h"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <filesystem>
+#include <map>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const fs::path DIR = fs::temp_directory_path() / "hranol_roi_test";
+
+    // Frame of 6 rows and 8 columns, pixel (r, c) has value 10 * r + c + offset, so that
+    // misplaced pixels are told apart
+    cv::Mat frame(int offset)
+    {
+        cv::Mat ret(6, 8, CV_8UC1);
+        for (int r = 0; r < ret.rows; ++r)
+            for (int c = 0; c < ret.cols; ++c)
+                ret.ptr(r)[c] = (uchar) (10 * r + c + offset);
+        return ret;
+    }
+
+    struct Collector
+    {
+        map< size_t, cv::Mat> frames;
+
+        FrameFilter::Callback callback() {
+            return [this](size_t i, const cv::Mat & frame) { frames[i] = frame.clone(); };
+        }
+    };
+}
+
+// Only the region is filtered, the background is computed from the regions of all frames
+void test_roi_background()
+{
+    FilterChainConfig config;
+    config.roi = cv::Rect(2, 1, 3, 2);
+    config.subtract = true;
+
+    Collector out;
+    FrameFilter filter(config, out.callback());
+    filter.filter(vector< cv::Mat>{ frame(1), frame(21) });
+
+    // Mean is frame(11), so the first frame is clipped to 0 and the second one is 10 everywhere
+    CHECK(out.frames.size() == 2);
+    CHECK(same_img(out.frames[0], cv::Mat(2, 3, CV_8UC1, cv::Scalar(0))));
+    CHECK(same_img(out.frames[1], cv::Mat(2, 3, CV_8UC1, cv::Scalar(10))));
+}
+
+// Cropped to the bounding box of the mask, the mask is cropped the same way as the frames
+void test_crop_to_mask()
+{
+    cv::Mat mask(6, 8, CV_8UC1, cv::Scalar(0));
+    mask(cv::Rect(2, 1, 3, 2)) = cv::Scalar(255);
+    mask.ptr(1)[3] = 0;
+    fs::path mask_file = DIR / "mask.png";
+    CHECK(cv::imwrite(mask_file.string(), mask));
+
+    FilterChainConfig config;
+    config.mask_file = mask_file.string();
+    config.crop_to_mask = true;
+
+    Collector out;
+    FrameFilter filter(config, out.callback());
+    filter.filter(vector< cv::Mat>{ frame(1) });
+
+    cv::Mat expected = frame(1)(cv::Rect(2, 1, 3, 2)).clone();
+    expected.ptr(0)[1] = 0;
+    CHECK(out.frames.size() == 1);
+    CHECK(same_img(out.frames[0], expected));
+}
+
+// Region must lie within the frames
+void test_roi_outside_frame()
+{
+    FilterChainConfig config;
+    config.roi = cv::Rect(6, 0, 4, 2);
+    config.rescale = true;
+
+    FrameFilter filter(config, [](size_t, const cv::Mat &) {});
+    CHECK_THROWS(filter.filter(vector< cv::Mat>{ frame(1) }));
+}
+
+// Background file records the region, it can't be used with another one of the same size
+void test_background_region()
+{
+    cv::Rect roi(2, 1, 3, 2);
+    BckgSubFilter bckg(1.0);
+    bckg.precomp_from(frame(1)(roi).clone());
+    bckg.finish_precomp();
+
+    fs::path path = DIR / "roi.bckg";
+    bckg.save_background(path, roi);
+
+    CHECK(BckgSubFilter::load_background(path, CV_8U, roi)->count() == 1);
+    CHECK_THROWS(BckgSubFilter::load_background(path, CV_8U, cv::Rect(0, 0, 3, 2)));
+    CHECK_THROWS(BckgSubFilter::load_background(path, CV_8U, cv::Rect()));
+
+    FilterChainConfig config;
+    config.roi = roi;
+    config.subtract = true;
+    config.background_file = path.string();
+
+    Collector out;
+    FrameFilter filter(config, out.callback());
+    filter.filter(vector< cv::Mat>{ frame(3) });
+    CHECK(out.frames.size() == 1);
+    CHECK(same_img(out.frames[0], cv::Mat(2, 3, CV_8UC1, cv::Scalar(2))));
+
+    config.roi = cv::Rect(3, 1, 3, 2);
+    CHECK_THROWS(FrameFilter(config, [](size_t, const cv::Mat &) {}));
+}
+
+int main()
+{
+    fs::create_directories(DIR);
+    int ret = run_tests(test_roi_background, test_crop_to_mask, test_roi_outside_frame, test_background_region);
+    fs::remove_all(DIR);
+    return ret;
+}
@@ -0,0 +1,135 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "FolderCrawler.h"
+#include "ImageStore.h"
+#include "RunManifest.h"
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const fs::path DIR = fs::temp_directory_path() / "hranol_run_manifest_test";
+
+    const vector< string> CONFIG_A = { "Background subtraction with factor 1.000000" };
+    const vector< string> CONFIG_B = { "Background subtraction with factor 2.000000" };
+
+    // Inputs are only examined, not decoded, so any content will do
+    void write_file(const fs::path & path, const string & content)
+    {
+        ofstream out(path, ofstream::binary | ofstream::trunc);
+        out << content;
+    }
+
+    // Store of files a.png and b.png in DIR/in, filtered into dest
+    OnDemandImageStore store(const fs::path & dest)
+    {
+        return OnDemandImageStore(DIR / "in", dest, { DIR / "in" / "a.png", DIR / "in" / "b.png" });
+    }
+
+    // Records a run of config into dest, with all inputs done
+    void write_run(const fs::path & dest, const vector< string> & config)
+    {
+        fs::create_directories(dest);
+        auto st = store(dest);
+        RunManifest manifest(&st, config);
+        manifest.start(vector< char>(st.size(), 0), false);
+        for (size_t i = 0; i < st.size(); ++i)
+            manifest.mark_done(i);
+        manifest.mark_complete();
+    }
+}
+
+void test_matches()
+{
+    fs::path dest = DIR / "matches";
+    CHECK(!RunManifest::matches(dest, CONFIG_A));
+
+    write_run(dest, CONFIG_A);
+    CHECK(RunManifest::matches(dest, CONFIG_A));
+    CHECK(!RunManifest::matches(dest, CONFIG_B));
+    CHECK(!RunManifest::matches(dest, {}));
+}
+
+// Only folders whose manifest has the same configuration are resumed, the newest of them wins
+void test_find_subfolder_dest()
+{
+    fs::path cur = DIR / "dests";
+    fs::create_directories(cur);
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", nullptr) == cur / "fltrd_run");
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", &CONFIG_A) == cur / "fltrd_run");
+
+    write_run(cur / "fltrd_run", CONFIG_A);
+    write_run(cur / "fltrd00_run", CONFIG_B);
+    write_run(cur / "fltrd01_run", CONFIG_A);
+    // Output without a manifest is never resumed
+    fs::create_directories(cur / "fltrd02_run");
+
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", nullptr) == cur / "fltrd03_run");
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", &CONFIG_A) == cur / "fltrd01_run");
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", &CONFIG_B) == cur / "fltrd00_run");
+    vector< string> other = { "Mask image.png" };
+    CHECK(find_subfolder_dest(cur, "run", "fltrd", &other) == cur / "fltrd03_run");
+}
+
+// Inputs done by the previous run are kept unless they changed or can't be examined
+void test_done_inputs()
+{
+    fs::path dest = DIR / "done";
+    write_run(dest, CONFIG_A);
+
+    {
+        auto st = store(dest);
+        RunManifest manifest(&st, CONFIG_A);
+        CHECK(manifest.load());
+        CHECK(manifest.inputs_unchanged());
+        CHECK(manifest.done(0) && manifest.done(1));
+    }
+
+    {
+        auto st = store(dest);
+        RunManifest manifest(&st, CONFIG_B);
+        CHECK(!manifest.load());
+    }
+
+    write_file(DIR / "in" / "b.png", "changed content");
+    {
+        auto st = store(dest);
+        RunManifest manifest(&st, CONFIG_A);
+        CHECK(manifest.load());
+        CHECK(!manifest.inputs_unchanged());
+        CHECK(manifest.done(0) && !manifest.done(1));
+    }
+
+    // Missing input is recorded as unknown and never matches, not even the unknown record
+    fs::remove(DIR / "in" / "b.png");
+    write_run(dest, CONFIG_A);
+    {
+        auto st = store(dest);
+        RunManifest manifest(&st, CONFIG_A);
+        CHECK(manifest.load());
+        CHECK(!manifest.inputs_unchanged());
+        CHECK(manifest.done(0) && !manifest.done(1));
+    }
+}
+
+int main()
+{
+    fs::remove_all(DIR);
+    fs::create_directories(DIR / "in");
+    write_file(DIR / "in" / "a.png", "a");
+    write_file(DIR / "in" / "b.png", "b");
+
+    int ret = run_tests(test_matches, test_find_subfolder_dest, test_done_inputs);
+    fs::remove_all(DIR);
+    return ret;
+}
@@ -0,0 +1,117 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "OutputSink.h"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const fs::path DIR = fs::temp_directory_path() / "hranol_tiff_stack_sink_test";
+
+    // Page of 4 rows and 300 columns. Left half of every row is constant and the right half
+    // changes with every pixel, so that PackBits writes both repeated and literal runs, longer
+    // than the 128 bytes of a single run.
+    cv::Mat page(int type, int offset)
+    {
+        cv::Mat ret(4, 300, type);
+        for (int r = 0; r < ret.rows; ++r)
+            for (int c = 0; c < ret.cols; ++c)
+            {
+                int val = (c < 150) ? 7 * r + offset : c * 211 + r + offset;
+                if (type == CV_8UC1)
+                    ret.at< uchar>(r, c) = (uchar) val;
+                else
+                    ret.at< ushort>(r, c) = (ushort) val;
+            }
+        return ret;
+    }
+
+    // Reads all pages of the stack in their native depth
+    vector< cv::Mat> read_stack(const fs::path & path)
+    {
+        vector< cv::Mat> ret;
+        CHECK(cv::imreadmulti(path.string(), ret, cv::ImreadModes::IMREAD_ANYDEPTH));
+        return ret;
+    }
+
+    void check_stack(int type, bool packbits)
+    {
+        fs::path path = DIR / "frames.tif";
+        vector< cv::Mat> pages;
+        for (int i = 0; i < 4; ++i)
+            pages.push_back(page(type, i));
+
+        {
+            TiffStackSink sink(path, pages.size(), packbits);
+            for (size_t i : { 2, 0, 3, 1 })
+                sink.write(i, pages[i], "frame_" + to_string(i) + ".png");
+            sink.finish();
+        }
+
+        auto read = read_stack(path);
+        CHECK(read.size() == pages.size());
+        for (size_t i = 0; i < read.size() && i < pages.size(); ++i)
+            CHECK(same_img(read[i], pages[i]));
+    }
+}
+
+// Pages arriving out of order end up in the stack in the order of their indices
+void test_8bit()
+{
+    check_stack(CV_8UC1, false);
+    check_stack(CV_8UC1, true);
+}
+
+void test_16bit()
+{
+    check_stack(CV_16UC1, false);
+    check_stack(CV_16UC1, true);
+}
+
+// Pages that were never written are left out, as after a failed run
+void test_missing_pages()
+{
+    fs::path path = DIR / "partial.tif";
+    cv::Mat first = page(CV_8UC1, 1), third = page(CV_8UC1, 3);
+    {
+        TiffStackSink sink(path, 4, true);
+        sink.write(2, third, "frame_2.png");
+        sink.write(0, first, "frame_0.png");
+        // Directories are written by the destructor
+    }
+
+    auto read = read_stack(path);
+    CHECK(read.size() == 2);
+    if (read.size() == 2)
+    {
+        CHECK(same_img(read[0], first));
+        CHECK(same_img(read[1], third));
+    }
+}
+
+void test_rejects_unsupported_images()
+{
+    TiffStackSink sink(DIR / "unsupported.tif", 2, false);
+    CHECK_THROWS(sink.write(0, cv::Mat(2, 2, CV_32FC1, cv::Scalar(0)), "float.png"));
+    CHECK_THROWS(sink.write(1, cv::Mat(2, 2, CV_8UC3, cv::Scalar(0)), "color.png"));
+}
+
+int main()
+{
+    fs::create_directories(DIR);
+    int ret = run_tests(test_8bit, test_16bit, test_missing_pages, test_rejects_unsupported_images);
+    fs::remove_all(DIR);
+    return ret;
+}
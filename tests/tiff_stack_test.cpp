@@ -0,0 +1,121 @@
+//
+// Copyright © 2018 Roman Sobkuliak <r.sobkuliak@gmail.com>
+// This code is released under the license described in the LICENSE file
+//
+
+#include "Check.h"
+#include "ContainerImageStore.h"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include <filesystem>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace
+{
+    const fs::path DIR = fs::temp_directory_path() / "hranol_tiff_stack_test";
+
+    // Page of 5 rows and 7 columns, pixel (r, c) has value scale * (10 * r + c) + offset, so
+    // that both pages and pixels are told apart
+    cv::Mat page(int type, int offset, int scale)
+    {
+        cv::Mat ret(5, 7, type);
+        for (int r = 0; r < ret.rows; ++r)
+            for (int c = 0; c < ret.cols; ++c)
+            {
+                int val = scale * (10 * r + c) + offset;
+                if (type == CV_8UC1)
+                    ret.at< uchar>(r, c) = (uchar) val;
+                else
+                    ret.at< ushort>(r, c) = (ushort) val;
+            }
+        return ret;
+    }
+
+    vector< cv::Mat> write_stack(const fs::path & path, int type, size_t count, int scale)
+    {
+        vector< cv::Mat> pages;
+        for (size_t i = 0; i < count; ++i)
+            pages.push_back(page(type, (int) i, scale));
+        CHECK(cv::imwrite(path.string(), pages));
+        return pages;
+    }
+}
+
+// Pages are read in any order, also going back to the pages the decoder has passed already
+void test_pages_out_of_order()
+{
+    fs::path path = DIR / "frames8.tif";
+    auto pages = write_stack(path, CV_8UC1, 5, 1);
+
+    TiffStackImageStore store(DIR / "out", path);
+    CHECK(store.size() == pages.size());
+    CHECK(store.estimate_memory(2) > 0);
+
+    for (size_t i : { 3, 0, 4, 1, 2, 4 })
+    {
+        CHECK(same_img(store.load(i), pages[i]));
+        store.release(i);
+    }
+
+    // Several pages loaded at once
+    cv::Mat & second = store.load(2);
+    cv::Mat & first = store.load(1);
+    CHECK(same_img(first, pages[1]));
+    CHECK(same_img(second, pages[2]));
+    store.release(1);
+    store.release(2);
+}
+
+// 16-bit pages keep their depth only with any_depth, otherwise they are converted to 8 bits
+void test_16bit_pages()
+{
+    fs::path path = DIR / "frames16.tif";
+    // Pixels are multiples of 256 (plus the page index), so that both rounding and truncation
+    // to 8 bits give the same values
+    auto pages = write_stack(path, CV_16UC1, 3, 256);
+
+    TiffStackImageStore deep(DIR / "out", path);
+    deep.set_any_depth(true);
+    CHECK(deep.size() == 3);
+    for (size_t i : { 2, 0, 1 })
+    {
+        CHECK(same_img(deep.load(i), pages[i]));
+        deep.release(i);
+    }
+
+    TiffStackImageStore shallow(DIR / "out", path);
+    const cv::Mat & img = shallow.load(1);
+    cv::Mat expected;
+    pages[1].convertTo(expected, CV_8UC1, 1.0 / 256);
+    CHECK(same_img(img, expected));
+    shallow.release(1);
+}
+
+// Loaded pages hold only the region of interest
+void test_roi()
+{
+    fs::path path = DIR / "frames8.tif";
+    auto pages = write_stack(path, CV_8UC1, 4, 1);
+
+    cv::Rect roi(2, 1, 3, 2);
+    TiffStackImageStore store(DIR / "out", path);
+    store.set_roi(roi);
+    for (size_t i : { 3, 1 })
+    {
+        CHECK(same_img(store.load(i), pages[i](roi)));
+        store.release(i);
+    }
+}
+
+int main()
+{
+    fs::create_directories(DIR);
+    int ret = run_tests(test_pages_out_of_order, test_16bit_pages, test_roi);
+    fs::remove_all(DIR);
+    return ret;
+}